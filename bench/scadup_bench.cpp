@@ -0,0 +1,501 @@
+/*
+ * End-to-end broker benchmark: an in-process Broker, streaming Publishers and
+ * raw subscriber clients on loopback, delivered messages per second and the
+ * latency of every delivery, from the stamp a publish carries in its first
+ * 8 content bytes. Publisher i sends to topic i % topics, subscriber j reads
+ * topic j % topics.
+ * With -l it measures delivery latency instead: one Publisher paced at -r
+ * messages per second, one Subscriber, publish to callback percentiles.
+ *
+ *   scadup_bench [-w workers[,workers...]] [-p publishers] [-s subscribers]
+ *                [-t topics] [-n messages per publisher] [-b payload bytes[,bytes...]]
+ *                [-P port] [-z zero-copy threshold bytes] [-m shared memory bytes]
+ *                [-u unix socket path] [-v wire version] [-c] [-l] [-r rate] [-T] [-o text|json|csv]
+ * -r paces every publisher at that many messages per second. A paced publish is
+ * stamped with the time it was due rather than sent, so a stall counts against
+ * every publish it held up (coordinated omission); unpaced ones are stamped as
+ * sent. -l paces at 10000 without it.
+ * -o json prints one object per run and line, -o csv a header and a row per run,
+ * to keep and compare across releases.
+ * -m 0 keeps the local clients on TCP, to compare against shared memory.
+ * -v 1 keeps every client on the v1 frame, to compare against compact ones.
+ * -c seals every publish with a CRC32C the broker verifies, and with -l the
+ * Subscriber too, to compare against frames sent unchecked.
+ * -T with -l traces every publish and, with -o text, breaks the latency down
+ * by stage: publisher, broker, queue, network, dispatch.
+ * With -u every run is repeated with the clients on the broker's unix socket.
+ */
+#include "common/Scadup.h"
+#include "scadup/Wire.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace Scadup;
+
+namespace {
+    struct Options {
+        std::vector<unsigned int> workers{ 1 };
+        unsigned int publishers = 4;
+        unsigned int subscribers = 4;
+        unsigned int topics = 1;
+        unsigned int messages = 2000;
+        std::vector<unsigned int> sizes{ 64 };
+        size_t bytes = 64;
+        unsigned short port = 19999;
+        size_t zerocopy = 0;
+        long shared = -1; // broker default
+        uint8_t version = WIRE_VERSION;
+        bool checksum = false;
+        std::string unixPath{};
+        const char* address = "127.0.0.1"; // of the run, loopback or unixPath
+        uint32_t topic = 0x1234;
+        bool latency = false;
+        unsigned int rate = 0; // per publisher, 0 unpaced
+        bool trace = false;
+        std::string format{ "text" };
+    };
+
+    // one line of the report, latencies in us, set by summarize()
+    struct Result {
+        const char* mode;
+        unsigned int workers;
+        unsigned int publishers;
+        unsigned int subscribers;
+        unsigned int topics;
+        unsigned int rate;
+        size_t sent;
+        size_t delivered;
+        size_t expected;
+        double seconds;
+        double p50;
+        double p90;
+        double p99;
+        double p999;
+        double max;
+    };
+
+    const size_t STATUS_SIZE = sizeof(Message::Payload::status);
+    FILE* g_out = stdout;
+
+    // broker and client logs go to stdout, keep it for them and report elsewhere
+    void quiet()
+    {
+        int fd = dup(STDOUT_FILENO);
+        g_out = fdopen(fd, "w");
+        if (freopen("/dev/null", "w", stdout) == nullptr)
+            g_out = stderr;
+    }
+
+    bool sendAll(SOCKET sock, const char* data, size_t len)
+    {
+        while (len > 0) {
+            ssize_t sz = ::send(sock, data, len, MSG_NOSIGNAL);
+            if (sz <= 0) {
+                if (sz < 0 && errno == EINTR)
+                    continue;
+                return false;
+            }
+            data += sz;
+            len -= static_cast<size_t>(sz);
+        }
+        return true;
+    }
+
+    uint64_t nanos()
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    // the publish stamp at the start of the content, 0 if there is none
+    uint64_t stampOf(const char* content, size_t len)
+    {
+        uint64_t stamp = 0;
+        if (len >= sizeof(stamp))
+            memcpy(&stamp, content, sizeof(stamp));
+        return stamp;
+    }
+
+    void record(std::vector<uint64_t>& latencies, uint64_t stamp)
+    {
+        uint64_t now = nanos();
+        if (stamp > 0 && latencies.size() < latencies.capacity())
+            latencies.emplace_back(now > stamp ? now - stamp : 0);
+    }
+
+    void subscriber(const Options& opt, uint32_t topic, size_t expect, std::atomic<size_t>& ready,
+        std::atomic<size_t>& received, std::vector<uint64_t>& latencies)
+    {
+        uint64_t ssid = 0;
+        uint8_t version = 1;
+        SOCKET sock = socket2Broker(opt.address, opt.port, ssid, 3, SUBSCRIBER, &version);
+        if (sock < 0)
+            return;
+        Header head{};
+        head.flag = SUBSCRIBER;
+        head.ssid = ssid;
+        head.topic = topic;
+        char hello[Wire::PREFIX];
+        if (!sendAll(sock, hello, Wire::prefix(version, head, nullptr, hello))) {
+            Close(sock);
+            return;
+        }
+        timeval tv{ 5, 0 };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&tv), sizeof(tv));
+        latencies.reserve(expect);
+        ready++;
+        std::vector<char> buff(1 << 16);
+        size_t have = 0;
+        size_t count = 0;
+        while (count < expect) {
+            ssize_t got = ::recv(sock, buff.data() + have, buff.size() - have, 0);
+            if (got <= 0)
+                break;
+            have += static_cast<size_t>(got);
+            size_t off = 0;
+            while (version < 2 && have - off >= HEAD_SIZE) {
+                const auto* frame = reinterpret_cast<const Header*>(buff.data() + off);
+                if (frame->size < HEAD_SIZE || have - off < frame->size)
+                    break;
+                if (frame->size >= HEAD_SIZE + STATUS_SIZE)
+                    record(latencies, stampOf(buff.data() + off + HEAD_SIZE + STATUS_SIZE,
+                        frame->size - HEAD_SIZE - STATUS_SIZE));
+                off += frame->size;
+                count++;
+            }
+            while (version >= 2) {
+                Header frame{};
+                size_t body = 0;
+                bool status = false;
+                long used = Wire::decode(buff.data() + off, have - off, frame, body, status);
+                if (used <= 0 || have - off - static_cast<size_t>(used) < body)
+                    break;
+                size_t skip = status ? STATUS_SIZE : 0;
+                if (body >= skip)
+                    record(latencies, stampOf(buff.data() + off + used + skip, body - skip));
+                off += static_cast<size_t>(used) + body;
+                count++;
+            }
+            memmove(buff.data(), buff.data() + off, have - off);
+            have -= off;
+            if (have == buff.size())
+                buff.resize(buff.size() * 2);
+        }
+        received += count;
+        Close(sock);
+    }
+
+    void publisher(const Options& opt, uint32_t topic, std::atomic<size_t>& sent)
+    {
+        Publisher pub;
+        if (pub.setup(opt.address, opt.port) != 0)
+            return;
+        pub.setChecksum(opt.checksum);
+        std::string payload(std::max<size_t>(opt.bytes, sizeof(uint64_t)), 'x');
+        const uint64_t interval = (opt.rate > 0) ? 1000000000ull / opt.rate : 0;
+        uint64_t due = nanos();
+        for (unsigned int i = 0; i < opt.messages; ++i) {
+            uint64_t stamp = nanos();
+            if (interval > 0) {
+                if (due > stamp)
+                    std::this_thread::sleep_for(std::chrono::nanoseconds(due - stamp));
+                stamp = due;
+                due += interval;
+            }
+            memcpy(&payload[0], &stamp, sizeof(stamp));
+            if (pub.publish(topic, payload) > 0)
+                sent++;
+        }
+        pub.close();
+    }
+
+    const char* transport(const Options& opt)
+    {
+        return opt.address == opt.unixPath.c_str() ? "unix" : "tcp";
+    }
+
+    const char* checked(const Options& opt)
+    {
+        return opt.checksum ? " crc" : "";
+    }
+
+    // sorts the latencies into the percentiles of the result
+    void summarize(std::vector<uint64_t>& lat, Result& result)
+    {
+        std::sort(lat.begin(), lat.end());
+        auto pct = [&lat](double p) -> double {
+            if (lat.empty())
+                return 0;
+            size_t idx = std::min(lat.size() - 1, static_cast<size_t>(p * static_cast<double>(lat.size())));
+            return static_cast<double>(lat[idx]) / 1000.0;
+        };
+        result.p50 = pct(0.50);
+        result.p90 = pct(0.90);
+        result.p99 = pct(0.99);
+        result.p999 = pct(0.999);
+        result.max = lat.empty() ? 0.0 : static_cast<double>(lat.back()) / 1000.0;
+    }
+
+    void report(const Options& opt, const Result& res)
+    {
+        const size_t bytes = std::max<size_t>(opt.bytes, sizeof(uint64_t));
+        const double rate = (res.seconds > 0) ? res.delivered / res.seconds : 0;
+        if (opt.format == "json") {
+            fprintf(g_out, "{\"mode\":\"%s\",\"transport\":\"%s\",\"version\":%u,\"checksum\":%s,"
+                "\"workers\":%u,\"publishers\":%u,\"subscribers\":%u,\"topics\":%u,\"bytes\":%zu,"
+                "\"rate\":%u,\"sent\":%zu,\"delivered\":%zu,\"expected\":%zu,\"seconds\":%.3f,"
+                "\"msgs_per_sec\":%.0f,\"mb_per_sec\":%.2f,\"latency_us\":{\"p50\":%.1f,\"p90\":%.1f,"
+                "\"p99\":%.1f,\"p999\":%.1f,\"max\":%.1f}}\n",
+                res.mode, transport(opt), opt.version, opt.checksum ? "true" : "false", res.workers,
+                res.publishers, res.subscribers, res.topics, bytes, res.rate, res.sent, res.delivered,
+                res.expected, res.seconds, rate, rate * bytes / 1e6, res.p50, res.p90, res.p99, res.p999, res.max);
+        } else if (opt.format == "csv") {
+            static bool header = false;
+            if (!header) {
+                fprintf(g_out, "mode,transport,version,checksum,workers,publishers,subscribers,topics,bytes,rate,"
+                    "sent,delivered,expected,seconds,msgs_per_sec,mb_per_sec,p50_us,p90_us,p99_us,p999_us,max_us\n");
+                header = true;
+            }
+            fprintf(g_out, "%s,%s,%u,%d,%u,%u,%u,%u,%zu,%u,%zu,%zu,%zu,%.3f,%.0f,%.2f,%.1f,%.1f,%.1f,%.1f,%.1f\n",
+                res.mode, transport(opt), opt.version, opt.checksum ? 1 : 0, res.workers, res.publishers,
+                res.subscribers, res.topics, bytes, res.rate, res.sent, res.delivered, res.expected, res.seconds,
+                rate, rate * bytes / 1e6, res.p50, res.p90, res.p99, res.p999, res.max);
+        } else if (strcmp(res.mode, "latency") == 0) {
+            fprintf(g_out, "%s v%u%s workers=%u rate=%u/s bytes=%zu delivered=%zu/%zu latency us p50=%.1f p90=%.1f "
+                "p99=%.1f p999=%.1f max=%.1f\n", transport(opt), opt.version, checked(opt),
+                res.workers, res.rate, bytes, res.delivered, res.expected, res.p50, res.p90, res.p99, res.p999, res.max);
+        } else {
+            fprintf(g_out, "%s v%u%s workers=%u publishers=%u subscribers=%u topics=%u bytes=%zu sent=%zu "
+                "delivered=%zu/%zu seconds=%.3f msgs/s=%.0f MB/s=%.2f\n", transport(opt), opt.version, checked(opt),
+                res.workers, res.publishers, res.subscribers, res.topics, bytes, res.sent, res.delivered,
+                res.expected, res.seconds, rate, rate * bytes / 1e6);
+            fprintf(g_out, "  latency us%s p50=%.1f p90=%.1f p99=%.1f p999=%.1f max=%.1f\n",
+                res.rate > 0 ? " (paced)" : "", res.p50, res.p90, res.p99, res.p999, res.max);
+            PoolStats pool = poolStats();
+            fprintf(g_out, "  pool hits=%zu refills=%zu misses=%zu oversize=%zu slabs=%zuKiB\n",
+                pool.hits, pool.refills, pool.misses, pool.oversize, pool.slabBytes / 1024);
+        }
+        fflush(g_out);
+    }
+
+    void run(const Options& opt, unsigned int workers)
+    {
+        Broker& broker = Broker::instance();
+        broker.setZeroCopy(opt.zerocopy);
+        if (opt.shared >= 0)
+            broker.setSharedMemory(static_cast<size_t>(opt.shared));
+        broker.setUnixSocket(opt.unixPath.c_str());
+        broker.setWireVersion(opt.version);
+        broker.setVerify(opt.checksum);
+        if (broker.setup(opt.port, workers) != 0) {
+            fprintf(g_out, "broker setup on port %u failed\n", opt.port);
+            return;
+        }
+        std::thread loop([&broker]() { broker.broker(); });
+
+        const unsigned int topics = std::max(1u, opt.topics);
+        size_t expect = 0;
+        std::atomic<size_t> ready{ 0 };
+        std::atomic<size_t> received{ 0 };
+        std::atomic<size_t> sent{ 0 };
+        std::vector<std::vector<uint64_t>> latencies(opt.subscribers);
+        std::vector<std::thread> subs;
+        for (unsigned int i = 0; i < opt.subscribers; ++i) {
+            unsigned int topic = i % topics;
+            // publishers of the topic, the first ones get one more when they do not divide evenly
+            size_t each = static_cast<size_t>(opt.publishers / topics + (topic < opt.publishers % topics ? 1 : 0))
+                * opt.messages;
+            expect += each;
+            subs.emplace_back(subscriber, std::cref(opt), opt.topic + topic, each, std::ref(ready),
+                std::ref(received), std::ref(latencies[i]));
+        }
+        while (ready < opt.subscribers) {
+            wait(Time100ms * 10);
+        }
+        // let the broker register the subscribe headers
+        wait(Time100ms * 1000);
+
+        auto begin = std::chrono::steady_clock::now();
+        std::vector<std::thread> pubs;
+        for (unsigned int i = 0; i < opt.publishers; ++i) {
+            pubs.emplace_back(publisher, std::cref(opt), opt.topic + i % topics, std::ref(sent));
+        }
+        for (auto& t : pubs) {
+            t.join();
+        }
+        for (auto& t : subs) {
+            t.join();
+        }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+        broker.exit();
+        loop.join();
+
+        std::vector<uint64_t> all;
+        for (auto& lat : latencies) {
+            all.insert(all.end(), lat.begin(), lat.end());
+            std::vector<uint64_t>().swap(lat);
+        }
+        Result result{ "throughput", workers, opt.publishers, opt.subscribers, topics, opt.rate, sent.load(), received.load(), expect, secs, 0, 0, 0, 0, 0 };
+        summarize(all, result);
+        report(opt, result);
+    }
+
+    void latency(const Options& opt, unsigned int workers)
+    {
+        Broker& broker = Broker::instance();
+        broker.setZeroCopy(opt.zerocopy);
+        if (opt.shared >= 0)
+            broker.setSharedMemory(static_cast<size_t>(opt.shared));
+        broker.setUnixSocket(opt.unixPath.c_str());
+        broker.setWireVersion(opt.version);
+        broker.setVerify(opt.checksum);
+        if (broker.setup(opt.port, workers) != 0) {
+            fprintf(g_out, "broker setup on port %u failed\n", opt.port);
+            return;
+        }
+        std::thread loop([&broker]() { broker.broker(); });
+
+        // filled on the receive thread, reserved up front
+        std::vector<uint64_t> latencies;
+        latencies.reserve(opt.messages);
+        TraceStats stages;
+        std::atomic<bool> done{ false };
+        Subscriber sub;
+        std::thread recv([&]() {
+            if (sub.setup(opt.address, opt.port) == 0) {
+                sub.subscribe(opt.topic, [&](const MessageView& msg) {
+                    if (strcmp(msg.data(), "end") == 0) {
+                        done = true;
+                        sub.quit();
+                    } else if (latencies.size() < latencies.capacity()) {
+                        latencies.emplace_back(nanos() - strtoull(msg.data(), nullptr, 10));
+                        if (msg.trace() != nullptr)
+                            stages.add(*msg.trace());
+                    }
+                });
+            }
+            done = true;
+        });
+        Publisher pub;
+        if (pub.setup(opt.address, opt.port) != 0) {
+            fprintf(g_out, "publisher setup failed\n");
+            Subscriber::exit();
+            recv.join();
+            broker.exit();
+            loop.join();
+            return;
+        }
+        pub.setChecksum(opt.checksum);
+        pub.setTrace(opt.trace);
+        // let the broker register the subscribe header
+        wait(Time100ms * 1000);
+
+        const unsigned int rate = (opt.rate > 0) ? opt.rate : 10000;
+        const uint64_t interval = 1000000000ull / rate;
+        uint64_t due = nanos();
+        char stamp[32];
+        std::string payload;
+        auto begin = std::chrono::steady_clock::now();
+        for (unsigned int i = 0; i < opt.messages; ++i) {
+            uint64_t now = nanos();
+            if (due > now)
+                std::this_thread::sleep_for(std::chrono::nanoseconds(due - now));
+            // when it was due: a late publish is not excused by the one that held it up
+            snprintf(stamp, sizeof(stamp), "%llu", static_cast<unsigned long long>(due));
+            due += interval;
+            payload.assign(stamp);
+            if (payload.size() < opt.bytes)
+                payload.append(opt.bytes - payload.size(), ' ');
+            pub.publish(opt.topic, payload);
+        }
+        double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+        pub.publish(opt.topic, "end");
+        for (int i = 0; i < 100 && !done; ++i) {
+            wait(Time100ms * 1000);
+        }
+        if (!done)
+            Subscriber::exit();
+        recv.join();
+        pub.close();
+        broker.exit();
+        loop.join();
+
+        Result result{ "latency", workers, 1, 1, 1, rate, opt.messages, latencies.size(), opt.messages, secs, 0, 0, 0, 0, 0 };
+        summarize(latencies, result);
+        report(opt, result);
+        if (opt.trace && opt.format == "text")
+            fprintf(g_out, "%s", stages.report().c_str());
+    }
+
+    std::vector<unsigned int> parseList(const char* arg)
+    {
+        std::vector<unsigned int> list;
+        std::string str(arg);
+        size_t pos = 0;
+        while (pos <= str.size()) {
+            size_t end = str.find(',', pos);
+            if (end == std::string::npos)
+                end = str.size();
+            if (end > pos)
+                list.emplace_back(static_cast<unsigned int>(atoi(str.substr(pos, end - pos).c_str())));
+            pos = end + 1;
+        }
+        return list;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    Options opt;
+    int ch;
+    while ((ch = getopt(argc, argv, "w:p:s:t:n:b:P:z:m:u:v:clr:To:h")) != -1) {
+        switch (ch) {
+        case 'w': opt.workers = parseList(optarg); break;
+        case 'p': opt.publishers = static_cast<unsigned int>(atoi(optarg)); break;
+        case 's': opt.subscribers = static_cast<unsigned int>(atoi(optarg)); break;
+        case 't': opt.topics = static_cast<unsigned int>(atoi(optarg)); break;
+        case 'n': opt.messages = static_cast<unsigned int>(atoi(optarg)); break;
+        case 'b': opt.sizes = parseList(optarg); break;
+        case 'P': opt.port = static_cast<unsigned short>(atoi(optarg)); break;
+        case 'z': opt.zerocopy = static_cast<size_t>(atol(optarg)); break;
+        case 'm': opt.shared = atol(optarg); break;
+        case 'u': opt.unixPath = optarg; break;
+        case 'v': opt.version = static_cast<uint8_t>(atoi(optarg)); break;
+        case 'c': opt.checksum = true; break;
+        case 'l': opt.latency = true; break;
+        case 'r': opt.rate = static_cast<unsigned int>(atoi(optarg)); break;
+        case 'T': opt.trace = true; break;
+        case 'o': opt.format = optarg; break;
+        default:
+            fprintf(stderr, "Usage: %s [-w workers[,workers...]] [-p publishers] [-s subscribers] [-t topics] "
+                "[-n messages] [-b bytes[,bytes...]] [-P port] [-z bytes] [-m bytes] [-u path] [-v version] [-c] [-l] "
+                "[-r rate] [-T] [-o text|json|csv]\n", argv[0]);
+            return ch == 'h' ? 0 : 1;
+        }
+    }
+    if (opt.format != "text" && opt.format != "json" && opt.format != "csv") {
+        fprintf(stderr, "Unknown output format %s.\n", opt.format.c_str());
+        return 1;
+    }
+    quiet();
+    std::vector<const char*> addresses{ "127.0.0.1" };
+    if (!opt.unixPath.empty())
+        addresses.emplace_back(opt.unixPath.c_str());
+    for (unsigned int bytes : opt.sizes) {
+        opt.bytes = bytes;
+        for (unsigned int workers : opt.workers) {
+            for (const char* address : addresses) {
+                opt.address = address;
+                if (opt.latency)
+                    latency(opt, workers);
+                else
+                    run(opt, workers);
+            }
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,889 @@
+/*
+ * Micro benchmarks of the building blocks under src/utils and src/common.
+ *
+ *   utils_bench [-t threads[,threads...]] [-n operations per thread] [-d dir]
+ *               [-f file] [-P port] [case...]
+ *
+ * cases:
+ *   mq    msg_que ring against the former mutex + linked list queue, every
+ *         thread pushes one item and takes one back (with mq_take, in batches
+ *         of 16, and with the single consumer mq_front + mq_pop at -t 1 only)
+ *   pool  Pool::alloc/free against malloc/free, batches of 64..4096 byte blocks
+ *   threadpool
+ *         4 workers running tasks submitted by the given number of threads,
+ *         work-stealing threadpool against the former single locked queue;
+ *         then the latency from enqueue to the task running, every thread
+ *         waiting for its task before submitting the next
+ *   writes
+ *         Scadup::writes of 64 and 4096 byte chunks, every thread to a socket
+ *         pair of its own drained by a reader, against the same loop of
+ *         send()s without the static mutex writes() serializes them on
+ *   file  FileUtils::GetFileStringContent against getStrFile2string on files
+ *         of 1, 16 and 64 MiB written to -f (default ./utils_bench.dat), page
+ *         cache warm; ignores -t. GetFileStringContent reads 16 MiB at most,
+ *         what follows is left zero
+ *   publish
+ *         Publisher::publish of 16..4096 byte payloads, v1 and v2, with and
+ *         without CRC32C, one Publisher per thread to an in-process broker on
+ *         -P (default 19998) without subscribers nor shared memory; first the
+ *         frame assembly alone (Message, Wire::seal, Wire::prefix)
+ *   log   sustained SegmentLog appends of 128 and 1024 byte records to a
+ *         log under -d (default ./utils_bench.log), without fdatasync, with
+ *         one every 1000 appends and with one per append; ignores -t
+ *   crc   Crc32c of 64..65536 byte messages on one core, the instruction
+ *         (when the CPU has it) against the slicing-by-8 tables; ignores -t
+ *   check known answers, no timing: the CRC32C of "123456789" both ways,
+ *         and Wire's varint length round-tripped at the 28-bit shift and
+ *         the UINT32_MAX frame size, malformed beyond; exits 1 on a mismatch
+ */
+#include "common/Scadup.h"
+#include <cstdio>
+#include <unistd.h>
+extern "C" {
+#include "utils/msg_que.h"
+}
+#include "scadup/Wire.h"
+#include "utils/Crc32c.h"
+#include "utils/FileUtils.h"
+#include "utils/Pool.h"
+#include "utils/SegmentLog.h"
+#include "utils/logging.h"
+#include "utils/threadpool.hpp"
+#include <algorithm>
+#include <dirent.h>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <queue>
+#include <sys/socket.h>
+
+namespace {
+    struct Options {
+        std::vector<unsigned int> threads{ 1, 2, 4, 8, 16 };
+        size_t operations = 1000000;
+        std::string dir = "utils_bench.log";
+        std::string file = "utils_bench.dat";
+        unsigned short port = 19998;
+    };
+
+    // the msg_que.c this ring replaced, kept to compare against
+    class ListQue {
+    public:
+        ListQue()
+        {
+            pthread_mutex_init(&m_mutex, nullptr);
+        }
+        ~ListQue()
+        {
+            while (m_head != nullptr) {
+                Node* n = m_head->next;
+                free(m_head);
+                m_head = n;
+            }
+            pthread_mutex_destroy(&m_mutex);
+        }
+        int push(void* x)
+        {
+            pthread_mutex_lock(&m_mutex);
+            auto* i = static_cast<Node*>(malloc(sizeof(Node)));
+            if (i == nullptr) {
+                pthread_mutex_unlock(&m_mutex);
+                return -2;
+            }
+            i->data = x;
+            i->next = nullptr;
+            if (m_tail == nullptr) {
+                m_head = m_tail = i;
+            } else {
+                m_tail->next = i;
+                m_tail = i;
+            }
+            pthread_mutex_unlock(&m_mutex);
+            return 0;
+        }
+        void* front()
+        {
+            pthread_mutex_lock(&m_mutex);
+            void* p = (m_head != nullptr) ? m_head->data : nullptr;
+            pthread_mutex_unlock(&m_mutex);
+            return p;
+        }
+        void pop()
+        {
+            pthread_mutex_lock(&m_mutex);
+            if (m_head != nullptr) {
+                Node* n = m_head->next;
+                free(m_head);
+                m_head = n;
+                if (m_head == nullptr)
+                    m_tail = nullptr;
+            }
+            pthread_mutex_unlock(&m_mutex);
+        }
+    private:
+        struct Node {
+            void* data;
+            Node* next;
+        };
+        Node* m_head = nullptr;
+        Node* m_tail = nullptr;
+        pthread_mutex_t m_mutex{};
+    };
+
+    // the threadpool.hpp this work-stealing pool replaced
+    class QueuePool {
+    public:
+        explicit QueuePool(size_t threads)
+        {
+            for (size_t i = 0; i < threads; ++i) {
+                m_workers.emplace_back([this] {
+                    for (;;) {
+                        std::function<void()> task;
+                        {
+                            std::unique_lock<std::mutex> lock(m_mutex);
+                            m_condition.wait(lock, [this] { return m_stop || !m_tasks.empty(); });
+                            if (m_stop && m_tasks.empty())
+                                return;
+                            task = std::move(m_tasks.front());
+                            m_tasks.pop();
+                        }
+                        task();
+                    }
+                    });
+            }
+        }
+        ~QueuePool()
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_stop = true;
+            }
+            m_condition.notify_all();
+            for (auto& t : m_workers) {
+                t.join();
+            }
+        }
+        template<class F, class... Args>
+        std::future<typename std::result_of<F(Args...)>::type> enqueue(F&& f, Args&&... args)
+        {
+            using return_type = typename std::result_of<F(Args...)>::type;
+            auto task = std::make_shared<std::packaged_task<return_type()>>(
+                std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+            std::future<return_type> fres = task->get_future();
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_tasks.emplace([task]() { (*task)(); });
+            }
+            m_condition.notify_one();
+            return fres;
+        }
+    private:
+        std::vector<std::thread> m_workers{};
+        std::queue<std::function<void()>> m_tasks{};
+        std::mutex m_mutex{};
+        std::condition_variable m_condition{};
+        bool m_stop = false;
+    };
+
+    const int BATCH = 16;
+
+    template <typename Task>
+    double measure(unsigned int threads, Task task)
+    {
+        std::atomic<bool> go{ false };
+        std::vector<std::thread> pool;
+        for (unsigned int i = 0; i < threads; ++i) {
+            pool.emplace_back([&go, &task, i]() {
+                while (!go.load(std::memory_order_acquire))
+                    std::this_thread::yield();
+                task(i);
+                });
+        }
+        auto begin = std::chrono::steady_clock::now();
+        go.store(true, std::memory_order_release);
+        for (auto& t : pool) {
+            t.join();
+        }
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+    }
+
+    void report(const char* name, unsigned int threads, size_t ops, double secs)
+    {
+        printf("%-16s threads=%-3u ops=%-10zu seconds=%.3f ops/s=%.0f\n", name, threads, ops, secs, ops / secs);
+        fflush(stdout);
+    }
+
+    uint64_t nanos()
+    {
+        return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count());
+    }
+
+    void reportLatency(const char* name, unsigned int threads, std::vector<uint64_t>& lat)
+    {
+        if (lat.empty())
+            return;
+        std::sort(lat.begin(), lat.end());
+        auto pct = [&lat](double p) {
+            return static_cast<double>(lat[std::min(lat.size() - 1, static_cast<size_t>(p * lat.size()))]) / 1000.0;
+        };
+        printf("%-16s threads=%-3u ops=%-10zu latency us p50=%.1f p99=%.1f p999=%.1f max=%.1f\n", name, threads,
+            lat.size(), pct(0.50), pct(0.99), pct(0.999), static_cast<double>(lat.back()) / 1000.0);
+        fflush(stdout);
+    }
+
+    void benchMq(const Options& opt)
+    {
+        const size_t n = opt.operations;
+        for (unsigned int threads : opt.threads) {
+            // one push and one take per iteration
+            const size_t ops = 2 * n * threads;
+            {
+                ListQue list;
+                double secs = measure(threads, [&list, n](unsigned int id) {
+                    void* item = reinterpret_cast<void*>(static_cast<uintptr_t>(id + 1));
+                    for (size_t i = 0; i < n; ++i) {
+                        list.push(item);
+                        while (list.front() == nullptr)
+                            std::this_thread::yield();
+                        list.pop();
+                    }
+                    });
+                report("mq.list", threads, ops, secs);
+            }
+            {
+                MsgQue ring{};
+                mq_init_size(&ring, 1024);
+                double secs = measure(threads, [&ring, n](unsigned int id) {
+                    void* item = reinterpret_cast<void*>(static_cast<uintptr_t>(id + 1));
+                    for (size_t i = 0; i < n; ++i) {
+                        while (mq_push(&ring, item) != 0)
+                            std::this_thread::yield();
+                        while (mq_take(&ring) == nullptr)
+                            std::this_thread::yield();
+                    }
+                    });
+                mq_deinit(&ring);
+                report("mq.ring", threads, ops, secs);
+            }
+            if (threads == 1) {
+                // mq_front + mq_pop is only safe with a single consumer
+                MsgQue ring{};
+                mq_init_size(&ring, 1024);
+                double secs = measure(threads, [&ring, n](unsigned int id) {
+                    void* item = reinterpret_cast<void*>(static_cast<uintptr_t>(id + 1));
+                    for (size_t i = 0; i < n; ++i) {
+                        while (mq_push(&ring, item) != 0)
+                            std::this_thread::yield();
+                        while (mq_front(&ring) == nullptr)
+                            std::this_thread::yield();
+                        mq_pop(&ring);
+                    }
+                    });
+                mq_deinit(&ring);
+                report("mq.frontpop", threads, ops, secs);
+            }
+            {
+                MsgQue ring{};
+                mq_init_size(&ring, 1024);
+                double secs = measure(threads, [&ring, n](unsigned int id) {
+                    void* items[BATCH];
+                    for (auto& item : items) {
+                        item = reinterpret_cast<void*>(static_cast<uintptr_t>(id + 1));
+                    }
+                    for (size_t i = 0; i < n; i += BATCH) {
+                        for (int sent = 0, k = 0; sent < BATCH; sent += k) {
+                            if ((k = mq_push_batch(&ring, items + sent, BATCH - sent)) == 0)
+                                std::this_thread::yield();
+                        }
+                        for (int got = 0, k = 0; got < BATCH; got += k) {
+                            if ((k = mq_pop_batch(&ring, items + got, BATCH - got)) == 0)
+                                std::this_thread::yield();
+                        }
+                    }
+                    });
+                mq_deinit(&ring);
+                report("mq.ring.batch", threads, ops, secs);
+            }
+        }
+    }
+
+    void benchPool(const Options& opt)
+    {
+        const size_t n = opt.operations;
+        const size_t sizes[] = { 64, 200, 1000, 4096 };
+        for (unsigned int threads : opt.threads) {
+            const size_t ops = 2 * n * threads;
+            double secs = measure(threads, [n, &sizes](unsigned int) {
+                void* blocks[BATCH];
+                for (size_t i = 0; i < n; i += BATCH) {
+                    for (int k = 0; k < BATCH; ++k)
+                        blocks[k] = malloc(sizes[(i + k) % 4]);
+                    for (int k = 0; k < BATCH; ++k)
+                        free(blocks[k]);
+                }
+                });
+            report("pool.malloc", threads, ops, secs);
+            secs = measure(threads, [n, &sizes](unsigned int) {
+                void* blocks[BATCH];
+                for (size_t i = 0; i < n; i += BATCH) {
+                    for (int k = 0; k < BATCH; ++k)
+                        blocks[k] = Pool::alloc(sizes[(i + k) % 4]);
+                    for (int k = 0; k < BATCH; ++k)
+                        Pool::free(blocks[k]);
+                }
+                });
+            report("pool.alloc", threads, ops, secs);
+        }
+        Pool::Stats stats = Pool::stats();
+        printf("pool hits=%zu refills=%zu misses=%zu oversize=%zu slabs=%zuKiB\n",
+            stats.hits, stats.refills, stats.misses, stats.oversize, stats.slabBytes / 1024);
+    }
+
+    // a Subscriber callback sized task: function pointer plus a Message
+    std::atomic<size_t> g_done{ 0 };
+    void onMessage(const Scadup::Message& msg)
+    {
+        g_done.fetch_add(msg.head.size, std::memory_order_relaxed);
+    }
+
+    template <typename Submit>
+    void benchPoolCase(const char* name, unsigned int threads, size_t n, Submit submit)
+    {
+        g_done = 0;
+        const size_t total = n * threads;
+        auto begin = std::chrono::steady_clock::now();
+        measure(threads, [n, &submit](unsigned int) {
+            Scadup::Message msg{};
+            msg.head.size = 1;
+            for (size_t i = 0; i < n; ++i)
+                submit(msg);
+            });
+        // until the last task ran
+        while (g_done.load() < total)
+            std::this_thread::yield();
+        report(name, threads, total, std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count());
+    }
+
+    // enqueue to the task running, one task in flight per submitting thread
+    template <typename Submit>
+    void benchPoolLatency(const char* name, unsigned int threads, size_t rounds, Submit submit)
+    {
+        std::vector<std::vector<uint64_t>> lats(threads);
+        measure(threads, [rounds, &submit, &lats](unsigned int id) {
+            std::vector<uint64_t>& lat = lats[id];
+            lat.reserve(rounds);
+            std::atomic<uint64_t> started{ 0 };
+            for (size_t i = 0; i < rounds; ++i) {
+                started.store(0, std::memory_order_relaxed);
+                uint64_t stamp = nanos();
+                submit([&started]() { started.store(nanos(), std::memory_order_release); });
+                uint64_t at;
+                while ((at = started.load(std::memory_order_acquire)) == 0)
+                    std::this_thread::yield();
+                lat.emplace_back(at - stamp);
+            }
+            });
+        std::vector<uint64_t> all;
+        for (auto& lat : lats) {
+            all.insert(all.end(), lat.begin(), lat.end());
+        }
+        reportLatency(name, threads, all);
+    }
+
+    void benchThreadpool(const Options& opt)
+    {
+        const size_t n = opt.operations / 4;
+        const size_t workers = 4;
+        for (unsigned int threads : opt.threads) {
+            {
+                QueuePool legacy(workers);
+                benchPoolCase("threadpool.queue", threads, n, [&legacy](const Scadup::Message& msg) {
+                    legacy.enqueue(onMessage, msg);
+                    });
+            }
+            {
+                threadpool pool;
+                pool.start(workers);
+                benchPoolCase("threadpool.enq", threads, n, [&pool](const Scadup::Message& msg) {
+                    pool.enqueue(onMessage, msg);
+                    });
+                benchPoolCase("threadpool.post", threads, n, [&pool](const Scadup::Message& msg) {
+                    pool.post(onMessage, msg);
+                    });
+                pool.stop();
+            }
+        }
+        for (unsigned int threads : opt.threads) {
+            const size_t rounds = std::max<size_t>(n / 100, 1);
+            {
+                QueuePool legacy(workers);
+                benchPoolLatency("threadpool.queue", threads, rounds, [&legacy](std::function<void()> task) {
+                    legacy.enqueue(task);
+                    });
+            }
+            {
+                threadpool pool;
+                pool.start(workers);
+                benchPoolLatency("threadpool.enq", threads, rounds, [&pool](std::function<void()> task) {
+                    pool.enqueue(task);
+                    });
+                pool.stop();
+            }
+        }
+    }
+
+    // sends of the given size on every thread's own socket pair, drained by a reader each
+    template <typename Send>
+    void benchWritesCase(const char* name, unsigned int threads, size_t n, size_t size, Send send)
+    {
+        std::vector<int> pairs(2 * threads, -1);
+        for (unsigned int i = 0; i < threads; ++i) {
+            if (socketpair(AF_UNIX, SOCK_STREAM, 0, &pairs[2 * i]) != 0) {
+                fprintf(stderr, "socketpair: %s\n", strerror(errno));
+                for (int fd : pairs) {
+                    if (fd >= 0)
+                        Close(fd);
+                }
+                return;
+            }
+        }
+        std::vector<std::thread> readers;
+        for (unsigned int i = 0; i < threads; ++i) {
+            int fd = pairs[2 * i + 1];
+            readers.emplace_back([fd]() {
+                char sink[65536];
+                while (::recv(fd, sink, sizeof(sink), 0) > 0) { }
+                });
+        }
+        const std::vector<uint8_t> chunk(size, 'x');
+        double secs = measure(threads, [&pairs, &chunk, &send, n](unsigned int id) {
+            for (size_t i = 0; i < n; ++i) {
+                if (send(pairs[2 * id], chunk.data(), chunk.size()) != static_cast<ssize_t>(chunk.size())) {
+                    fprintf(stderr, "write %zu bytes: %s\n", chunk.size(), strerror(errno));
+                    return;
+                }
+            }
+            });
+        for (unsigned int i = 0; i < threads; ++i) {
+            shutdown(pairs[2 * i], SHUT_WR);
+        }
+        for (auto& t : readers) {
+            t.join();
+        }
+        for (int fd : pairs) {
+            Close(fd);
+        }
+        printf("%-16s threads=%-3u bytes=%-5zu ops=%-10zu seconds=%.3f ops/s=%.0f MB/s=%.1f\n",
+            name, threads, size, n * threads, secs, n * threads / secs, n * threads * size / secs / 1e6);
+        fflush(stdout);
+    }
+
+    void benchWrites(const Options& opt)
+    {
+        const size_t sizes[] = { 64, 4096 };
+        for (size_t size : sizes) {
+            const size_t n = opt.operations / (size > 1024 ? 16 : 2);
+            for (unsigned int threads : opt.threads) {
+                benchWritesCase("writes", threads, n, size, [](int fd, const uint8_t* data, size_t len) {
+                    return Scadup::writes(fd, data, len);
+                    });
+                benchWritesCase("writes.nolock", threads, n, size, [](int fd, const uint8_t* data, size_t len) {
+                    size_t done = 0;
+                    while (done < len) {
+                        ssize_t sent = Write(fd, data + done, len - done);
+                        if (sent < 0 && errno == EINTR)
+                            continue;
+                        if (sent <= 0)
+                            return static_cast<ssize_t>(-1);
+                        done += static_cast<size_t>(sent);
+                    }
+                    return static_cast<ssize_t>(done);
+                    });
+            }
+        }
+    }
+
+    void benchFile(const Options& opt)
+    {
+        const size_t mib[] = { 1, 16, 64 };
+        const struct {
+            const char* name;
+            std::string (*read)(const std::string&);
+        } kinds[] = { { "file.content", FileUtils::GetFileStringContent },
+            { "file.str2string", FileUtils::getStrFile2string } };
+        for (size_t size : mib) {
+            {
+                std::ofstream out(opt.file, std::ios::binary | std::ios::trunc);
+                const std::string block(1 << 20, 'x');
+                for (size_t i = 0; i < size && out; ++i) {
+                    out.write(block.data(), static_cast<std::streamsize>(block.size()));
+                }
+                if (!out) {
+                    fprintf(stderr, "write %s: %s\n", opt.file.c_str(), strerror(errno));
+                    unlink(opt.file.c_str());
+                    return;
+                }
+            }
+            // 64 MiB read in each case, the first read warms the page cache
+            const size_t n = std::max<size_t>(64 / size, 2);
+            for (const auto& kind : kinds) {
+                size_t bytes = kind.read(opt.file).size();
+                auto begin = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < n; ++i) {
+                    bytes = kind.read(opt.file).size();
+                }
+                double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+                printf("%-16s file=%-3zuMiB got=%-9zu ops=%-6zu seconds=%.3f ms/op=%.2f MB/s=%.0f\n",
+                    kind.name, size, bytes, n, secs, secs * 1e3 / n, n * (size << 20) / secs / 1e6);
+                fflush(stdout);
+            }
+        }
+        unlink(opt.file.c_str());
+    }
+
+    volatile size_t g_sink = 0; // keeps the frames built from being optimized away
+
+    // what Publisher::publish builds before it takes the lock: header, status, checksum, prefix
+    void benchFrame(const Options& opt)
+    {
+        const size_t sizes[] = { 16, 64, 1024, 4096 };
+        for (size_t size : sizes) {
+            const std::string payload(size, 'x');
+            for (uint8_t version = 1; version <= Scadup::WIRE_VERSION; ++version) {
+                for (int checked = 0; checked < 2; ++checked) {
+                    char prefix[Scadup::Wire::PREFIX];
+                    size_t total = 0;
+                    const size_t n = opt.operations;
+                    auto begin = std::chrono::steady_clock::now();
+                    for (size_t i = 0; i < n; ++i) {
+                        Scadup::Message msg = {};
+                        memset(static_cast<void*>(&msg), 0, sizeof(Scadup::Message));
+                        msg.head.size = static_cast<unsigned int>(Scadup::HEAD_SIZE + sizeof(msg.payload.status) + size + 1);
+                        msg.head.topic = static_cast<uint32_t>(i);
+                        msg.head.flag = Scadup::PUBLISHER;
+                        memcpy(msg.payload.status, "OK", 3);
+                        if (checked) {
+                            msg.head.rsvp |= Scadup::CHECKED;
+                            Scadup::Wire::seal(msg.payload.status, payload.data(), size);
+                        }
+                        total += Scadup::Wire::prefix(version, msg.head, msg.payload.status, prefix);
+                    }
+                    double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+                    g_sink = g_sink + total;
+                    printf("%-16s v%u%-4s bytes=%-5zu ops=%-10zu seconds=%.3f ns/op=%.1f\n", "publish.frame",
+                        version, checked ? " crc" : "", size, n, secs, secs * 1e9 / n);
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+
+    void benchPublish(const Options& opt)
+    {
+        benchFrame(opt);
+        // a publish logs at INFO, that is not what is measured here
+        const Logging::Level level = Logging::level();
+        Logging::setLevel(Logging::LEVEL_WARN);
+        Scadup::Broker& broker = Scadup::Broker::instance();
+        broker.setSharedMemory(0);
+        const size_t sizes[] = { 16, 64, 1024, 4096 };
+        for (uint8_t version = 1; version <= Scadup::WIRE_VERSION; ++version) {
+            broker.setWireVersion(version);
+            if (broker.setup(opt.port, 1) != 0) {
+                fprintf(stderr, "broker setup on port %u failed\n", opt.port);
+                break;
+            }
+            std::thread loop([&broker]() { broker.broker(); });
+            for (size_t size : sizes) {
+                const std::string payload(size, 'x');
+                const size_t n = opt.operations / (size > 1024 ? 16 : 4);
+                for (int checked = 0; checked < 2; ++checked) {
+                    for (unsigned int threads : opt.threads) {
+                        std::vector<std::unique_ptr<Scadup::Publisher>> pubs;
+                        for (unsigned int i = 0; i < threads; ++i) {
+                            pubs.emplace_back(new Scadup::Publisher());
+                            if (pubs.back()->setup("127.0.0.1", opt.port) != 0) {
+                                fprintf(stderr, "publisher setup failed\n");
+                                pubs.pop_back();
+                                break;
+                            }
+                            pubs.back()->setChecksum(checked != 0);
+                        }
+                        if (pubs.size() < threads)
+                            continue;
+                        std::atomic<size_t> failed{ 0 };
+                        double secs = measure(threads, [&pubs, &payload, &failed, n](unsigned int id) {
+                            for (size_t i = 0; i < n; ++i) {
+                                if (pubs[id]->publish(0x5a5a, payload) <= 0)
+                                    failed++;
+                            }
+                            });
+                        for (auto& pub : pubs) {
+                            pub->close();
+                        }
+                        printf("%-16s v%u%-4s threads=%-3u bytes=%-5zu ops=%-10zu seconds=%.3f ops/s=%.0f "
+                            "MB/s=%.1f failed=%zu\n", "publish", version, checked ? " crc" : "", threads, size,
+                            n * threads, secs, n * threads / secs, n * threads * size / secs / 1e6, failed.load());
+                        fflush(stdout);
+                    }
+                }
+            }
+            broker.exit();
+            loop.join();
+        }
+        Logging::flush();
+        Logging::setLevel(level);
+    }
+
+    void removeLog(const std::string& dir)
+    {
+        DIR* handle = opendir(dir.c_str());
+        if (handle == nullptr)
+            return;
+        while (dirent* ent = readdir(handle)) {
+            if (ent->d_name[0] != '.')
+                unlink((dir + "/" + ent->d_name).c_str());
+        }
+        closedir(handle);
+        rmdir(dir.c_str());
+    }
+
+    void benchLog(const Options& opt)
+    {
+        const size_t sizes[] = { 128, 1024 };
+        const struct {
+            const char* name;
+            size_t every;
+        } policies[] = { { "log.nosync", 0 }, { "log.sync1000", 1000 }, { "log.sync1", 1 } };
+        for (size_t size : sizes) {
+            std::vector<char> record(size, 'x');
+            for (const auto& policy : policies) {
+                // a sync per append is disk latency bound, fewer of those
+                size_t n = opt.operations / (policy.every == 1 ? 100 : 4);
+                removeLog(opt.dir);
+                SegmentLog log;
+                if (log.open(opt.dir) != 0) {
+                    fprintf(stderr, "open log under %s: %s\n", opt.dir.c_str(), strerror(errno));
+                    return;
+                }
+                auto begin = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < n; ++i) {
+                    if (log.append(record.data(), static_cast<uint32_t>(size), i) < 0) {
+                        fprintf(stderr, "append: %s\n", strerror(errno));
+                        break;
+                    }
+                    if (policy.every > 0 && log.unsynced() >= policy.every)
+                        log.sync();
+                }
+                log.sync();
+                double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+                printf("%-16s bytes=%-5zu ops=%-10zu seconds=%.3f ops/s=%.0f MB/s=%.1f\n",
+                    policy.name, size, n, secs, n / secs, n * size / secs / 1e6);
+                fflush(stdout);
+                log.close();
+            }
+        }
+        removeLog(opt.dir);
+    }
+
+    bool checkCrc()
+    {
+        const char* check = "123456789";
+        if (Crc32c::extend(0, check, 9) != 0xe3069283 || Crc32c::portable(0, check, 9) != 0xe3069283) {
+            fprintf(stderr, "crc32c of \"%s\" is 0x%08x and 0x%08x, not 0xe3069283\n", check,
+                Crc32c::extend(0, check, 9), Crc32c::portable(0, check, 9));
+            return false;
+        }
+        // split anywhere, the same
+        if (Crc32c::extend(Crc32c::extend(0, check, 4), check + 4, 5) != 0xe3069283) {
+            fprintf(stderr, "crc32c of \"%s\" in two parts is not 0xe3069283\n", check);
+            return false;
+        }
+        return true;
+    }
+
+    // a frame of size encoded and decoded back, the length taking bytes bytes
+    bool checkVarint(uint32_t size, bool ok, size_t bytes)
+    {
+        const char status[Scadup::Wire::STATUS_BYTES] = { 'E', 'R', 'R' };
+        Scadup::Header head{};
+        head.cmd = 0x12;
+        head.rsvp = Scadup::CHECKED;
+        head.flag = Scadup::PUBLISHER;
+        head.topic = 0x89abcdef;
+        head.size = size;
+        char out[Scadup::Wire::PREFIX];
+        size_t used = Scadup::Wire::encode(head, ok ? Scadup::Wire::OK : status, out);
+        Scadup::Header back{};
+        size_t body = 0;
+        bool sent = false;
+        long got = Scadup::Wire::decode(out, used, back, body, sent);
+        size_t length = size - Scadup::HEAD_SIZE - (ok ? Scadup::Wire::STATUS_BYTES : 0);
+        if (used != Scadup::Wire::HEAD + bytes + (ok ? 0 : Scadup::Wire::STATUS_BYTES) || got != static_cast<long>(Scadup::Wire::HEAD + bytes)
+            || back.size != size || back.topic != head.topic || back.cmd != head.cmd || back.rsvp != head.rsvp
+            || back.flag != head.flag || body != length || sent == ok) {
+            fprintf(stderr, "varint of size %u (%s) took %zu bytes, decoded %ld: size %u body %zu\n",
+                size, ok ? "OK" : "status", used, got, back.size, body);
+            return false;
+        }
+        // one byte short of the length is incomplete, not malformed
+        if (Scadup::Wire::decode(out, Scadup::Wire::HEAD + bytes - 1, back, body, sent) != 0) {
+            fprintf(stderr, "varint of size %u cut short is not incomplete\n", size);
+            return false;
+        }
+        return true;
+    }
+
+    std::vector<uint8_t> varint(uint64_t value)
+    {
+        std::vector<uint8_t> bytes;
+        do {
+            uint8_t byte = value & 0x7f;
+            value >>= 7;
+            bytes.push_back(static_cast<uint8_t>(byte | (value != 0 ? 0x80 : 0)));
+        } while (value != 0);
+        return bytes;
+    }
+
+    // a length byte by byte, decode() must find it malformed
+    bool checkMalformed(const std::vector<uint8_t>& length, bool status = false)
+    {
+        std::vector<char> in(Scadup::Wire::HEAD, 0);
+        in[2] = status ? Scadup::Wire::STATUS : 0;
+        for (uint8_t byte : length) {
+            in.push_back(static_cast<char>(byte));
+        }
+        in.resize(in.size() + Scadup::Wire::STATUS_BYTES, 0);
+        Scadup::Header head{};
+        size_t body = 0;
+        bool sent = false;
+        if (Scadup::Wire::decode(in.data(), in.size(), head, body, sent) != -1) {
+            fprintf(stderr, "varint of %zu bytes ending 0x%02x is not malformed\n", length.size(), length.back());
+            return false;
+        }
+        return true;
+    }
+
+    bool selfCheck()
+    {
+        const uint32_t shift = 1u << 28; // the first length of 5 bytes
+        bool ok = checkCrc();
+        ok = checkVarint(static_cast<uint32_t>(Scadup::HEAD_SIZE + Scadup::Wire::STATUS_BYTES), false, 1) && ok;
+        ok = checkVarint(static_cast<uint32_t>(Scadup::HEAD_SIZE + 127), false, 1) && ok;
+        ok = checkVarint(static_cast<uint32_t>(Scadup::HEAD_SIZE + 128), false, 2) && ok;
+        ok = checkVarint(static_cast<uint32_t>(Scadup::HEAD_SIZE + shift - 1), false, 4) && ok;
+        ok = checkVarint(static_cast<uint32_t>(Scadup::HEAD_SIZE + shift), false, 5) && ok;
+        ok = checkVarint(static_cast<uint32_t>(Scadup::HEAD_SIZE + Scadup::Wire::STATUS_BYTES + shift), true, 5) && ok;
+        ok = checkVarint(UINT32_MAX, false, 5) && ok;
+        ok = checkVarint(UINT32_MAX, true, 5) && ok;
+        // a sixth byte (a small length padded out, only the shift past 28 is
+        // wrong), bits past 32, and a size one past UINT32_MAX
+        ok = checkMalformed({ 0x81, 0x80, 0x80, 0x80, 0x80, 0x00 }) && ok;
+        ok = checkMalformed({ 0xff, 0xff, 0xff, 0xff, 0x10 }) && ok;
+        ok = checkMalformed(varint(UINT32_MAX - Scadup::HEAD_SIZE - Scadup::Wire::STATUS_BYTES + 1)) && ok;
+        ok = checkMalformed(varint(UINT32_MAX - Scadup::HEAD_SIZE + 1), true) && ok;
+        printf("%-16s %s\n", "check", ok ? "passed" : "FAILED");
+        fflush(stdout);
+        return ok;
+    }
+
+    void benchCrc(const Options& opt)
+    {
+        if (!checkCrc())
+            return;
+        const size_t sizes[] = { 64, 256, 1024, 4096, 65536 };
+        const struct {
+            const char* name;
+            uint32_t (*sum)(uint32_t, const void*, size_t);
+        } kinds[] = { { Crc32c::hardware() ? "crc.sse42" : "crc.extend", Crc32c::extend },
+            { "crc.slicing8", Crc32c::portable } };
+        for (size_t size : sizes) {
+            std::vector<char> message(size);
+            for (size_t i = 0; i < size; ++i) {
+                message[i] = static_cast<char>(i * 31 + 7);
+            }
+            // the same bytes summed whatever the size
+            size_t n = std::max<size_t>(opt.operations * 64 / size, 1);
+            for (const auto& kind : kinds) {
+                uint32_t crc = 0;
+                auto begin = std::chrono::steady_clock::now();
+                for (size_t i = 0; i < n; ++i) {
+                    crc ^= kind.sum(0, message.data(), size);
+                    message[i % size] = static_cast<char>(crc);
+                }
+                double secs = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+                printf("%-16s bytes=%-5zu ops=%-10zu seconds=%.3f ns/op=%.1f GB/s=%.2f\n",
+                    kind.name, size, n, secs, secs * 1e9 / n, n * size / secs / 1e9);
+                fflush(stdout);
+            }
+        }
+    }
+
+    std::vector<unsigned int> parseList(const char* arg)
+    {
+        std::vector<unsigned int> list;
+        std::string str(arg);
+        size_t pos = 0;
+        while (pos <= str.size()) {
+            size_t end = str.find(',', pos);
+            if (end == std::string::npos)
+                end = str.size();
+            if (end > pos)
+                list.emplace_back(static_cast<unsigned int>(atoi(str.substr(pos, end - pos).c_str())));
+            pos = end + 1;
+        }
+        return list;
+    }
+}
+
+int main(int argc, char* argv[])
+{
+    Options opt;
+    int ch;
+    while ((ch = getopt(argc, argv, "t:n:d:f:P:h")) != -1) {
+        switch (ch) {
+        case 't': opt.threads = parseList(optarg); break;
+        case 'n': opt.operations = static_cast<size_t>(atol(optarg)); break;
+        case 'd': opt.dir = optarg; break;
+        case 'f': opt.file = optarg; break;
+        case 'P': opt.port = static_cast<unsigned short>(atoi(optarg)); break;
+        default:
+            fprintf(stderr, "Usage: %s [-t threads[,threads...]] [-n operations] [-d dir] [-f file] [-P port] [mq] "
+                "[pool] [threadpool] [log] [crc] [writes] [file] [publish] [check]\n", argv[0]);
+            return ch == 'h' ? 0 : 1;
+        }
+    }
+    std::vector<std::string> cases;
+    for (int i = optind; i < argc; ++i) {
+        cases.emplace_back(argv[i]);
+    }
+    if (cases.empty())
+        cases = { "check", "mq", "pool", "threadpool", "log", "crc", "writes", "file", "publish" };
+    for (const auto& name : cases) {
+        if (name == "check") {
+            if (!selfCheck())
+                return 1;
+        } else if (name == "mq") {
+            benchMq(opt);
+        } else if (name == "pool") {
+            benchPool(opt);
+        } else if (name == "threadpool") {
+            benchThreadpool(opt);
+        } else if (name == "log") {
+            benchLog(opt);
+        } else if (name == "crc") {
+            benchCrc(opt);
+        } else if (name == "writes") {
+            benchWrites(opt);
+        } else if (name == "file") {
+            benchFile(opt);
+        } else if (name == "publish") {
+            benchPublish(opt);
+        } else {
+            fprintf(stderr, "unknown case '%s'\n", name.c_str());
+            return 1;
+        }
+    }
+    return 0;
+}
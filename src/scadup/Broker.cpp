@@ -1,8 +1,31 @@
 #include "common/Scadup.h"
+#include <bitset>
+#include <memory>
+#include <unordered_map>
 
 extern "C" {
 #include "../utils/msg_que.h"
 }
+#include "../utils/Reactor.h"
+#include "../utils/SegmentLog.h"
+#include "../utils/ShmRing.h"
+#include "../utils/TimerWheel.h"
+#include "Frame.h"
+#include "Metrics.h"
+#include "Wire.h"
+#include <deque>
+#include <list>
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#endif
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <sys/un.h>
+#endif
+#ifdef __linux__
+#include <linux/errqueue.h>
+#include <sys/socket.h>
+#endif
 
 #define LOG_TAG "Broker"
 #include "../utils/logging.h"
@@ -29,7 +52,7 @@ void signalCatch(int value)
 }
 #endif
 
-bool Scadup::makeSocket(SOCKET& socket)
+bool Scadup::makeSocket(SOCKET& socket, int family)
 {
 #ifdef _WIN32
     WSADATA wsaData;
@@ -41,7 +64,7 @@ bool Scadup::makeSocket(SOCKET& socket)
     }
 #endif
     bool status = true;
-    socket = ::socket(AF_INET, SOCK_STREAM, 0);
+    socket = ::socket(family, SOCK_STREAM, 0);
     if (socket <= 0) {
         LOGE("Generating socket fail(%s).",
             (errno != 0 ? strerror(errno) : std::to_string(socket).c_str()));
@@ -85,28 +108,51 @@ ssize_t Scadup::writes(SOCKET socket, const uint8_t* data, size_t len)
     return ssize_t(len - left);
 }
 
+// an IPv4 address, or the path of a unix socket when it has a '/'
+static socklen_t brokerAddress(const char* ip, unsigned short port, sockaddr_storage& addr)
+{
+    memset(&addr, 0, sizeof(addr));
+#ifndef _WIN32
+    if (strchr(ip, '/') != nullptr) {
+        auto* local = reinterpret_cast<sockaddr_un*>(&addr);
+        if (strlen(ip) >= sizeof(local->sun_path))
+            return 0;
+        local->sun_family = AF_UNIX;
+        strcpy(local->sun_path, ip);
+        return static_cast<socklen_t>(sizeof(sockaddr_un));
+    }
+#endif
+    auto* inet = reinterpret_cast<sockaddr_in*>(&addr);
+    inet->sin_family = AF_INET;
+    inet->sin_port = htons(port);
+    inet->sin_addr.s_addr = inet_addr(ip);
+    return static_cast<socklen_t>(sizeof(sockaddr_in));
+}
+
 int Scadup::connect(const char* ip, unsigned short port, unsigned int total)
 {
+    sockaddr_storage local{};
+    socklen_t length = brokerAddress(ip, port, local);
+    if (length == 0) {
+        LOGE("Socket path %s too long!", ip);
+        return -1;
+    }
     SOCKET sock = -1;
-    if (!makeSocket(sock)) {
+    if (!makeSocket(sock, local.ss_family)) {
         LOGE("Connect to make socket fail!");
         return -1;
     }
-    sockaddr_in local{};
-    local.sin_family = AF_INET;
-    local.sin_port = htons(port);
-    local.sin_addr.s_addr = inet_addr(ip);
     int flag = 1;
     setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&flag), sizeof(flag));
     LOGI("------ Connecting to %s:%d ------", ip, port);
     unsigned int tries = 0;
-    while (::connect(sock, reinterpret_cast<struct sockaddr*>(&local), sizeof(local)) == (-1)) {
+    while (::connect(sock, reinterpret_cast<struct sockaddr*>(&local), length) == (-1)) {
         if (g_state)
             break;
         if (tries < total) {
             wait(Time100ms * (long)pow(2, tries));
             Close(sock);
-            if (!makeSocket(sock)) {
+            if (!makeSocket(sock, local.ss_family)) {
                 LOGE("Connect to make socket fail, when tries up %d times!", tries);
                 return -1;
             }
@@ -121,7 +167,8 @@ int Scadup::connect(const char* ip, unsigned short port, unsigned int total)
     return sock;
 }
 
-SOCKET Scadup::socket2Broker(const char* ip, unsigned short port, uint64_t& ssid, uint32_t timeout)
+SOCKET Scadup::socket2Broker(const char* ip, unsigned short port, uint64_t& ssid, uint32_t timeout,
+    G_ScaFlag flag, uint8_t* version)
 {
     SOCKET socket = connect(ip, port, timeout);
     if (socket <= 0) {
@@ -131,10 +178,28 @@ SOCKET Scadup::socket2Broker(const char* ip, unsigned short port, uint64_t& ssid
     Header head{};
     ssize_t size = ::recv(socket, reinterpret_cast<char*>(&head), sizeof(head), 0);
     if (size > 0) {
-        if (head.size == sizeof(head) && head.flag == BROKER)
+        bool hello = head.size == sizeof(head) && head.flag == BROKER;
+        if (hello)
             ssid = head.ssid;
         else
             LOGW("Mismatch flag %s, size %u.", GET_FLAG(head.flag), head.size);
+        if (version != nullptr) {
+            // the hello offers the broker's highest version, older ones offer none
+            *version = hello ? std::min<uint8_t>(std::max<uint8_t>(head.rsvp, 1), WIRE_VERSION) : 1;
+            if (*version >= WIRE_VERSION) {
+                Header ask{};
+                ask.cmd = Wire::VERSION;
+                ask.rsvp = *version;
+                ask.flag = flag;
+                ask.size = HEAD_SIZE;
+                ask.ssid = ssid;
+                if (Write(socket, &ask, HEAD_SIZE) != static_cast<ssize_t>(HEAD_SIZE)) {
+                    LOGE("Version to sock %d failed: %s", socket, strerror(errno));
+                    Close(socket);
+                    return -4;
+                }
+            }
+        }
     } else {
         if (size == 0) {
             LOGE("Connection closed by peer, close %d: %s", socket, strerror(errno));
@@ -147,23 +212,305 @@ SOCKET Scadup::socket2Broker(const char* ip, unsigned short port, uint64_t& ssid
     return socket;
 }
 
+bool Scadup::localPeer(SOCKET socket)
+{
+    sockaddr_storage addr{};
+    auto size = static_cast<socklen_t>(sizeof(addr));
+    if (getpeername(socket, reinterpret_cast<sockaddr*>(&addr), &size) != 0)
+        return false;
+#ifndef _WIN32
+    if (addr.ss_family == AF_UNIX)
+        return true;
+#endif
+    if (addr.ss_family != AF_INET)
+        return false;
+    const auto& peer = reinterpret_cast<const sockaddr_in&>(addr);
+    sockaddr_in self{};
+    size = static_cast<socklen_t>(sizeof(self));
+    if (getsockname(socket, reinterpret_cast<sockaddr*>(&self), &size) != 0)
+        return false;
+    return peer.sin_addr.s_addr == self.sin_addr.s_addr || (ntohl(peer.sin_addr.s_addr) >> 24) == 127;
+}
+
 void Scadup::abandon()
 {
     g_state = true;
 }
 
+PoolStats Scadup::poolStats()
+{
+    Pool::Stats stats = Pool::stats();
+    return PoolStats{ stats.hits, stats.refills, stats.misses, stats.oversize, stats.slabBytes, stats.hugeBytes };
+}
+
+void Scadup::setPoolHugePages(bool enable)
+{
+    Pool::setHugePages(enable);
+}
+
 Broker& Broker::instance()
 {
     static Broker broker;
     return broker;
 }
 
-int Broker::setup(unsigned short port)
-{
-#ifndef _WIN32
-    signal(SIGPIPE, signalCatch);
-#endif
+/*
+ * Per-connection state owned by the reactor thread: a client first sends its
+ * handshake header, then a stream of headers each optionally followed by a body.
+ */
+struct Broker::Session {
+    enum Stage {
+        HANDSHAKE,
+        HEADER,
+        BODY
+    } stage = HANDSHAKE;
+    Worker* owner = nullptr;
+    Network work{};
+    uint64_t ssid = 0;
+    Header head{};
+    size_t have = 0; // bytes of the current header/body already read
+    size_t need = 0; // body length of the current frame
+    Frame* frame = nullptr;
+    uint8_t version = 1; // of the wire protocol, agreed on before the handshake
+    std::vector<char> input{}; // compact frames are read in bulk into, parsed from begin to end
+    size_t begin = 0;
+    size_t end = 0;
+    std::deque<Frame*> outq{};
+    size_t offset = 0; // bytes of outq.front() already sent
+    size_t outBytes = 0; // bytes held by outq
+    std::shared_ptr<Backlog> backlog{};
+    TimerWheel::Timer timer{}; // handshake, then idle deadline
+    uint64_t lastSeen = 0; // ms of the last bytes received, any frame counts as heartbeat
+    std::deque<std::pair<uint32_t, Frame*>> zcPending{}; // awaiting MSG_ZEROCOPY completion
+    uint32_t zcSeq = 0;
+    struct {
+        History* history = nullptr;
+        uint64_t next = 0;
+        uint64_t end = 0; // live delivery starts here
+    } replay;
+    std::deque<Frame*> held{}; // live frames waiting for the replay to finish
+    uint64_t since = 0; // route table version that added the subscription
+    ShmRing* ring = nullptr; // reads the topic from shared memory, TCP only for larger frames
+    Multicast* group = nullptr; // receives the topic by multicast, TCP only answers its gaps
+    bool replaying = false;
+    bool zerocopy = false;
+    bool writing = false;
+    bool registered = false;
+    bool closed = false;
+};
+
+/*
+ * One event loop with its own SO_REUSEPORT listener; publishes that match
+ * subscribers of another worker are handed over through its inbox.
+ */
+struct Broker::Worker {
+    unsigned int index = 0;
+    Reactor reactor{};
+    SOCKET socket = -1;
+    MsgQue inbox{};
+    TimerWheel timers{};
+    std::vector<TimerWheel::Timer*> due{};
+    uint64_t now = 0; // ms, refreshed once per loop iteration
+    std::unordered_map<SOCKET, Session*> sessions{};
+    std::vector<Session*> closed{};
+    std::shared_ptr<const RouteTable> routes{};
+    uint64_t version = 0;
+    std::unordered_map<uint32_t, History*> histories{}; // cache of m_histories
+    std::unordered_map<uint32_t, Shared*> rings{}; // cache of m_shared
+    uint64_t ringVersion = 0;
+    uint64_t beat = 0; // ms of the next multicast heartbeat, sent by worker 0
+    Metrics::Shard* stats = nullptr;
+    std::atomic<bool> evict{ false }; // a session's backlog is marked, its inbox overflowed
+    std::thread thread{};
+};
+
+struct Broker::Route {
+    Session* session;
+    unsigned int worker;
+    std::shared_ptr<Backlog> backlog; // counts for it from any worker
+    size_t ring; // frames up to this size reach it through shared memory
+};
+
+/*
+ * Outbound queue depth of one subscriber, written by its worker without a
+ * lock and read by queueDepth() through m_backlogs.
+ */
+struct Broker::Backlog {
+    Network work{};
+    std::atomic<size_t> messages{ 0 };
+    std::atomic<size_t> bytes{ 0 };
+    std::atomic<size_t> dropped{ 0 };
+    std::atomic<bool> evict{ false }; // missed a frame under DISCONNECT, closed by its worker
+};
+
+/*
+ * Copy-on-write topic index: an update copies the outer map of pointers and
+ * the one topic it touches, readers keep using whatever snapshot they hold.
+ */
+struct Broker::RouteTable {
+    std::unordered_map<uint32_t, std::shared_ptr<const std::vector<Route>>> topics{};
+};
+
+/*
+ * Durable mode: every publish is appended to the log of its topic before it
+ * is routed, a flusher thread makes the logs durable by the LogPolicy.
+ */
+struct Broker::Journal {
+    std::string dir{};
+    LogPolicy policy{};
+    std::mutex waitLock{};
+    std::condition_variable cond{};
+    bool running = false;
+    bool kick = false;
+    std::thread thread{};
+};
+
+/*
+ * Sequenced messages of one topic, in its log when durable or else the last
+ * `keep` frames in memory. A publish is recorded and routed under
+ * `lock`, so a subscriber that registers under it gets every sequence
+ * exactly once: those before `next` replayed, the later ones live.
+ */
+struct Broker::History {
+    struct Stored {
+        uint64_t seq;
+        uint64_t time;
+        Frame* frame;
+    };
+    std::mutex lock{};
+    std::shared_ptr<SegmentLog> log{};
+    std::deque<Stored> ring{};
+    uint64_t next = 0; // sequence of the next publish without a log
+    size_t keep = 0; // frames kept without a log
+
+    ~History()
+    {
+        for (auto& stored : ring) {
+            stored.frame->release();
+        }
+    }
+    uint64_t first()
+    {
+        if (log)
+            return log->first();
+        return ring.empty() ? next : ring.front().seq;
+    }
+    uint64_t last()
+    {
+        return log ? log->next() : next;
+    }
+};
+
+/*
+ * Last value of every topic published with RETAIN, bounded by bytes and
+ * evicted least recently published or subscribed first. A retained publish
+ * is stored and routed under `lock`, a subscriber reads it and registers
+ * under it too: it gets the latest value either from here or live, once.
+ */
+struct Broker::Retained {
+    struct Entry {
+        uint32_t topic;
+        Frame* frame;
+    };
+    std::mutex lock{};
+    std::list<Entry> lru{}; // most recently used first
+    std::unordered_map<uint32_t, std::list<Entry>::iterator> index{};
+    size_t bytes = 0;
+    size_t limit = 0;
+
+    ~Retained()
+    {
+        for (auto& entry : lru) {
+            entry.frame->release();
+        }
+    }
+    void store(Frame* frame)
+    {
+        uint32_t topic = frame->head()->topic;
+        auto it = index.find(topic);
+        if (frame->size() > limit) {
+            if (it != index.end()) {
+                bytes -= it->second->frame->size();
+                it->second->frame->release();
+                lru.erase(it->second);
+                index.erase(it);
+            }
+            return;
+        }
+        frame->retain();
+        if (it != index.end()) {
+            bytes -= it->second->frame->size();
+            it->second->frame->release();
+            it->second->frame = frame;
+            lru.splice(lru.begin(), lru, it->second);
+        } else {
+            lru.push_front(Entry{ topic, frame });
+            index[topic] = lru.begin();
+        }
+        bytes += frame->size();
+        while (bytes > limit) {
+            Entry& oldest = lru.back();
+            bytes -= oldest.frame->size();
+            oldest.frame->release();
+            index.erase(oldest.topic);
+            lru.pop_back();
+        }
+    }
+    Frame* find(uint32_t topic) // a reference for the caller, or nullptr
+    {
+        auto it = index.find(topic);
+        if (it == index.end())
+            return nullptr;
+        lru.splice(lru.begin(), lru, it->second);
+        it->second->frame->retain();
+        return it->second->frame;
+    }
+};
+
+/*
+ * Shared memory ring of a topic for clients on this host: the broker writes
+ * what arrives over TCP into it, the bridge thread routes what local
+ * publishers wrote to the TCP subscribers.
+ */
+struct Broker::Shared {
+    ShmRing ring{};
+    std::thread bridge{};
+    std::atomic<bool> running{ false };
+    Metrics::Shard* stats = nullptr; // written by the bridge only
+
+    ~Shared()
+    {
+        running = false;
+        ring.wake();
+        if (bridge.joinable())
+            bridge.join();
+    }
+};
+
+/*
+ * Multicast group of a topic: every publish goes out once as a datagram
+ * numbered by the topic history, which also serves the gaps subscribers
+ * ask for over their session.
+ */
+struct Broker::Multicast {
+    sockaddr_in group{};
+    in_addr iface{};
+    SOCKET socket = -1;
+    std::string offer{}; // "group:port interface" for subscribers
+};
+
+static const size_t STATUS_SIZE = sizeof(Message::Payload::status);
+static const size_t INBOX_SIZE = 65536;
+static const unsigned int MAX_WORKERS = 256; // a publish marks the ones to hand it to on the stack
+static const unsigned int HANDSHAKE_TIMEOUT = 10000; // ms
+static const size_t CATCHUP_CHUNK = 256 * 1024; // bytes of log records per replay write
+static const size_t COMPACT_INPUT = 16 * 1024; // bytes a compact session reads at once
+static const size_t CATCHUP_WINDOW = 4 * 1024 * 1024; // replay bytes queued ahead
+static const size_t MULTICAST_HISTORY = 4096; // frames kept for gaps without setHistory
+static const size_t DATAGRAM_LIMIT = 65507; // UDP payload over IPv4
 
+static SOCKET listenOn(unsigned short port, bool share, bool loopback = false)
+{
     SOCKET sock = -1;
     if (!makeSocket(sock)) {
         LOGE("Setup to make socket fail!");
@@ -172,8 +519,15 @@ int Broker::setup(unsigned short port)
 
     struct sockaddr_in local { };
     local.sin_family = AF_INET;
-    local.sin_addr.s_addr = INADDR_ANY;
+    local.sin_addr.s_addr = htonl(loopback ? INADDR_LOOPBACK : INADDR_ANY);
     local.sin_port = htons(port);
+    int flag = 1;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&flag), sizeof(flag));
+#ifdef SO_REUSEPORT
+    if (share) {
+        setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, reinterpret_cast<const char*>(&flag), sizeof(flag));
+    }
+#endif
     if (::bind(sock, reinterpret_cast<struct sockaddr*>(&local), sizeof(local)) < 0) {
         LOGE("Binding socket (%s).",
             (errno != 0 ? strerror(errno) : std::to_string(sock).c_str()));
@@ -188,23 +542,155 @@ int Broker::setup(unsigned short port)
         Close(sock);
         return -3;
     }
+    return sock;
+}
 
-    m_msgQue = new MsgQue{};
-    mq_init(static_cast<MsgQue*>(m_msgQue));
-    m_socket = sock;
-    m_active = true;
+#ifndef _WIN32
+static SOCKET listenUnix(const std::string& path)
+{
+    sockaddr_un local{};
+    if (path.size() >= sizeof(local.sun_path)) {
+        LOGE("Socket path %s too long!", path.c_str());
+        return -1;
+    }
+    SOCKET sock = -1;
+    if (!makeSocket(sock, AF_UNIX)) {
+        LOGE("Setup to make unix socket fail!");
+        return -1;
+    }
+    local.sun_family = AF_UNIX;
+    strcpy(local.sun_path, path.c_str());
+    unlink(path.c_str()); // left over by a broker that did not exit
+    if (::bind(sock, reinterpret_cast<struct sockaddr*>(&local), sizeof(local)) < 0) {
+        LOGE("Binding %s (%s).", path.c_str(), strerror(errno));
+        Close(sock);
+        return -2;
+    }
+    const int backlog = 50;
+    if (listen(sock, backlog) < 0) {
+        LOGE("listening %s (%s).", path.c_str(), strerror(errno));
+        Close(sock);
+        unlink(path.c_str());
+        return -3;
+    }
+    return sock;
+}
+#endif
+
+// sends to a multicast group, one hop only: subscribers share the LAN segment
+static SOCKET groupSocket(const in_addr& iface)
+{
+    SOCKET sock = ::socket(AF_INET, SOCK_DGRAM, 0);
+    if (sock < 0)
+        return -1;
+    unsigned char ttl = 1;
+    unsigned char loop = 1; // subscribers on this host too
+    int bytes = 4 * 1024 * 1024;
+    if (setsockopt(sock, IPPROTO_IP, IP_MULTICAST_TTL, reinterpret_cast<const char*>(&ttl), sizeof(ttl)) != 0
+        || setsockopt(sock, IPPROTO_IP, IP_MULTICAST_LOOP, reinterpret_cast<const char*>(&loop), sizeof(loop)) != 0
+        || setsockopt(sock, IPPROTO_IP, IP_MULTICAST_IF, reinterpret_cast<const char*>(&iface), sizeof(iface)) != 0) {
+        Close(sock);
+        return -1;
+    }
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, reinterpret_cast<const char*>(&bytes), sizeof(bytes));
+    return sock;
+}
+
+int Broker::setup(unsigned short port, unsigned int workers)
+{
+#ifndef _WIN32
+    signal(SIGPIPE, signalCatch);
+#endif
+    if (workers == 0) {
+        workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    if (workers > MAX_WORKERS) {
+        LOGW("%u workers reduced to %u.", workers, MAX_WORKERS);
+        workers = MAX_WORKERS;
+    }
+#ifndef SO_REUSEPORT
+    if (workers > 1) {
+        LOGW("SO_REUSEPORT unsupported, %u workers reduced to 1.", workers);
+        workers = 1;
+    }
+#endif
 
-    std::thread check([&](Broker* b)->void {
-        if (b != nullptr)
-            b->checkAlive(m_networks, &m_active);
-        }, this);
-    if (check.joinable()) {
-        check.detach();
+    auto metrics = std::make_shared<Metrics>();
+    std::atomic_store(&m_metrics, metrics);
+    for (unsigned int i = 0; i < workers; ++i) {
+        SOCKET sock = listenOn(port, workers > 1);
+        if (sock < 0) {
+            release();
+            return (int)sock;
+        }
+        auto* worker = new Worker{};
+        worker->index = i;
+        worker->socket = sock;
+        worker->stats = metrics->shard();
+        m_workers.emplace_back(worker);
+        if (mq_init_size(&worker->inbox, INBOX_SIZE) != 0) {
+            LOGE("Inbox of worker %u alloc fail.", i);
+            release();
+            return -3;
+        }
+        if (worker->reactor.open() != 0 || Reactor::setNonBlock(sock) != 0
+            || worker->reactor.add(sock, Reactor::READ, nullptr) != 0) {
+            LOGE("Reactor setup (%s).", strerror(errno));
+            release();
+            return -4;
+        }
+    }
+    if (!m_unixPath.empty()) {
+#ifdef _WIN32
+        LOGE("Unix socket %s unsupported!", m_unixPath.c_str());
+        release();
+        return -5;
+#else
+        // one listener for every worker, whichever accepts first takes the client
+        m_unixSocket = listenUnix(m_unixPath);
+        if (m_unixSocket < 0 || Reactor::setNonBlock(m_unixSocket) != 0) {
+            release();
+            return -5;
+        }
+        for (auto* worker : m_workers) {
+            if (worker->reactor.add(m_unixSocket, Reactor::READ, &m_unixSocket) != 0) {
+                LOGE("Reactor setup (%s).", strerror(errno));
+                release();
+                return -5;
+            }
+        }
+#endif
+    }
+    for (auto& it : m_multicast) {
+        it.second->socket = groupSocket(it.second->iface);
+        if (it.second->socket < 0) {
+            LOGE("Multicast socket of topic 0x%04x (%s).", it.first, strerror(errno));
+            release();
+            return -6;
+        }
+    }
+    if (m_retainLimit > 0) {
+        m_retained = std::make_shared<Retained>();
+        m_retained->limit = m_retainLimit;
     }
+    if (m_metricsPort > 0) {
+        // plain text for a scraper on this host, never the clients' listeners
+        m_metricsSocket = listenOn(m_metricsPort, false, true);
+        if (m_metricsSocket < 0) {
+            release();
+            return -7;
+        }
+    }
+    m_active = true;
 
+    struct sockaddr_in local { };
     auto size = static_cast<socklen_t>(sizeof(local));
-    getsockname(sock, reinterpret_cast<struct sockaddr*>(&local), &size);
-    LOGI("listens localhost [%s:%d].", inet_ntoa(local.sin_addr), port);
+    getsockname(m_workers[0]->socket, reinterpret_cast<struct sockaddr*>(&local), &size);
+    LOGI("listens localhost [%s:%d] with %u worker(s).", inet_ntoa(local.sin_addr), port, workers);
+    if (m_unixSocket >= 0)
+        LOGI("listens unix socket [%s].", m_unixPath.c_str());
+    if (m_metricsSocket >= 0)
+        LOGI("serves metrics on [127.0.0.1:%u].", m_metricsPort);
 
     return 0;
 }
@@ -220,305 +706,1773 @@ bool Broker::checkSsid(SOCKET key, uint64_t ssid)
     return ((int)((ssid >> 8) & 0x00ff) == key);
 }
 
-void Broker::taskAllot(Networks& works, const Network& work)
+#if defined(__linux__) && defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY)
+#define ZERO_COPY 1
+#endif
+
+void Broker::startBody(Session* ss, bool keep)
 {
-    if (work.head.flag == PUBLISHER) {
-        Header head{};
-        ssize_t len = recv(work.socket, reinterpret_cast<char*>(&head), sizeof(head), MSG_WAITALL);
-        if (len == 0 || (len < 0 && errno == EPIPE)) {
-            setOffline(works, work.socket);
-            LOGW("Socket lost/closing by itself!");
-        } else {
-            ProxyTask(works, work);
-        }
-    }
-    if (work.head.flag == SUBSCRIBER) {
-        std::thread task([&](const SOCKET& socket) -> void {
-            LOGI("start heart beat task");
-            while (m_active) {
-                Header head{};
-                ssize_t len = ::recv(socket, reinterpret_cast<char*>(&head), HEAD_SIZE, 0);
-                if (len == 0 || (len < 0 && errno == EPIPE) || (len > 0 && head.cmd == 0xff)) {
-                    setOffline(works, socket);
-                    LOGW("Socket %d lost/closing by itself!", socket);
-                    break;
-                } else {
-                    if (len > 0) {
-                        // Received header from subscriber
-                    } else {
-                        LOGE("Error receiving data: %s", strerror(errno));
-                    }
-                }
-                wait(Time100ms);
-            }
-            }, work.socket);
-        if (task.joinable())
-            task.detach();
+    ss->frame = nullptr;
+    if (!keep || ss->need < STATUS_SIZE)
+        return;
+    ss->frame = Frame::create(HEAD_SIZE + ss->need);
+    if (ss->frame == nullptr) {
+        LOGE("Frame allocation(%zu) failed!", HEAD_SIZE + ss->need);
+        return;
     }
+    memcpy(ss->frame->data(), &ss->head, HEAD_SIZE);
 }
 
-int Broker::ProxyTask(Networks& works, const Network& work)
+void Broker::taskAllot(Networks& works, Session* ss)
 {
-    LOGI("start proxy task, works(%d), address %s:%u, size %u.",
-        works[work.head.flag >= MAX_VAL && work.head.flag < MAX_VAL ? work.head.flag : NONE].size(),
-        work.IP, work.PORT, work.head.size);
-    const size_t sz1 = sizeof(Message::Payload::status);
-    const size_t msgSize = work.head.size - HEAD_SIZE;
-    const size_t contSize = msgSize - sz1;
-
-    // heap-allocate Message; must free payload.content before delete msg
-    auto* msg = new Message{};
-    msg->payload.content = new(std::nothrow) char[contSize];
-    if (msg->payload.content == nullptr) {
-        LOGE("Payload content allocation failed!");
-        DelPtr(msg);
-        return -1;
+    const Header& head = ss->head;
+    if (head.ssid != ss->ssid) {
+        LOGE("Handshake ssid=%llu mismatch %llu, close %d.", head.ssid, ss->ssid, ss->work.socket);
+        closeSession(ss, CLOSE_HANDSHAKE);
+        return;
+    }
+    Network& work = ss->work;
+    work.head = head;
+    work.active = true;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        works[head.flag].emplace_back(work);
     }
-    memset(msg->payload.content, 0, contSize);
+    ss->registered = true;
+    if (m_idleTimeout > 0)
+        ss->owner->timers.schedule(&ss->timer, m_idleTimeout);
+    else
+        ss->owner->timers.cancel(&ss->timer);
+    if (head.flag == SUBSCRIBER) {
+        ss->backlog = std::make_shared<Backlog>();
+        ss->backlog->work = work;
+        {
+            std::lock_guard<std::mutex> lock(m_backlogLock);
+            m_backlogs.emplace_back(ss->backlog);
+        }
+        // a start position follows in the status slot, routed once it is read
+        if ((head.rsvp == START_LIVE || head.size != HEAD_SIZE + STATUS_SIZE) && !subscribeLive(ss)) {
+            closeSession(ss, CLOSE_SEND);
+            return;
+        }
+    }
+    LOGI("a new %s (%s:%d) %d set to Networks, topic=0x%04x, ssid=0x%04x, size=%u, worker=%u, wire v%u.",
+        GET_FLAG(head.flag), work.IP, work.PORT, work.socket, head.topic, ss->ssid, head.size, work.worker,
+        ss->version);
+    if (head.flag == PUBLISHER && head.size == HEAD_SIZE) {
+        // a heartbeat or ring request sent before the first publish registers the publisher
+        ss->stage = Session::HEADER;
+        if (head.cmd == 0x30)
+            offerRing(ss);
+    } else if (head.flag == PUBLISHER) {
+        if (head.size < HEAD_SIZE + STATUS_SIZE) {
+            LOGW("Message size(%u) invalid!", head.size);
+            closeSession(ss, CLOSE_PROTOCOL);
+            return;
+        }
+        ss->need = head.size - HEAD_SIZE;
+        startBody(ss, true);
+        if (ss->frame == nullptr) {
+            closeSession(ss, CLOSE_RESOURCE);
+            return;
+        }
+        ss->stage = Session::BODY;
+    } else {
+        ss->stage = Session::HEADER;
+        if (head.flag == SUBSCRIBER && head.rsvp != START_LIVE && head.size == HEAD_SIZE + STATUS_SIZE) {
+            ss->need = STATUS_SIZE;
+            startBody(ss, true);
+            if (ss->frame == nullptr) {
+                closeSession(ss, CLOSE_RESOURCE);
+                return;
+            }
+            ss->stage = Session::BODY;
+        }
+#ifdef ZERO_COPY
+        int flag = 1;
+        ss->zerocopy = m_zeroCopy > 0 && head.flag == SUBSCRIBER &&
+            setsockopt(work.socket, SOL_SOCKET, SO_ZEROCOPY, &flag, sizeof(flag)) == 0;
+#endif
+    }
+}
 
-    // receive: first sz1 bytes -> status[], rest -> content
-    size_t left = msgSize;
-    size_t len = 0;
-    size_t size = sz1;
-    char* payload = msg->payload.status;
-    do {
-        ssize_t got = ::recv(work.socket, payload + len, size, 0);
+void Broker::onReadable(Session* ss)
+{
+    char scratch[256];
+    const SOCKET sock = ss->work.socket;
+    while (!ss->closed) {
+        if (ss->version >= 2 && ss->stage != Session::BODY) {
+            if (!readCompact(ss))
+                break;
+            continue;
+        }
+        char* dst = nullptr;
+        size_t want = 0;
+        if (ss->stage != Session::BODY) {
+            dst = reinterpret_cast<char*>(&ss->head) + ss->have;
+            want = HEAD_SIZE - ss->have;
+        } else if (ss->frame == nullptr) {
+            dst = scratch;
+            want = std::min(sizeof(scratch), ss->need - ss->have);
+        } else {
+            dst = ss->frame->data() + HEAD_SIZE + ss->have;
+            want = ss->need - ss->have;
+        }
+        ssize_t got = ::recv(sock, dst, want, 0);
         if (got < 0) {
+            if (errno == EINTR)
+                continue;
             if (errno != EAGAIN && errno != EWOULDBLOCK) {
                 LOGE("Call recv(%ld) failed: %s", got, strerror(errno));
-                DelArr(msg->payload.content);
-                DelPtr(msg);
-                return -1;
-            }
-        } else if (got == 0) {
-            LOGW("Connection closed by peer.");
-            DelArr(msg->payload.content);
-            DelPtr(msg);
-            return -1;
-        } else {
-            left -= static_cast<size_t>(got);
-            len += static_cast<size_t>(got);
-            if (len == sz1) {
-                payload = msg->payload.content;
-                size = contSize;
-                len = 0;
+                closeSession(ss, CLOSE_RECV);
             }
+            break;
         }
-    } while (left > 0);
-
-    msg->head = work.head;
-    mq_push(static_cast<MsgQue*>(m_msgQue), msg);
-    setOffline(works, work.socket);
-
-    // forward message to matching subscribers
-    std::vector<Network>& subs = works[SUBSCRIBER];
-    if (subs.empty()) {
-        LOGW("No subscriber to publish!");
+        if (got == 0) {
+            LOGW("Socket %d lost/closing by itself!", sock);
+            closeSession(ss, CLOSE_PEER);
+            break;
+        }
+        ss->have += static_cast<size_t>(got);
+        ss->lastSeen = ss->owner->now;
+        if (ss->stage == Session::BODY) {
+            if (ss->have == ss->need)
+                onMessage(ss);
+            continue;
+        }
+        if (ss->have < HEAD_SIZE)
+            continue;
+        ss->have = 0;
+        onHeader(ss);
     }
-    void* raw = mq_front(static_cast<MsgQue*>(m_msgQue));
-    if (raw != nullptr) {
-        auto* val = static_cast<Message*>(raw);
-        if (val->head.flag != PUBLISHER) {
-            LOGW("Message invalid(%d), len=%u!", val->head.flag, val->head.size);
-            DelArr(val->payload.content);
-            DelPtr(val);
-            mq_pop(static_cast<MsgQue*>(m_msgQue));
-            return -1;
+}
+
+/*
+ * Compact (v2) frames: read in bulk, parsed out of the session's input into
+ * the v1 layout. A body that did not fit is read on as BODY, into its frame.
+ * False once nothing more can be read now.
+ */
+bool Broker::readCompact(Session* ss)
+{
+    std::vector<char>& input = ss->input;
+    for (;;) {
+        while (!ss->closed && ss->stage != Session::BODY) {
+            size_t body = 0;
+            bool status = false;
+            long used = Wire::decode(input.data() + ss->begin, ss->end - ss->begin, ss->head, body, status);
+            if (used == 0)
+                break;
+            if (used < 0) {
+                LOGE("Malformed frame from sock %d, close.", ss->work.socket);
+                closeSession(ss, CLOSE_PROTOCOL);
+                return false;
+            }
+            ss->begin += static_cast<size_t>(used);
+            ss->head.ssid = ss->ssid;
+            onHeader(ss);
+            if (ss->closed)
+                return false;
+            if (ss->stage != Session::BODY) {
+                if (body == 0)
+                    continue;
+                // a body nobody reads
+                ss->need = body;
+                ss->frame = nullptr;
+                ss->stage = Session::BODY;
+            } else if (!status) {
+                if (ss->frame != nullptr)
+                    memcpy(ss->frame->data() + HEAD_SIZE, Wire::OK, STATUS_SIZE);
+                ss->have = STATUS_SIZE;
+            }
+            size_t take = std::min(ss->need - ss->have, ss->end - ss->begin);
+            if (ss->frame != nullptr)
+                memcpy(ss->frame->data() + HEAD_SIZE + ss->have, input.data() + ss->begin, take);
+            ss->begin += take;
+            ss->have += take;
+            if (ss->have == ss->need)
+                onMessage(ss);
         }
-        if (val->head.size > 0) {
-            for (auto& sub : subs) {
-                if (sub.head.topic == work.head.topic) {
-                    if (sub.active && sub.socket > 0) {
-                        left = val->head.size;
-                        size = HEAD_SIZE + sz1;
-                        const char* buff = reinterpret_cast<const char*>(val);
-                        do {
-                            ssize_t sz = ::send(sub.socket, buff, size, MSG_NOSIGNAL);
-                            if (sz == 0 || (sz < 0 && errno == EPIPE)) {
-                                setOffline(works, sub.socket);
-                                LOGE("Write to sock[%d], size %u failed!", sub.socket, val->head.size);
-                                break;
-                            }
-                            if (static_cast<size_t>(sz) == HEAD_SIZE + sz1) {
-                                size = val->head.size - HEAD_SIZE - sz1;
-                                buff = val->payload.content;
-                            }
-                            left -= static_cast<size_t>(sz);
-                        } while (left > 0);
-                        LOGI("writes message to subscriber[%s:%u], size %u!", sub.IP, sub.PORT, val->head.size);
-                    } else {
-                        LOGW("No valid subscriber of topic %04x!", sub.head.topic);
-                    }
-                }
+        if (ss->closed || ss->stage == Session::BODY)
+            return !ss->closed;
+        if (ss->begin > 0) {
+            memmove(input.data(), input.data() + ss->begin, ss->end - ss->begin);
+            ss->end -= ss->begin;
+            ss->begin = 0;
+        }
+        ssize_t got = ::recv(ss->work.socket, input.data() + ss->end, input.size() - ss->end, 0);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                LOGE("Call recv(%ld) failed: %s", got, strerror(errno));
+                closeSession(ss, CLOSE_RECV);
             }
-            DelArr(val->payload.content);
-            DelPtr(val);
-            mq_pop(static_cast<MsgQue*>(m_msgQue));
-        } else {
-            LOGW("Message size(%u) invalid!", val->head.size);
-            DelArr(val->payload.content);
-            DelPtr(val);
-            mq_pop(static_cast<MsgQue*>(m_msgQue));
+            return false;
         }
-    } else {
-        LOGW("MsgQue is null!");
+        if (got == 0) {
+            LOGW("Socket %d lost/closing by itself!", ss->work.socket);
+            closeSession(ss, CLOSE_PEER);
+            return false;
+        }
+        ss->end += static_cast<size_t>(got);
+        ss->lastSeen = ss->owner->now;
     }
-    return 0;
 }
 
-void Broker::setOffline(Networks& works, SOCKET socket)
+// a whole header read: the handshake, a control frame, or one whose body follows
+void Broker::onHeader(Session* ss)
 {
-    std::lock_guard<std::mutex> lock(m_lock);
-    for (auto& wks : works) {
-        std::vector<Network>& vec = wks.second;
-        for (auto& wk : vec) {
-            if (wk.socket == socket) {
-                wk.active = false;
-                if (wk.socket > 0) {
-                    Close(wk.socket);
-                    wk.socket = 0;
-                }
-                LOGI("client %s:%u will delete later soon.", wk.IP, wk.PORT);
-                return;
-            }
+    const SOCKET sock = ss->work.socket;
+    if (ss->stage == Session::HANDSHAKE && ss->head.cmd == Wire::VERSION && ss->version < 2) {
+        if (ss->head.ssid != ss->ssid || ss->head.rsvp < 2 || ss->head.rsvp > m_wireVersion) {
+            LOGE("Version %u of ssid=%llu not offered, close %d.", ss->head.rsvp, ss->head.ssid, sock);
+            closeSession(ss, CLOSE_HANDSHAKE);
+            return;
         }
+        // the handshake and all after it are compact
+        ss->version = ss->head.rsvp;
+        ss->input.resize(COMPACT_INPUT);
+        return;
+    }
+    if (ss->stage == Session::HANDSHAKE) {
+        taskAllot(m_networks, ss);
+    } else if (ss->head.cmd == 0xff) {
+        LOGW("Socket %d quit by itself!", sock);
+        closeSession(ss, CLOSE_QUIT);
+    } else if (ss->head.cmd == 0x30 && ss->work.head.flag == PUBLISHER) {
+        offerRing(ss);
+    } else if (ss->head.size > HEAD_SIZE) {
+        ss->need = ss->head.size - HEAD_SIZE;
+        startBody(ss, ss->work.head.flag == PUBLISHER || ss->head.cmd == 0x40);
+        ss->stage = Session::BODY;
     }
 }
 
-void Broker::checkAlive(Networks& works, bool* active)
+void Broker::onMessage(Session* ss)
 {
-    LOGI("start alive checking task at %p.", active);
-    while (active != nullptr && (*active)) {
-        wait(Time100ms * 3);
-        std::lock_guard<std::mutex> lock(m_lock);
-        for (auto& work : works) {
-            std::vector<Network>& vec = work.second;
-            for (auto it = vec.begin(); it != vec.end(); ) {
-                if (!it->active) {
-                    LOGI("delete offline client %s:%u", it->IP, it->PORT);
-                    it = vec.erase(it);
-                } else {
-                    ++it;
-                }
+    Frame* frame = ss->frame;
+    ss->frame = nullptr;
+    ss->have = 0;
+    ss->stage = Session::HEADER;
+    if (frame == nullptr)
+        return;
+    if (ss->work.head.flag == SUBSCRIBER) {
+        if (frame->head()->cmd == 0x40)
+            resend(ss, frame);
+        else
+            subscribeFrom(ss, frame);
+        frame->release();
+        return;
+    }
+    ProxyTask(m_networks, *ss->owner, frame);
+}
+
+// what precedes the content of a v1 frame on the wire of a version into out:
+// nothing for v1, the compact header (and status) for v2; skip is the part
+// of the frame it stands for
+static size_t wireFrame(uint8_t version, const char* frame, size_t size, char* out, size_t& skip)
+{
+    skip = 0;
+    if (version < 2 || size < HEAD_SIZE)
+        return 0;
+    Header head{};
+    memcpy(&head, frame, HEAD_SIZE);
+    head.size = static_cast<uint32_t>(size);
+    skip = (size >= HEAD_SIZE + STATUS_SIZE) ? HEAD_SIZE + STATUS_SIZE : HEAD_SIZE;
+    return Wire::encode(head, frame + HEAD_SIZE, out);
+}
+
+// a queued frame on the wire: prefix bytes in out, then its own from skip on
+static size_t onWire(uint8_t version, Frame* frame, char* out, size_t& prefix, size_t& skip)
+{
+    prefix = frame->raw() ? (skip = 0) : wireFrame(version, frame->data(), frame->size(), out, skip);
+    return prefix + frame->size() - skip;
+}
+
+bool Broker::flush(Session* ss)
+{
+    const SOCKET sock = ss->work.socket;
+    Reactor& reactor = ss->owner->reactor;
+    while (!ss->outq.empty()) {
+        ssize_t sz = 0;
+        bool zerocopy = false;
+#ifdef _WIN32
+        Frame* front = ss->outq.front();
+        char head[Wire::PREFIX];
+        size_t prefix = 0;
+        size_t skip = 0;
+        size_t wire = onWire(ss->version, front, head, prefix, skip);
+        if (front->traced() && ss->offset == 0)
+            Wire::stamp(front->data(), front->size(), Wire::HOP_SEND);
+        if (ss->offset < prefix)
+            sz = ::send(sock, head + ss->offset, static_cast<int>(prefix - ss->offset), 0);
+        else
+            sz = ::send(sock, front->data() + skip + ss->offset - prefix, static_cast<int>(wire - ss->offset), 0);
+#else
+        const int batch = 64;
+        iovec iov[2 * batch];
+        char heads[batch][Wire::PREFIX]; // compact prefixes, v2 only
+        int count = 0;
+        int frames = 0;
+        size_t offset = ss->offset;
+        for (Frame* frame : ss->outq) {
+            if (frames == batch)
+                break;
+            size_t prefix = 0;
+            size_t skip = 0;
+            size_t wire = onWire(ss->version, frame, heads[frames], prefix, skip);
+            bool large = ss->zerocopy && wire - offset >= m_zeroCopy;
+            if (frames > 0 && large)
+                break;
+            frames++;
+            if (frame->traced() && offset == 0)
+                Wire::stamp(frame->data(), frame->size(), Wire::HOP_SEND);
+            if (offset < prefix) {
+                iov[count].iov_base = heads[frames - 1] + offset;
+                iov[count].iov_len = prefix - offset;
+                count++;
+                offset = prefix;
+                if (large)
+                    break; // a copy of the stack, the pages behind it go zero-copy next
+            }
+            iov[count].iov_base = frame->data() + skip + offset - prefix;
+            iov[count].iov_len = wire - offset;
+            offset = 0;
+            count++;
+            if (large) {
+                zerocopy = true;
+                break;
             }
         }
-        for (auto it = works.begin(); it != works.end(); ) {
-            if (it->second.empty()) {
-                LOGI("works key(%s) is null deleted! now size=%d", GET_FLAG(it->first), works.size());
-                it = works.erase(it);
-            } else {
-                ++it;
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        int flags = MSG_NOSIGNAL;
+#ifdef ZERO_COPY
+        if (zerocopy)
+            flags |= MSG_ZEROCOPY;
+#endif
+        sz = ::sendmsg(sock, &msg, flags);
+#endif
+        if (sz < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS) {
+                if (!ss->writing) {
+                    ss->writing = true;
+                    reactor.modify(sock, Reactor::READ | Reactor::WRITE, ss);
+                }
+                return true;
             }
+            return false;
+        }
+        if (sz == 0)
+            return false;
+        if (zerocopy) {
+            // the kernel still reads these pages until it reports completion
+            Frame* front = ss->outq.front();
+            front->retain();
+            ss->zcPending.emplace_back(ss->zcSeq++, front);
         }
+        advance(ss, static_cast<size_t>(sz));
     }
+    if (ss->writing) {
+        ss->writing = false;
+        reactor.modify(sock, Reactor::READ, ss);
+    }
+    return true;
 }
 
-int Broker::broker()
+void Broker::advance(Session* ss, size_t sent)
 {
-    fd_set fdset;
-    FD_ZERO(&fdset);
-    while (m_active) {
-        FD_SET(m_socket, &fdset);
-        timeval timeout = { 3, 0 };
-        if (select((int)(m_socket + 1), &fdset, nullptr, nullptr, &timeout) > 0) {
-            if (FD_ISSET(m_socket, &fdset)) {
-                struct sockaddr_in peer { };
-                auto socklen = static_cast<socklen_t>(sizeof(peer));
-                SOCKET sockNew = ::accept(m_socket, reinterpret_cast<struct sockaddr*>(&peer), &socklen);
-                if ((int)sockNew < 0) {
-                    LOGE("Socket accept (%s).", (errno != 0 ? strerror(errno) : std::to_string((int)sockNew).c_str()));
-                    return -1;
-                } else {
-                    int set = 1;
-                    setsockopt(sockNew, SOL_SOCKET, SO_KEEPALIVE, reinterpret_cast<const char*>(&set), sizeof(set));
-                    Network work = {};
-                    getpeername(sockNew, reinterpret_cast<struct sockaddr*>(&peer), &socklen);
-                    char addr[INET_ADDRSTRLEN];
-                    const char* ip = inet_ntop(AF_INET, &peer.sin_addr, addr, INET_ADDRSTRLEN);
-                    strncpy(work.IP, ip, INET_ADDRSTRLEN);
-                    work.PORT = ntohs(peer.sin_port);
-                    time_t t{};
-                    time(&t);
-                    struct tm* lt = localtime(&t);
-                    LOGI("accepted peer address [%s:%u] (@ %d/%02d/%02d-%02d:%02d:%02d)",
-                        work.IP, work.PORT,
-                        lt->tm_year + 1900, lt->tm_mon + 1, lt->tm_mday, lt->tm_hour, lt->tm_min,
-                        lt->tm_sec);
-                    uint64_t ssid = setSession(work.IP, work.PORT, sockNew);
-                    Header head = {};
-                    head.flag = BROKER;
-                    head.size = sizeof(head);
-                    head.ssid = ssid;
-                    ssize_t len = ::send(sockNew, reinterpret_cast<char*>(&head), HEAD_SIZE, 0);
-                    if (len == 0 || (len < 0 && errno == EPIPE)) {
-                        LOGE("Write to sock %d ssid %llu failed!", sockNew, ssid);
-                        continue;
-                    }
-                    memset(&head, 0, sizeof(head));
-                    ssize_t size = recv(sockNew, reinterpret_cast<char*>(&head), sizeof(head), MSG_PEEK);
-                    if (size > 0 && ssid == head.ssid) {
-                        work.socket = sockNew;
-                        work.head = head;
-                        work.active = true;
-                        if (m_networks.find(head.flag) == m_networks.end()) {
-                            std::vector<Network> vec = { work };
-                            m_networks.insert(std::make_pair(head.flag, vec));
-                        } else {
-                            std::lock_guard<std::mutex> lock(m_lock);
-                            m_networks[head.flag].emplace_back(work);
-                        }
-                        taskAllot(m_networks, work);
-                        LOGI("a new %s (%s:%d) %d set to Networks, topic=0x%04x, ssid=0x%04x, size=%u.",
-                            GET_FLAG(head.flag), work.IP, work.PORT, work.socket, head.topic, ssid, head.size);
-                    } else {
-                        if (0 == size || errno == EINVAL || (size < 0 && errno != EAGAIN)) {
-                            LOGE("Recv fail(%ld), ssid=%llu, close %d: %s", size, head.ssid, sockNew, strerror(errno));
-                            Close(sockNew);
-                        }
-                    }
-                }
-            }
+    while (sent > 0 && !ss->outq.empty()) {
+        Frame* front = ss->outq.front();
+        char head[Wire::PREFIX];
+        size_t prefix = 0;
+        size_t skip = 0;
+        size_t left = onWire(ss->version, front, head, prefix, skip) - ss->offset;
+        if (sent < left) {
+            ss->offset += sent;
+            return;
         }
+        sent -= left;
+        ss->offset = 0;
+        ss->outBytes -= front->size();
+        ss->outq.pop_front();
+        front->release();
+    }
+    if (ss->backlog) {
+        ss->backlog->messages.store(ss->outq.size(), std::memory_order_relaxed);
+        ss->backlog->bytes.store(ss->outBytes, std::memory_order_relaxed);
     }
-    LOGI("broker loop has exit.");
-    return 0;
 }
 
-void Broker::exit()
+bool Broker::enqueue(Session* ss, Frame* frame)
 {
-    m_active = false;
-    auto* mq = static_cast<MsgQue*>(m_msgQue);
-
-    // drain message queue: free content + delete Message
-    {
-        void* ft;
-        while ((ft = mq_front(mq)) != nullptr) {
-            auto* msg = static_cast<Message*>(ft);
-            DelArr(msg->payload.content);
-            DelPtr(msg);
-            mq_pop(mq);
+    auto full = [this, ss](size_t size) {
+        if (ss->outq.empty())
+            return false;
+        return (m_queue.messages > 0 && ss->outq.size() + 1 > m_queue.messages) ||
+            (m_queue.bytes > 0 && ss->outBytes + size > m_queue.bytes);
+    };
+    while (full(frame->size())) {
+        if (m_queue.policy == DISCONNECT) {
+            LOGW("Subscriber[%s:%u] queue full (%zu msgs, %zu bytes), disconnect!",
+                ss->work.IP, ss->work.PORT, ss->outq.size(), ss->outBytes);
+            return false;
+        }
+        // the head of the queue may be half written and has to stay
+        size_t oldest = (ss->offset > 0) ? 1 : 0;
+        if (m_queue.policy == DROP_NEWEST || oldest >= ss->outq.size()) {
+            if (ss->backlog)
+                ss->backlog->dropped.fetch_add(1, std::memory_order_relaxed);
+            return true;
         }
+        Frame* drop = ss->outq[oldest];
+        ss->outq.erase(ss->outq.begin() + static_cast<std::ptrdiff_t>(oldest));
+        ss->outBytes -= drop->size();
+        drop->release();
+        if (ss->backlog)
+            ss->backlog->dropped.fetch_add(1, std::memory_order_relaxed);
     }
+    frame->retain();
+    ss->outq.emplace_back(frame);
+    ss->outBytes += frame->size();
+    if (ss->backlog) {
+        ss->backlog->messages.store(ss->outq.size(), std::memory_order_relaxed);
+        ss->backlog->bytes.store(ss->outBytes, std::memory_order_relaxed);
+    }
+    return true;
+}
 
-    // close all connected client sockets
-    {
-        std::lock_guard<std::mutex> lock(m_lock);
-        for (auto& wks : m_networks) {
-            for (auto& wk : wks.second) {
-                if (wk.socket > 0) {
-                    Close(wk.socket);
-                    wk.socket = 0;
-                }
+bool Broker::reap(Session* ss)
+{
+#ifdef ZERO_COPY
+    const SOCKET sock = ss->work.socket;
+    for (;;) {
+        char control[128];
+        msghdr msg{};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (::recvmsg(sock, &msg, MSG_ERRQUEUE) < 0)
+            break;
+        for (cmsghdr* cm = CMSG_FIRSTHDR(&msg); cm != nullptr; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+            auto* err = reinterpret_cast<sock_extended_err*>(CMSG_DATA(cm));
+            if (err->ee_origin != SO_EE_ORIGIN_ZEROCOPY || err->ee_errno != 0)
+                continue;
+            // completions cover the inclusive range [ee_info, ee_data]
+            while (!ss->zcPending.empty() &&
+                static_cast<int32_t>(ss->zcPending.front().first - err->ee_data) <= 0) {
+                ss->zcPending.front().second->release();
+                ss->zcPending.pop_front();
             }
         }
-        m_networks.clear();
     }
+#endif
+    int error = 0;
+    auto len = static_cast<socklen_t>(sizeof(error));
+    getsockopt(ss->work.socket, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &len);
+    return error == 0;
+}
+
+void Broker::closeSession(Session* ss, G_CloseReason reason)
+{
+    if (ss->closed)
+        return;
+    ss->closed = true;
+    Worker* worker = ss->owner;
+    worker->stats->closed(reason);
+    const SOCKET sock = ss->work.socket;
+    worker->reactor.remove(sock);
+    worker->timers.cancel(&ss->timer);
+    worker->sessions.erase(sock);
+    if (ss->registered) {
+        if (ss->work.head.flag == SUBSCRIBER && ss->group == nullptr)
+            removeRoute(ss->work.head.topic, ss);
+        setOffline(m_networks, sock);
+    }
+    Close(sock);
+    if (ss->frame != nullptr) {
+        ss->frame->release();
+        ss->frame = nullptr;
+    }
+    for (Frame* frame : ss->outq) {
+        frame->release();
+    }
+    ss->outq.clear();
+    for (Frame* frame : ss->held) {
+        frame->release();
+    }
+    ss->held.clear();
+    ss->replaying = false;
+    ss->outBytes = 0;
+    if (ss->backlog) {
+        std::lock_guard<std::mutex> lock(m_backlogLock);
+        m_backlogs.erase(std::remove(m_backlogs.begin(), m_backlogs.end(), ss->backlog), m_backlogs.end());
+    }
+    for (auto& pending : ss->zcPending) {
+        pending.second->release();
+    }
+    ss->zcPending.clear();
+    worker->closed.emplace_back(ss);
+}
+
+uint64_t Broker::addRoute(uint32_t topic, Session* ss)
+{
+    std::lock_guard<std::mutex> lock(m_routeLock);
+    auto table = m_routes ? std::make_shared<RouteTable>(*m_routes) : std::make_shared<RouteTable>();
+    auto it = table->topics.find(topic);
+    auto subs = (it != table->topics.end()) ?
+        std::make_shared<std::vector<Route>>(*it->second) : std::make_shared<std::vector<Route>>();
+    subs->emplace_back(Route{ ss, ss->owner->index, ss->backlog, (ss->ring != nullptr) ? ss->ring->limit() : 0 });
+    table->topics[topic] = subs;
+    std::atomic_store(&m_routes, std::shared_ptr<const RouteTable>(table));
+    return m_version.fetch_add(1, std::memory_order_release) + 1;
+}
 
-    if (m_socket > 0) {
-        Close(m_socket);
-        m_socket = -1;
+void Broker::removeRoute(uint32_t topic, Session* ss)
+{
+    std::lock_guard<std::mutex> lock(m_routeLock);
+    if (!m_routes)
+        return;
+    auto it = m_routes->topics.find(topic);
+    if (it == m_routes->topics.end())
+        return;
+    auto subs = std::make_shared<std::vector<Route>>();
+    subs->reserve(it->second->size());
+    for (const auto& route : *it->second) {
+        if (route.session != ss)
+            subs->emplace_back(route);
+    }
+    auto table = std::make_shared<RouteTable>(*m_routes);
+    if (subs->empty())
+        table->topics.erase(topic);
+    else
+        table->topics[topic] = subs;
+    std::atomic_store(&m_routes, std::shared_ptr<const RouteTable>(table));
+    m_version.fetch_add(1, std::memory_order_release);
+}
+
+const std::vector<Broker::Route>* Broker::lookup(Worker& worker, uint32_t topic)
+{
+    uint64_t version = m_version.load(std::memory_order_acquire);
+    if (version != worker.version || !worker.routes) {
+        worker.routes = std::atomic_load(&m_routes);
+        worker.version = version;
+    }
+    if (!worker.routes)
+        return nullptr;
+    auto it = worker.routes->topics.find(topic);
+    return (it != worker.routes->topics.end()) ? it->second.get() : nullptr;
+}
+
+int Broker::ProxyTask(Networks&, Worker& worker, Frame* frame)
+{
+    const Header* head = frame->head();
+    if (head->flag != PUBLISHER || head->size < HEAD_SIZE + STATUS_SIZE) {
+        LOGW("Message invalid(%d), len=%u!", head->flag, head->size);
+        frame->release();
+        return -1;
+    }
+    frame->ingest(Metrics::now());
+    if (Wire::trailer(*head) != 0)
+        Wire::stamp(frame->data(), frame->size(), Wire::HOP_RECEIVE);
+    worker.stats->ingest(head->topic, head->size);
+    route(&worker, frame);
+    return 0;
+}
+
+// one datagram: the head and, unless it is a heartbeat, the compact frame or
+// GROUP_FETCH for it when that is too large
+static bool sendGroup(SOCKET sock, const sockaddr_in& group, GroupHead head, Frame* frame)
+{
+#ifdef _WIN32
+    return false;
+#else
+    char gh[Wire::GROUP_HEAD];
+    char prefix[Wire::PREFIX];
+    size_t skip = 0;
+    iovec iov[3]{ { gh, sizeof(gh) }, { prefix, 0 }, { nullptr, 0 } };
+    msghdr msg{};
+    msg.msg_name = const_cast<sockaddr_in*>(&group);
+    msg.msg_namelen = sizeof(group);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 1;
+    if (frame != nullptr && head.kind == GROUP_FRAME) {
+        iov[1].iov_len = wireFrame(WIRE_VERSION, frame->data(), frame->size(), prefix, skip);
+        iov[2].iov_base = frame->data() + skip;
+        iov[2].iov_len = frame->size() - skip;
+        if (sizeof(gh) + iov[1].iov_len + iov[2].iov_len <= DATAGRAM_LIMIT)
+            msg.msg_iovlen = 3;
+        else
+            head.kind = GROUP_FETCH;
+    }
+    Wire::encodeGroup(head, gh);
+    return sendmsg(sock, &msg, MSG_NOSIGNAL) >= 0;
+#endif
+}
+
+/*
+ * Records, retains and hands a publish to the workers owning its
+ * subscribers, taking over the caller's reference. `worker` is the calling
+ * worker, nullptr for the bridge of a shared memory ring, whose publishes
+ * are in the ring already.
+ */
+void Broker::route(Worker* worker, Frame* frame)
+{
+    const Header* head = frame->head();
+    if (m_verify && head->size > HEAD_SIZE + STATUS_SIZE) {
+        const char* status = frame->data() + HEAD_SIZE;
+        size_t length = head->size - HEAD_SIZE - STATUS_SIZE - Wire::trailer(*head) - 1;
+        if (!Wire::intact(*head, status, status + STATUS_SIZE, length)) {
+            LOGW("Checksum of topic 0x%04x from ssid=%llu mismatched, dropped.", head->topic, head->ssid);
+            frame->release();
+            return;
+        }
+    }
+    Multicast* multicast = m_multicast.empty() ? nullptr : group(head->topic);
+    History* history = (m_journal || m_historySize > 0 || multicast != nullptr) ?
+        this->history(worker, head->topic) : nullptr;
+    std::unique_lock<std::mutex> ordered;
+    if (history != nullptr) {
+        ordered = std::unique_lock<std::mutex>(history->lock);
+        int64_t seq = record(*history, frame);
+        if (multicast != nullptr && seq >= 0) {
+            // sent in sequence order under the lock, once for every subscriber of the group
+            GroupHead group{ static_cast<uint64_t>(seq), head->topic, GROUP_FRAME };
+            if (!sendGroup(multicast->socket, multicast->group, group, frame))
+                LOGW("Multicast of topic 0x%04x at %llu: %s!", head->topic, (unsigned long long)seq, strerror(errno));
+        }
+    }
+
+    Retained* retained = ((head->rsvp & RETAIN) && m_retained) ? m_retained.get() : nullptr;
+    std::unique_lock<std::mutex> cached;
+    if (retained != nullptr) {
+        cached = std::unique_lock<std::mutex>(retained->lock);
+        retained->store(frame);
+    }
+
+    // local subscribers read it from the ring, fanned out by one copy
+    Shared* shared = (worker != nullptr && m_sharedBytes > 0) ? this->shared(worker, head->topic, false) : nullptr;
+    if (shared != nullptr && frame->size() <= shared->ring.limit()) {
+        ShmRing::Part part{ frame->data(), frame->size() };
+        shared->ring.write(&part, 1, ShmRing::BROKER);
+    } else if (shared != nullptr && (head->rsvp & MARKED) == 0) {
+        // too large: sent over their sessions, read there when they reach the marker
+        char marker[Wire::PREFIX];
+        Wire::mark(*head, marker);
+        ShmRing::Part part{ marker, sizeof(marker) };
+        shared->ring.write(&part, 1, ShmRing::BROKER);
+    }
+
+    // find out which workers own a subscriber of this topic
+    std::shared_ptr<const RouteTable> table{};
+    const std::vector<Route>* subs = nullptr;
+    if (worker != nullptr) {
+        subs = lookup(*worker, head->topic);
+        frame->routed(worker->version);
+    } else {
+        frame->routed(m_version.load(std::memory_order_acquire));
+        table = std::atomic_load(&m_routes);
+        if (table) {
+            auto it = table->topics.find(head->topic);
+            if (it != table->topics.end())
+                subs = it->second.get();
+        }
+    }
+    if (cached)
+        cached.unlock();
+    LOGI("start proxy task, subs(%d), topic 0x%04x, size %u.",
+        (subs != nullptr ? subs->size() : 0), head->topic, head->size);
+    if (subs == nullptr) {
+        LOGW("No subscriber to publish!");
+        frame->release();
+        return;
+    }
+    std::bitset<MAX_WORKERS> targets{};
+    for (const auto& route : *subs) {
+        if (route.worker < m_workers.size())
+            targets.set(route.worker);
+    }
+    for (size_t i = 0; i < m_workers.size(); ++i) {
+        if (!targets.test(i) || (worker != nullptr && i == worker->index))
+            continue;
+        frame->retain();
+        if (mq_push(&m_workers[i]->inbox, frame) != 0) {
+            // the peer worker is INBOX_SIZE frames behind: its subscribers are
+            // slow consumers, counted and handled by the queue policy
+            LOGW("Inbox of worker %zu is full, message of topic 0x%04x dropped!", i, head->topic);
+            frame->release();
+            bool evict = false;
+            for (const auto& route : *subs) {
+                if (route.worker != i || !route.backlog || frame->size() <= route.ring)
+                    continue;
+                route.backlog->dropped.fetch_add(1, std::memory_order_relaxed);
+                if (m_queue.policy == DISCONNECT) {
+                    route.backlog->evict.store(true, std::memory_order_relaxed);
+                    evict = true;
+                }
+            }
+            if (evict) {
+                m_workers[i]->evict.store(true, std::memory_order_release);
+                m_workers[i]->reactor.notify();
+            }
+            continue;
+        }
+        m_workers[i]->reactor.notify();
+    }
+    if (worker != nullptr && targets.test(worker->index)) {
+        // earlier sequences handed over to this worker go out first
+        if (history != nullptr)
+            drain(*worker);
+        deliver(*worker, frame);
+    }
+    frame->release();
+}
+
+Broker::History* Broker::history(Worker* worker, uint32_t topic)
+{
+    if (worker != nullptr) {
+        auto cached = worker->histories.find(topic);
+        if (cached != worker->histories.end())
+            return cached->second;
+    }
+    std::lock_guard<std::mutex> lock(m_historyLock);
+    auto& entry = m_histories[topic];
+    if (!entry) {
+        entry = std::make_shared<History>();
+        entry->keep = (m_historySize > 0 || m_multicast.count(topic) == 0) ? m_historySize : MULTICAST_HISTORY;
+        if (m_journal) {
+            char name[16];
+            snprintf(name, sizeof(name), "%08x", topic);
+            auto log = std::make_shared<SegmentLog>();
+            if (log->open(m_journal->dir + "/" + name, m_journal->policy.segmentBytes,
+                m_journal->policy.indexInterval) == 0)
+                entry->log = log;
+            else
+                LOGE("Open log of topic 0x%04x under %s: %s!", topic, m_journal->dir.c_str(), strerror(errno));
+        }
+    }
+    if (worker != nullptr)
+        worker->histories[topic] = entry.get();
+    return entry.get();
+}
+
+// the sequence of the publish, -1 if the log failed it
+int64_t Broker::record(History& history, Frame* frame)
+{
+    const Header* head = frame->head();
+    auto time = static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count());
+    if (!history.log) {
+        if (history.keep > 0) {
+            frame->retain();
+            history.ring.push_back(History::Stored{ history.next, time, frame });
+            while (history.ring.size() > history.keep) {
+                history.ring.front().frame->release();
+                history.ring.pop_front();
+            }
+        }
+        return static_cast<int64_t>(history.next++);
+    }
+    int64_t seq = history.log->append(frame->data(), head->size, time);
+    if (seq < 0) {
+        LOGE("Append to log of topic 0x%04x failed: %s!", head->topic, strerror(errno));
+        return -1;
+    }
+    Journal& journal = *m_journal;
+    if (journal.policy.flushMessages > 0 && history.log->unsynced() == journal.policy.flushMessages) {
+        std::lock_guard<std::mutex> lock(journal.waitLock);
+        journal.kick = true;
+        journal.cond.notify_one();
+    }
+    return seq;
+}
+
+void Broker::subscribeFrom(Session* ss, Frame* frame)
+{
+    const Header& head = ss->work.head;
+    uint64_t value = 0;
+    memcpy(&value, frame->data() + HEAD_SIZE, sizeof(value));
+    History* history = (m_journal || m_historySize > 0) ? this->history(ss->owner, head.topic) : nullptr;
+    if (history == nullptr) {
+        LOGW("No history kept, topic 0x%04x subscribed live.", head.topic);
+        if (!subscribeLive(ss))
+            closeSession(ss, CLOSE_SEND);
+        return;
+    }
+    uint64_t first = 0;
+    uint64_t end = 0;
+    uint64_t from = 0;
+    {
+        // publishes before `end` are recorded, the later ones see the route
+        std::lock_guard<std::mutex> lock(history->lock);
+        end = history->last();
+        first = history->first();
+        ss->since = addRoute(head.topic, ss);
+        if (head.rsvp == START_TIME && !history->log) {
+            from = end;
+            for (const auto& stored : history->ring) {
+                if (stored.time >= value) {
+                    from = stored.seq;
+                    break;
+                }
+            }
+        }
+    }
+    switch (head.rsvp) {
+    case START_EARLIEST: from = first; break;
+    case START_SEQUENCE: from = std::min(std::max(value, first), end); break;
+    case START_TIME: from = history->log ? std::min(history->log->seek(value), end) : from; break;
+    default: from = end; break;
+    }
+    LOGI("subscriber %d of topic 0x%04x starts at %llu, replays %llu.",
+        ss->work.socket, head.topic, from, end - from);
+    // announce the position, the client counts from it
+    Frame* position = Frame::create(HEAD_SIZE + STATUS_SIZE);
+    if (position == nullptr) {
+        closeSession(ss, CLOSE_RESOURCE);
+        return;
+    }
+    Header* announce = position->head();
+    memset(announce, 0, HEAD_SIZE);
+    announce->cmd = 0x20;
+    announce->flag = BROKER;
+    announce->size = HEAD_SIZE + STATUS_SIZE;
+    announce->topic = head.topic;
+    memcpy(position->data() + HEAD_SIZE, &from, sizeof(from));
+    ss->outq.emplace_back(position);
+    ss->outBytes += position->size();
+    ss->replay.history = history;
+    ss->replay.next = from;
+    ss->replay.end = end;
+    ss->replaying = true;
+    if (!pump(ss))
+        closeSession(ss, CLOSE_SEND);
+}
+
+// the answer to a shared memory (0x30) or multicast (0x40) request: where to
+// read the topic from at the position on, empty to stay on TCP
+static Frame* offerFrame(uint8_t cmd, uint32_t topic, const std::string& name, uint64_t position)
+{
+    Frame* frame = Frame::create(HEAD_SIZE + STATUS_SIZE + name.size() + 1);
+    if (frame == nullptr)
+        return nullptr;
+    Header* head = frame->head();
+    memset(head, 0, HEAD_SIZE);
+    head->cmd = cmd;
+    head->flag = BROKER;
+    head->size = static_cast<uint32_t>(frame->size());
+    head->topic = topic;
+    memcpy(frame->data() + HEAD_SIZE, &position, sizeof(position));
+    memcpy(frame->data() + HEAD_SIZE + STATUS_SIZE, name.c_str(), name.size() + 1);
+    return frame;
+}
+
+/*
+ * Routes the subscriber, the retained value of its topic goes out first.
+ * One asking for a fan-out (0x40) reads from shared memory on this host,
+ * else from the multicast group of a topic that has one, without a route.
+ */
+bool Broker::subscribeLive(Session* ss)
+{
+    uint32_t topic = ss->work.head.topic;
+    const uint8_t cmd = ss->work.head.cmd;
+    Shared* shared = ((cmd == 0x30 || (cmd == 0x40 && localPeer(ss->work.socket))) && m_sharedBytes > 0) ?
+        this->shared(ss->owner, topic, true) : nullptr;
+    ss->group = (cmd == 0x40 && shared == nullptr && !m_multicast.empty()) ? group(topic) : nullptr;
+    History* history = (ss->group != nullptr) ? this->history(ss->owner, topic) : nullptr;
+    Frame* last = nullptr;
+    uint64_t position = 0;
+    {
+        // in the order route() takes them
+        std::unique_lock<std::mutex> ordered{};
+        if (history != nullptr)
+            ordered = std::unique_lock<std::mutex>(history->lock);
+        std::unique_lock<std::mutex> lock{};
+        if (m_retained) {
+            lock = std::unique_lock<std::mutex>(m_retained->lock);
+            last = m_retained->find(topic);
+        }
+        if (shared != nullptr) {
+            position = shared->ring.position();
+            ss->ring = &shared->ring;
+        }
+        if (history != nullptr)
+            position = history->last();
+        else
+            ss->since = addRoute(topic, ss);
+    }
+    if (last != nullptr) {
+        LOGI("retained message of topic 0x%04x to subscriber %d, size %zu.", topic, ss->work.socket, last->size());
+        bool kept = enqueue(ss, last);
+        last->release();
+        if (!kept)
+            return false;
+    }
+    if (shared != nullptr || ss->group != nullptr) {
+        // the ring or group takes over from the position, after the retained value
+        const std::string& name = (shared != nullptr) ? shared->ring.name() : ss->group->offer;
+        Frame* offer = offerFrame((shared != nullptr) ? 0x30 : 0x40, topic, name, position);
+        if (offer == nullptr)
+            return false;
+        ss->outq.emplace_back(offer);
+        ss->outBytes += offer->size();
+        LOGI("subscriber %d reads topic 0x%04x from %s at %llu.", ss->work.socket, topic, name.c_str(), position);
+    }
+    return flush(ss);
+}
+
+// a publisher on this host asks for the ring of a topic; none when the
+// topic is kept for replay, a lapped bridge would leave gaps in it
+void Broker::offerRing(Session* ss)
+{
+    uint32_t topic = ss->head.topic;
+    bool kept = m_journal || m_historySize > 0 || group(topic) != nullptr;
+    Shared* shared = (m_sharedBytes > 0 && !kept) ? this->shared(ss->owner, topic, true) : nullptr;
+    Frame* offer = offerFrame(0x30, topic, (shared != nullptr) ? shared->ring.name() : std::string(), 0);
+    if (offer == nullptr) {
+        closeSession(ss, CLOSE_RESOURCE);
+        return;
+    }
+    ss->outq.emplace_back(offer);
+    ss->outBytes += offer->size();
+    if (!flush(ss))
+        closeSession(ss, CLOSE_SEND);
+}
+
+Broker::Shared* Broker::shared(Worker* worker, uint32_t topic, bool create)
+{
+    uint64_t version = m_sharedVersion.load(std::memory_order_acquire);
+    if (worker->ringVersion != version) {
+        worker->rings.clear();
+        worker->ringVersion = version;
+    }
+    auto cached = worker->rings.find(topic);
+    if (cached != worker->rings.end() && (cached->second != nullptr || !create))
+        return cached->second;
+    std::lock_guard<std::mutex> lock(m_sharedLock);
+    auto it = m_shared.find(topic);
+    Shared* found = (it != m_shared.end()) ? it->second.get() : nullptr;
+    if (found == nullptr && create) {
+        auto made = std::make_shared<Shared>();
+        char name[64];
+        snprintf(name, sizeof(name), "/scadup.%d.%08x", static_cast<int>(getpid()), topic);
+        if (made->ring.create(name, m_sharedBytes) == 0) {
+            made->stats = m_metrics->shard();
+            made->running = true;
+            made->bridge = std::thread(&Broker::bridge, this, made.get());
+            m_shared[topic] = made;
+            m_sharedVersion.fetch_add(1, std::memory_order_release);
+            found = made.get();
+        } else {
+            LOGE("Shared memory %s of %zu bytes: %s!", name, m_sharedBytes, strerror(errno));
+        }
+    }
+    worker->rings[topic] = found;
+    return found;
+}
+
+// routes what local publishers wrote into the ring to everybody else
+void Broker::bridge(Shared* shared)
+{
+    ShmRing& ring = shared->ring;
+    uint64_t pos = 0; // from its creation, a publisher may write before the thread runs
+    std::vector<char> buffer(ring.limit() * 2);
+    while (shared->running.load(std::memory_order_acquire)) {
+        long got = ring.read(pos, buffer.data(), buffer.size(), ShmRing::CLIENT);
+        if (got < 0) {
+            LOGW("Bridge of %s lapped, messages lost for TCP subscribers!", ring.name().c_str());
+            continue;
+        }
+        if (got == 0) {
+            ring.wait(pos, HEARTBEAT_INTERVAL);
+            continue;
+        }
+        size_t off = 0;
+        while (off + HEAD_SIZE <= static_cast<size_t>(got)) {
+            Header head{};
+            memcpy(static_cast<void*>(&head), &buffer[off], HEAD_SIZE);
+            if (head.cmd == Wire::MARKER && head.size == Wire::PREFIX) {
+                off += head.size; // its publish comes over TCP
+                continue;
+            }
+            if (head.flag != PUBLISHER || head.size < HEAD_SIZE + STATUS_SIZE || off + head.size > static_cast<size_t>(got)) {
+                LOGW("Invalid record(%d, %u) in %s!", head.flag, head.size, ring.name().c_str());
+                break;
+            }
+            Frame* frame = Frame::create(head.size);
+            if (frame != nullptr) {
+                memcpy(frame->data(), &buffer[off], head.size);
+                frame->ingest(Metrics::now());
+                if (Wire::trailer(head) != 0)
+                    Wire::stamp(frame->data(), head.size, Wire::HOP_RECEIVE);
+                shared->stats->ingest(head.topic, head.size);
+                route(nullptr, frame);
+            }
+            off += head.size;
+        }
+    }
+}
+
+Broker::Multicast* Broker::group(uint32_t topic)
+{
+    auto it = m_multicast.find(topic);
+    return (it != m_multicast.end() && it->second->socket >= 0) ? it->second.get() : nullptr;
+}
+
+// a multicast subscriber missed [from, to): announced by 0x41, then sent again in order
+void Broker::resend(Session* ss, Frame* request)
+{
+    uint64_t range[2]{};
+    if (request->size() < HEAD_SIZE + sizeof(range))
+        return;
+    memcpy(range, request->data() + HEAD_SIZE, sizeof(range));
+    uint32_t topic = ss->work.head.topic;
+    History* history = (ss->group != nullptr) ? this->history(ss->owner, topic) : nullptr;
+    std::vector<Frame*> frames{};
+    uint64_t first = range[1];
+    if (history != nullptr && range[0] < range[1]) {
+        if (history->log) {
+            history->log->read(range[0], CATCHUP_CHUNK, [&](const SegmentLog::Record& rec) {
+                if (rec.seq >= range[1])
+                    return false;
+                Frame* frame = Frame::create(rec.size);
+                if (frame == nullptr)
+                    return false;
+                memcpy(frame->data(), rec.data, rec.size);
+                if (frames.empty())
+                    first = rec.seq;
+                frames.emplace_back(frame);
+                return true;
+            });
+        } else {
+            std::lock_guard<std::mutex> lock(history->lock);
+            if (!history->ring.empty()) {
+                uint64_t oldest = history->ring.front().seq;
+                first = std::min(std::max(range[0], oldest), range[1]);
+                size_t bytes = 0;
+                for (uint64_t seq = first; seq < range[1] && seq - oldest < history->ring.size()
+                    && bytes < CATCHUP_CHUNK; ++seq) {
+                    Frame* frame = history->ring[static_cast<size_t>(seq - oldest)].frame;
+                    frame->retain();
+                    frames.emplace_back(frame);
+                    bytes += frame->size();
+                }
+            }
+        }
+    }
+    if (first > range[0])
+        LOGW("Gap %llu..%llu of topic 0x%04x out of history!", range[0], first, topic);
+    // what was asked, and where the frames that follow end
+    uint64_t answer[3]{ range[0], range[1], first + frames.size() };
+    Frame* announce = Frame::create(HEAD_SIZE + STATUS_SIZE + sizeof(answer));
+    if (announce == nullptr) {
+        for (Frame* frame : frames) {
+            frame->release();
+        }
+        closeSession(ss, CLOSE_RESOURCE);
+        return;
+    }
+    Header* head = announce->head();
+    memset(head, 0, HEAD_SIZE);
+    head->cmd = 0x41;
+    head->flag = BROKER;
+    head->size = static_cast<uint32_t>(announce->size());
+    head->topic = topic;
+    memcpy(announce->data() + HEAD_SIZE, &first, sizeof(first));
+    memcpy(announce->data() + HEAD_SIZE + STATUS_SIZE, answer, sizeof(answer));
+    ss->outq.emplace_back(announce);
+    ss->outBytes += announce->size();
+    for (Frame* frame : frames) {
+        ss->outq.emplace_back(frame);
+        ss->outBytes += frame->size();
+    }
+    if (!flush(ss))
+        closeSession(ss, CLOSE_SEND);
+}
+
+// tells the groups the next sequence, a subscriber missing the last ones learns it here
+void Broker::beat(Worker& worker)
+{
+    for (auto& it : m_multicast) {
+        Multicast* multicast = group(it.first);
+        History* history = (multicast != nullptr) ? this->history(&worker, it.first) : nullptr;
+        if (history == nullptr)
+            continue;
+        std::lock_guard<std::mutex> lock(history->lock);
+        GroupHead head{ history->last(), it.first, GROUP_BEAT };
+        sendGroup(multicast->socket, multicast->group, head, nullptr);
+    }
+}
+
+bool Broker::pump(Session* ss)
+{
+    History& history = *ss->replay.history;
+    while (ss->replaying && ss->outBytes < CATCHUP_WINDOW) {
+        auto& replay = ss->replay;
+        if (replay.next >= replay.end) {
+            // caught up, the live frames held meanwhile follow in order
+            ss->replaying = false;
+            while (!ss->held.empty()) {
+                Frame* frame = ss->held.front();
+                ss->held.pop_front();
+                bool kept = enqueue(ss, frame);
+                frame->release();
+                if (!kept)
+                    return false;
+            }
+            LOGI("subscriber %d caught up at %llu.", ss->work.socket, replay.end);
+            break;
+        }
+        if (history.log) {
+            // records are whole frames, copied back to back into one write
+            // as the session reads them (compact ones are never longer)
+            size_t need = CATCHUP_CHUNK;
+            Frame* chunk = Frame::create(need);
+            if (chunk == nullptr)
+                return false;
+            chunk->raw(true);
+            size_t used = 0;
+            auto copy = [ss, &chunk, &used](const SegmentLog::Record& rec) {
+                size_t skip = 0;
+                used += wireFrame(ss->version, rec.data, rec.size, chunk->data() + used, skip);
+                memcpy(chunk->data() + used, rec.data + skip, rec.size - skip);
+                used += rec.size - skip;
+            };
+            history.log->read(replay.next, 0, [&](const SegmentLog::Record& rec) {
+                if (rec.seq >= replay.end)
+                    return false;
+                if (used + rec.size > chunk->size()) {
+                    need = rec.size;
+                    return false;
+                }
+                copy(rec);
+                replay.next = rec.seq + 1;
+                return true;
+            });
+            if (used == 0 && need > CATCHUP_CHUNK) {
+                // a single record larger than a chunk
+                chunk->release();
+                chunk = Frame::create(need);
+                if (chunk == nullptr)
+                    return false;
+                chunk->raw(true);
+                history.log->read(replay.next, 0, [&](const SegmentLog::Record& rec) {
+                    copy(rec);
+                    replay.next = rec.seq + 1;
+                    return false;
+                });
+            }
+            if (used == 0) {
+                chunk->release();
+                LOGW("Replay of topic 0x%04x stopped at %llu, log unreadable!", ss->work.head.topic, replay.next);
+                replay.next = replay.end;
+                continue;
+            }
+            chunk->resize(used);
+            ss->outq.emplace_back(chunk);
+            ss->outBytes += used;
+        } else {
+            std::lock_guard<std::mutex> lock(history.lock);
+            if (history.ring.empty() || replay.next < history.ring.front().seq) {
+                uint64_t kept = history.ring.empty() ? replay.end : history.ring.front().seq;
+                LOGW("Replay of topic 0x%04x skips %llu..%llu, out of history!",
+                    ss->work.head.topic, replay.next, kept);
+                replay.next = std::min(kept, replay.end);
+                continue;
+            }
+            size_t index = static_cast<size_t>(replay.next - history.ring.front().seq);
+            size_t bytes = 0;
+            for (; index < history.ring.size() && replay.next < replay.end && bytes < CATCHUP_CHUNK; ++index) {
+                Frame* frame = history.ring[index].frame;
+                frame->retain();
+                ss->outq.emplace_back(frame);
+                ss->outBytes += frame->size();
+                bytes += frame->size();
+                replay.next++;
+            }
+        }
+        if (!flush(ss))
+            return false;
+    }
+    if (ss->backlog) {
+        ss->backlog->messages.store(ss->outq.size(), std::memory_order_relaxed);
+        ss->backlog->bytes.store(ss->outBytes, std::memory_order_relaxed);
+    }
+    return flush(ss);
+}
+
+void Broker::flusher()
+{
+    Journal& journal = *m_journal;
+    std::vector<std::shared_ptr<SegmentLog>> logs;
+    std::unique_lock<std::mutex> lock(journal.waitLock);
+    while (journal.running) {
+        auto ready = [&journal] { return journal.kick || !journal.running; };
+        if (journal.policy.flushInterval > 0)
+            journal.cond.wait_for(lock, std::chrono::milliseconds(journal.policy.flushInterval), ready);
+        else
+            journal.cond.wait(lock, ready);
+        journal.kick = false;
+        lock.unlock();
+        {
+            std::lock_guard<std::mutex> guard(m_historyLock);
+            logs.clear();
+            for (const auto& entry : m_histories) {
+                if (entry.second->log)
+                    logs.emplace_back(entry.second->log);
+            }
+        }
+        for (const auto& log : logs) {
+            if (log->unsynced() > 0 && log->sync() != 0)
+                LOGE("Sync log under %s failed: %s!", journal.dir.c_str(), strerror(errno));
+        }
+        lock.lock();
+    }
+}
+
+// a traced publish of its own for one subscriber, as its later hops differ
+// by queue; the shared one, retained, if there is no memory for it
+static Frame* traceCopy(Frame* frame)
+{
+    Frame* copy = Frame::create(frame->size());
+    if (copy == nullptr) {
+        frame->retain();
+        return frame;
+    }
+    memcpy(copy->data(), frame->data(), frame->size());
+    copy->routed(frame->routed());
+    copy->ingest(frame->ingest());
+    copy->traced(true);
+    Wire::stamp(copy->data(), copy->size(), Wire::HOP_ENQUEUE);
+    return copy;
+}
+
+void Broker::deliver(Worker& worker, Frame* frame)
+{
+    const Header* head = frame->head();
+    const std::vector<Route>* subs = lookup(worker, head->topic);
+    if (subs == nullptr)
+        return;
+    const uint64_t now = Metrics::now();
+    const bool traced = Wire::trailer(*head) != 0;
+    std::vector<std::pair<Session*, G_CloseReason>> dead;
+    for (const auto& route : *subs) {
+        if (route.worker != worker.index)
+            continue;
+        Session* ss = route.session;
+        if (ss->closed) {
+            LOGW("No valid subscriber of topic %04x!", head->topic);
+            continue;
+        }
+        // routed before the subscriber registered: replayed or predating it
+        if (frame->routed() < ss->since)
+            continue;
+        if (ss->ring != nullptr && frame->size() <= ss->ring->limit())
+            continue; // in the ring already
+        if (ss->replaying) {
+            frame->retain();
+            ss->held.emplace_back(frame);
+            continue;
+        }
+        Frame* own = traced ? traceCopy(frame) : frame;
+        bool queued = enqueue(ss, own);
+        if (traced)
+            own->release();
+        if (!queued || !flush(ss)) {
+            LOGE("Write to sock[%d], size %u failed!", ss->work.socket, head->size);
+            dead.emplace_back(ss, queued ? CLOSE_SEND : CLOSE_QUEUE);
+            continue;
+        }
+        worker.stats->sent(head->topic, head->size, now - frame->ingest());
+        LOGI("writes message to subscriber[%s:%u], size %u!", ss->work.IP, ss->work.PORT, head->size);
+    }
+    for (auto& it : dead) {
+        closeSession(it.first, it.second);
+    }
+}
+
+void Broker::setOffline(Networks& works, SOCKET socket)
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    for (auto it = works.begin(); it != works.end(); ++it) {
+        std::vector<Network>& vec = it->second;
+        for (auto wk = vec.begin(); wk != vec.end(); ++wk) {
+            if (wk->socket != socket)
+                continue;
+            LOGI("delete offline client %s:%u", wk->IP, wk->PORT);
+            vec.erase(wk);
+            if (vec.empty()) {
+                LOGI("works key(%s) is null deleted! now size=%d", GET_FLAG(it->first), works.size() - 1);
+                works.erase(it);
+            }
+            return;
+        }
+    }
+}
+
+void Broker::onTimer(Session* ss)
+{
+    if (ss->closed)
+        return;
+    Worker& worker = *ss->owner;
+    const bool handshake = (ss->stage == Session::HANDSHAKE || !ss->registered);
+    unsigned int limit = handshake ? HANDSHAKE_TIMEOUT : m_idleTimeout;
+    if (limit == 0)
+        return;
+    // traffic only stamps lastSeen, the deadline is moved here when it comes due
+    uint64_t deadline = ss->lastSeen + limit;
+    if (worker.now >= deadline) {
+        LOGW("Socket %d (%s:%u) silent for %llu ms, closing.", ss->work.socket, ss->work.IP, ss->work.PORT,
+            (unsigned long long)(worker.now - ss->lastSeen));
+        closeSession(ss, handshake ? CLOSE_HANDSHAKE : CLOSE_IDLE);
+        return;
+    }
+    worker.timers.schedule(&ss->timer, deadline - worker.now);
+}
+
+void Broker::onAccept(Worker& worker, SOCKET listener)
+{
+    const bool local = (listener != worker.socket);
+    while (m_active) {
+        struct sockaddr_in peer { };
+        auto socklen = static_cast<socklen_t>(sizeof(peer));
+        SOCKET sockNew = ::accept(listener, local ? nullptr : reinterpret_cast<struct sockaddr*>(&peer),
+            local ? nullptr : &socklen);
+        if ((int)sockNew < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                LOGE("Socket accept (%s).", (errno != 0 ? strerror(errno) : std::to_string((int)sockNew).c_str()));
+            return;
+        }
+        worker.stats->accepted();
+        if (!local) {
+            int set = 1;
+            setsockopt(sockNew, SOL_SOCKET, SO_KEEPALIVE, reinterpret_cast<const char*>(&set), sizeof(set));
+            // writes are already batched per wakeup, Nagle would only add delay
+            setsockopt(sockNew, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&set), sizeof(set));
+        } else {
+            // unix peers are unnamed, the ssid is made as for loopback
+            peer.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        }
+        Reactor::setNonBlock(sockNew);
+        auto* ss = new Session{};
+        ss->owner = &worker;
+        Network& work = ss->work;
+        char addr[INET_ADDRSTRLEN];
+        const char* ip = inet_ntop(AF_INET, &peer.sin_addr, addr, INET_ADDRSTRLEN);
+        snprintf(work.IP, sizeof(work.IP), "%s", ip != nullptr ? ip : "");
+        work.PORT = ntohs(peer.sin_port);
+        work.socket = sockNew;
+        work.worker = worker.index;
+        LOGI("accepted peer address [%s:%u]", work.IP, work.PORT);
+        ss->ssid = setSession(work.IP, work.PORT, sockNew);
+        ss->lastSeen = worker.now;
+        ss->timer.data = ss;
+        worker.timers.schedule(&ss->timer, HANDSHAKE_TIMEOUT);
+        worker.sessions[sockNew] = ss;
+        Frame* hello = Frame::create(HEAD_SIZE);
+        if (hello != nullptr) {
+            Header* head = hello->head();
+            memset(head, 0, HEAD_SIZE);
+            head->rsvp = m_wireVersion; // versions offered, the client may answer with one
+            head->flag = BROKER;
+            head->size = HEAD_SIZE;
+            head->ssid = ss->ssid;
+            ss->outq.emplace_back(hello);
+            ss->outBytes += hello->size();
+        }
+        if (hello == nullptr || worker.reactor.add(sockNew, Reactor::READ, ss) != 0 || !flush(ss)) {
+            LOGE("Write to sock %d ssid %llu failed!", sockNew, ss->ssid);
+            closeSession(ss, CLOSE_SEND);
+        }
+    }
+}
+
+// messages handed over by other workers
+void Broker::drain(Worker& worker)
+{
+    void* batch[64];
+    int handed;
+    while ((handed = mq_pop_batch(&worker.inbox, batch, 64)) > 0) {
+        for (int i = 0; i < handed; ++i) {
+            auto* frame = static_cast<Frame*>(batch[i]);
+            deliver(worker, frame);
+            frame->release();
+        }
+    }
+}
+
+void Broker::loop(Worker& worker)
+{
+    Reactor& reactor = worker.reactor;
+    worker.now = TimerWheel::now();
+    while (m_active) {
+        int timeout = worker.timers.timeout(worker.now);
+        if (worker.index == 0 && !m_multicast.empty())
+            timeout = (timeout < 0) ? static_cast<int>(HEARTBEAT_INTERVAL) : std::min<int>(timeout, HEARTBEAT_INTERVAL);
+        int count = reactor.wait((timeout < 0 || timeout > 3000) ? 3000 : timeout);
+        if (count < 0) {
+            LOGE("Reactor wait (%s).", strerror(errno));
+            break;
+        }
+        worker.now = TimerWheel::now();
+        for (int i = 0; i < count; ++i) {
+            const Reactor::Event& ev = reactor.event(i);
+            if (ev.data == nullptr || ev.data == &m_unixSocket) {
+                onAccept(worker, ev.data == nullptr ? worker.socket : m_unixSocket);
+                continue;
+            }
+            auto* ss = static_cast<Session*>(ev.data);
+            if (ss->closed)
+                continue;
+            if ((ev.events & Reactor::WRITE) && (!flush(ss) || (ss->replaying && !pump(ss)))) {
+                LOGE("Write to sock[%d] failed!", ss->work.socket);
+                closeSession(ss, CLOSE_SEND);
+                continue;
+            }
+            if (ev.events & Reactor::READ)
+                onReadable(ss);
+            if ((ev.events & Reactor::FAULT) && !ss->closed && !reap(ss))
+                closeSession(ss, CLOSE_RECV);
+        }
+        drain(worker);
+        if (worker.evict.exchange(false, std::memory_order_acquire)) {
+            // frames for them were dropped at the inbox, as if their queues were full
+            std::vector<Session*> dead;
+            for (auto& it : worker.sessions) {
+                Session* ss = it.second;
+                if (!ss->closed && ss->backlog && ss->backlog->evict.exchange(false, std::memory_order_relaxed))
+                    dead.emplace_back(ss);
+            }
+            for (auto* ss : dead) {
+                LOGW("Subscriber[%s:%u] missed messages at a full inbox, disconnect!", ss->work.IP, ss->work.PORT);
+                closeSession(ss, CLOSE_QUEUE);
+            }
+        }
+        if (worker.index == 0 && !m_multicast.empty() && worker.now >= worker.beat) {
+            beat(worker);
+            worker.beat = worker.now + HEARTBEAT_INTERVAL;
+        }
+        // heartbeat, handshake and idle deadlines
+        worker.due.clear();
+        worker.timers.advance(worker.now, worker.due);
+        for (auto* timer : worker.due) {
+            onTimer(static_cast<Session*>(timer->data));
+        }
+        for (auto* ss : worker.closed) {
+            delete ss;
+        }
+        worker.closed.clear();
+    }
+
+    std::vector<Session*> sessions;
+    for (auto& it : worker.sessions) {
+        sessions.emplace_back(it.second);
+    }
+    for (auto* ss : sessions) {
+        closeSession(ss, CLOSE_SHUTDOWN);
+    }
+    for (auto* ss : worker.closed) {
+        delete ss;
+    }
+    worker.closed.clear();
+    LOGI("worker %u loop has exit.", worker.index);
+}
+
+int Broker::broker()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (m_workers.empty() || !m_active) {
+            LOGE("Broker was not setup!");
+            return -1;
+        }
+        m_looping = true;
+    }
+    if (m_journal && (m_journal->policy.flushMessages > 0 || m_journal->policy.flushInterval > 0)) {
+        m_journal->running = true;
+        m_journal->thread = std::thread(&Broker::flusher, this);
+    }
+    if (m_metricsSocket >= 0)
+        m_metricsThread = std::thread(&Broker::serveMetrics, this);
+    for (size_t i = 1; i < m_workers.size(); ++i) {
+        Worker* worker = m_workers[i];
+        worker->thread = std::thread([this, worker]() { loop(*worker); });
+    }
+    loop(*m_workers[0]);
+    m_active = false;
+    for (auto* worker : m_workers) {
+        worker->reactor.notify();
+        if (worker->thread.joinable())
+            worker->thread.join();
+    }
+    if (m_journal && m_journal->thread.joinable()) {
+        {
+            std::lock_guard<std::mutex> lock(m_journal->waitLock);
+            m_journal->running = false;
+        }
+        m_journal->cond.notify_one();
+        m_journal->thread.join();
+    }
+    if (m_metricsThread.joinable()) {
+        // wakes the accept
+#ifdef _WIN32
+        shutdown(m_metricsSocket, SD_BOTH);
+#else
+        shutdown(m_metricsSocket, SHUT_RDWR);
+#endif
+        m_metricsThread.join();
+    }
+    release();
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_looping = false;
+    }
+    PoolStats pool = poolStats();
+    LOGI("broker loop has exit, pool hits %zu, refills %zu, misses %zu, oversize %zu, slabs %zu KiB.",
+        pool.hits, pool.refills, pool.misses, pool.oversize, pool.slabBytes / 1024);
+    return 0;
+}
+
+void Broker::release()
+{
+    std::map<uint32_t, std::shared_ptr<Shared>> shared{};
+    {
+        std::lock_guard<std::mutex> lock(m_sharedLock);
+        shared.swap(m_shared);
+    }
+    shared.clear(); // the bridges hand over to workers, stopped first
+    std::unique_lock<std::mutex> guard(m_lock); // exit() may still be notifying
+    for (auto* worker : m_workers) {
+        // drain message queue: drop the references handed over
+        void* ft;
+        while ((ft = mq_take(&worker->inbox)) != nullptr) {
+            static_cast<Frame*>(ft)->release();
+        }
+        mq_deinit(&worker->inbox);
+        if (worker->socket > 0) {
+            Close(worker->socket);
+            worker->socket = -1;
+        }
+        DelPtr(worker);
+    }
+    m_workers.clear();
+    for (auto& it : m_multicast) {
+        if (it.second->socket >= 0) {
+            Close(it.second->socket);
+            it.second->socket = -1;
+        }
+    }
+    if (m_unixSocket >= 0) {
+        Close(m_unixSocket);
+        m_unixSocket = -1;
+#ifndef _WIN32
+        unlink(m_unixPath.c_str());
+#endif
+    }
+    if (m_metricsSocket >= 0) {
+        Close(m_metricsSocket);
+        m_metricsSocket = -1;
+    }
+    guard.unlock();
+    {
+        std::lock_guard<std::mutex> lock(m_routeLock);
+        std::atomic_store(&m_routes, std::shared_ptr<const RouteTable>());
+        m_version.fetch_add(1, std::memory_order_release);
+    }
+    {
+        // closing a log syncs what the flusher has not
+        std::lock_guard<std::mutex> lock(m_historyLock);
+        m_histories.clear();
+    }
+    m_retained.reset();
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_networks.clear();
+    }
+    std::lock_guard<std::mutex> lock(m_backlogLock);
+    m_backlogs.clear();
+}
+
+void Broker::setZeroCopy(size_t threshold)
+{
+    m_zeroCopy = threshold;
+}
+
+int Broker::setMulticast(uint32_t topic, const char* group, unsigned short port, const char* iface)
+{
+    if (group == nullptr || *group == '\0') {
+        m_multicast.erase(topic);
+        return 0;
+    }
+    auto multicast = std::make_shared<Multicast>();
+    multicast->group.sin_family = AF_INET;
+    multicast->group.sin_port = htons(port);
+    multicast->iface.s_addr = htonl(INADDR_ANY);
+    if (inet_pton(AF_INET, group, &multicast->group.sin_addr) != 1
+        || (ntohl(multicast->group.sin_addr.s_addr) >> 28) != 0xe
+        || (iface != nullptr && inet_pton(AF_INET, iface, &multicast->iface) != 1)) {
+        LOGE("Multicast group %s:%u on %s invalid!", group, port, (iface != nullptr ? iface : "any"));
+        return -1;
+    }
+    multicast->offer = std::string(group) + ":" + std::to_string(port) + " " + (iface != nullptr ? iface : "0.0.0.0");
+    m_multicast[topic] = multicast;
+    return 0;
+}
+
+void Broker::setWireVersion(uint8_t version)
+{
+    m_wireVersion = std::min<uint8_t>(std::max<uint8_t>(version, 1), WIRE_VERSION);
+}
+
+void Broker::setVerify(bool verify)
+{
+    m_verify = verify;
+}
+
+void Broker::setMetrics(unsigned short port)
+{
+    m_metricsPort = port;
+}
+
+void Broker::setUnixSocket(const char* path)
+{
+    m_unixPath = (path != nullptr) ? path : "";
+}
+
+void Broker::setIdleTimeout(unsigned int ms)
+{
+    m_idleTimeout = ms;
+}
+
+int Broker::setDurable(const char* dir, const LogPolicy& policy)
+{
+    if (dir == nullptr || *dir == '\0') {
+        m_journal.reset();
+        return 0;
+    }
+#ifdef _WIN32
+    LOGE("Durable mode unsupported on this platform!");
+    return -1;
+#else
+    if (::mkdir(dir, 0755) != 0 && errno != EEXIST) {
+        LOGE("Durable directory %s unusable: %s!", dir, strerror(errno));
+        return -1;
+    }
+    auto journal = std::make_shared<Journal>();
+    journal->dir = dir;
+    journal->policy = policy;
+    m_journal = journal;
+    return 0;
+#endif
+}
+
+void Broker::setHistory(size_t messages)
+{
+    m_historySize = messages;
+}
+
+void Broker::setSharedMemory(size_t bytes)
+{
+    m_sharedBytes = bytes;
+}
+
+void Broker::setRetainLimit(size_t bytes)
+{
+    m_retainLimit = bytes;
+}
+
+void Broker::setQueueLimit(size_t messages, size_t bytes, G_QuePolicy policy)
+{
+    m_queue.messages = messages;
+    m_queue.bytes = bytes;
+    m_queue.policy = policy;
+}
+
+std::vector<QueueDepth> Broker::queueDepth()
+{
+    std::vector<QueueDepth> depths;
+    {
+        std::lock_guard<std::mutex> lock(m_backlogLock);
+        depths.reserve(m_backlogs.size());
+        for (const auto& backlog : m_backlogs) {
+            QueueDepth depth{};
+            snprintf(depth.IP, sizeof(depth.IP), "%s", backlog->work.IP);
+            depth.PORT = backlog->work.PORT;
+            depth.topic = backlog->work.head.topic;
+            depth.messages = backlog->messages.load(std::memory_order_relaxed);
+            depth.bytes = backlog->bytes.load(std::memory_order_relaxed);
+            depth.dropped = backlog->dropped.load(std::memory_order_relaxed);
+            depths.emplace_back(depth);
+        }
+    }
+    // laggards first
+    std::sort(depths.begin(), depths.end(), [](const QueueDepth& a, const QueueDepth& b) {
+        return a.bytes > b.bytes;
+        });
+    return depths;
+}
+
+BrokerMetrics Broker::metrics()
+{
+    std::shared_ptr<Metrics> metrics = std::atomic_load(&m_metrics);
+    if (!metrics)
+        return BrokerMetrics{};
+    BrokerMetrics snapshot = metrics->snapshot();
+    snapshot.queues = queueDepth();
+    return snapshot;
+}
+
+// one scrape per connection, answered with HTTP/1.0 whatever was asked
+void Broker::serveMetrics()
+{
+    while (m_active) {
+        SOCKET sock = ::accept(m_metricsSocket, nullptr, nullptr);
+        if ((int)sock < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+#ifdef _WIN32
+        DWORD wait = 100;
+#else
+        timeval wait{ 0, 100 * 1000 };
+#endif
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&wait), sizeof(wait));
+        char request[1024];
+        ::recv(sock, request, sizeof(request), 0);
+        std::string body = Metrics::text(metrics());
+        std::string reply = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+            + std::to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+        size_t off = 0;
+        while (off < reply.size()) {
+            ssize_t sent = ::send(sock, reply.data() + off, reply.size() - off, MSG_NOSIGNAL);
+            if (sent <= 0)
+                break;
+            off += static_cast<size_t>(sent);
+        }
+        Close(sock);
+    }
+    LOGI("metrics endpoint has exit.");
+}
+
+void Broker::exit()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_active = false;
+    if (!m_looping) {
+        // set up but never run: nothing else closes the listeners
+        lock.unlock();
+        release();
+        return;
+    }
+    for (auto* worker : m_workers) {
+        worker->reactor.notify();
     }
-    mq_deinit(mq);
-    DelPtr(mq);
-    m_msgQue = nullptr;
 }
@@ -0,0 +1,100 @@
+#ifndef SCADUP_FRAME_H
+#define SCADUP_FRAME_H
+
+#include "common/Scadup.h"
+#include "../utils/Pool.h"
+#include <atomic>
+#include <cstdint>
+#include <new>
+
+namespace Scadup {
+    /*
+     * One wire frame (header, status, content) in a single allocation. It is
+     * received once, shared by every queue that sends it and freed with the
+     * last reference; the storage comes from the size-class Pool.
+     */
+    class Frame {
+    public:
+        static Frame* create(size_t size)
+        {
+            void* raw = Pool::alloc(sizeof(Frame) + size);
+            if (raw == nullptr)
+                return nullptr;
+            return new(raw) Frame(size);
+        }
+        void retain()
+        {
+            m_refs.fetch_add(1, std::memory_order_relaxed);
+        }
+        void release()
+        {
+            if (m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                this->~Frame();
+                Pool::free(this);
+            }
+        }
+        char* data()
+        {
+            return reinterpret_cast<char*>(this + 1);
+        }
+        size_t size() const
+        {
+            return m_size;
+        }
+        void resize(size_t size) // shrink only, to what was filled in
+        {
+            if (size < m_size)
+                m_size = static_cast<uint32_t>(size);
+        }
+        Header* head()
+        {
+            return reinterpret_cast<Header*>(data());
+        }
+        uint64_t routed() const // version of the route table it was routed by
+        {
+            return m_routed;
+        }
+        void routed(uint64_t version)
+        {
+            m_routed = version;
+        }
+        bool raw() const // bytes of several frames, already as the session reads them
+        {
+            return m_raw;
+        }
+        void raw(bool raw)
+        {
+            m_raw = raw;
+        }
+        uint64_t ingest() const // steady ns it was read by the broker at
+        {
+            return m_ingest;
+        }
+        void ingest(uint64_t ns)
+        {
+            m_ingest = ns;
+        }
+        bool traced() const // a traced publish copied for one subscriber, stamped when sent
+        {
+            return m_traced;
+        }
+        void traced(bool traced)
+        {
+            m_traced = traced;
+        }
+    private:
+        explicit Frame(size_t size) : m_size(static_cast<uint32_t>(size)) { }
+        ~Frame() = default;
+        Frame(const Frame&) = delete;
+        Frame& operator=(const Frame&) = delete;
+    private:
+        std::atomic<uint32_t> m_refs{ 1 };
+        uint32_t m_size;
+        uint64_t m_routed = 0;
+        uint64_t m_ingest = 0;
+        bool m_raw = false;
+        bool m_traced = false;
+    };
+}
+
+#endif // SCADUP_FRAME_H
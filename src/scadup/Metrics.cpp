@@ -0,0 +1,146 @@
+#include "Metrics.h"
+#include <algorithm>
+#include <cstdio>
+#include <map>
+
+using namespace Scadup;
+
+static const char* const CLOSE_NAMES[CLOSE_REASONS] = {
+    "quit", "peer", "recv", "send", "protocol", "handshake", "idle", "queue", "resource", "shutdown"
+};
+
+Metrics::Shard* Metrics::shard()
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_shards.emplace_back(new Shard());
+    return m_shards.back().get();
+}
+
+BrokerMetrics Metrics::snapshot()
+{
+    BrokerMetrics result{};
+    std::map<uint32_t, TopicMetrics> topics{};
+    std::vector<uint64_t> latency(BUCKETS, 0);
+    uint64_t max = 0;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        for (const auto& shard : m_shards) {
+            result.accepts += shard->m_accepts.load(std::memory_order_relaxed);
+            for (size_t i = 0; i < CLOSE_REASONS; ++i) {
+                result.closes[i] += shard->m_closes[i].load(std::memory_order_relaxed);
+            }
+            result.untracked += shard->m_untracked.load(std::memory_order_relaxed);
+            max = std::max(max, shard->m_max.load(std::memory_order_relaxed));
+            for (size_t i = 0; i < BUCKETS; ++i) {
+                latency[i] += shard->m_latency[i].load(std::memory_order_relaxed);
+            }
+            for (const auto& slot : shard->m_topics) {
+                uint64_t key = slot.key.load(std::memory_order_acquire);
+                if (key == 0)
+                    continue;
+                TopicMetrics& topic = topics[static_cast<uint32_t>(key - 1)];
+                topic.topic = static_cast<uint32_t>(key - 1);
+                topic.messagesIn += slot.messagesIn.load(std::memory_order_relaxed);
+                topic.bytesIn += slot.bytesIn.load(std::memory_order_relaxed);
+                topic.messagesOut += slot.messagesOut.load(std::memory_order_relaxed);
+                topic.bytesOut += slot.bytesOut.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    result.topics.reserve(topics.size());
+    for (const auto& it : topics) {
+        result.topics.emplace_back(it.second);
+    }
+    result.latency = summary(latency.data(), max);
+    return result;
+}
+
+LatencyMetrics Metrics::summary(const uint64_t* buckets, uint64_t max)
+{
+    LatencyMetrics stats{};
+    stats.max = max;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+        stats.count += buckets[i];
+    }
+    if (stats.count == 0)
+        return stats;
+    struct {
+        double rank;
+        uint64_t* value;
+    } marks[] = { { 0.5, &stats.p50 }, { 0.9, &stats.p90 }, { 0.99, &stats.p99 }, { 0.999, &stats.p999 } };
+    size_t mark = 0;
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS && mark < sizeof(marks) / sizeof(marks[0]); ++i) {
+        seen += buckets[i];
+        while (mark < sizeof(marks) / sizeof(marks[0]) && seen > 0
+            && static_cast<double>(seen) >= marks[mark].rank * static_cast<double>(stats.count)) {
+            *marks[mark].value = std::min(value(i), stats.max);
+            ++mark;
+        }
+    }
+    return stats;
+}
+
+std::string Metrics::text(const BrokerMetrics& metrics)
+{
+    std::string out{};
+    char line[256];
+    auto put = [&out, &line](int len) {
+        if (len > 0)
+            out.append(line, std::min(static_cast<size_t>(len), sizeof(line) - 1));
+    };
+    out += "# TYPE scadup_accepts_total counter\n";
+    put(snprintf(line, sizeof(line), "scadup_accepts_total %llu\n", (unsigned long long)metrics.accepts));
+    out += "# TYPE scadup_closes_total counter\n";
+    for (size_t i = 0; i < CLOSE_REASONS; ++i) {
+        put(snprintf(line, sizeof(line), "scadup_closes_total{reason=\"%s\"} %llu\n",
+            CLOSE_NAMES[i], (unsigned long long)metrics.closes[i]));
+    }
+    const struct {
+        const char* name;
+        uint64_t TopicMetrics::* field;
+    } series[] = {
+        { "scadup_topic_messages_in_total", &TopicMetrics::messagesIn },
+        { "scadup_topic_bytes_in_total", &TopicMetrics::bytesIn },
+        { "scadup_topic_messages_out_total", &TopicMetrics::messagesOut },
+        { "scadup_topic_bytes_out_total", &TopicMetrics::bytesOut },
+    };
+    for (const auto& it : series) {
+        put(snprintf(line, sizeof(line), "# TYPE %s counter\n", it.name));
+        for (const auto& topic : metrics.topics) {
+            put(snprintf(line, sizeof(line), "%s{topic=\"0x%04x\"} %llu\n",
+                it.name, topic.topic, (unsigned long long)(topic.*it.field)));
+        }
+    }
+    out += "# TYPE scadup_untracked_messages_total counter\n";
+    put(snprintf(line, sizeof(line), "scadup_untracked_messages_total %llu\n", (unsigned long long)metrics.untracked));
+    const struct {
+        const char* name;
+        const char* type;
+        size_t QueueDepth::* field;
+    } queues[] = {
+        { "scadup_queue_messages", "gauge", &QueueDepth::messages },
+        { "scadup_queue_bytes", "gauge", &QueueDepth::bytes },
+        { "scadup_queue_dropped_total", "counter", &QueueDepth::dropped },
+    };
+    for (const auto& it : queues) {
+        put(snprintf(line, sizeof(line), "# TYPE %s %s\n", it.name, it.type));
+        for (const auto& depth : metrics.queues) {
+            put(snprintf(line, sizeof(line), "%s{peer=\"%s:%u\",topic=\"0x%04x\"} %zu\n",
+                it.name, depth.IP, depth.PORT, depth.topic, depth.*it.field));
+        }
+    }
+    const LatencyMetrics& latency = metrics.latency;
+    out += "# TYPE scadup_deliver_latency_seconds summary\n";
+    const struct {
+        const char* quantile;
+        uint64_t value;
+    } marks[] = { { "0.5", latency.p50 }, { "0.9", latency.p90 }, { "0.99", latency.p99 }, { "0.999", latency.p999 },
+        { "1", latency.max } };
+    for (const auto& it : marks) {
+        put(snprintf(line, sizeof(line), "scadup_deliver_latency_seconds{quantile=\"%s\"} %.9f\n",
+            it.quantile, static_cast<double>(it.value) / 1e9));
+    }
+    put(snprintf(line, sizeof(line), "scadup_deliver_latency_seconds_count %llu\n", (unsigned long long)latency.count));
+    return out;
+}
@@ -0,0 +1,143 @@
+#ifndef SCADUP_METRICS_H
+#define SCADUP_METRICS_H
+
+#include "common/Scadup.h"
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace Scadup {
+    /*
+     * Broker counters, sharded per thread: every worker loop and ring bridge
+     * owns a Shard only it writes, with plain loads and stores, no locked
+     * instruction on the way. A snapshot sums the shards under the registry
+     * lock alone. Topics are counted in an open addressed table per shard,
+     * those not placed within a few probes as untracked. Latencies go into a
+     * log-linear histogram, HDR style: 32 linear buckets per power of two,
+     * values within 3%, up to about half an hour in ns.
+     */
+    class Metrics {
+    public:
+        static const unsigned int SUB_BITS = 5;
+        static const size_t SUB = size_t(1) << SUB_BITS;
+        static const unsigned int TOP_BIT = 40; // highest bit of a value told apart
+        static const size_t BUCKETS = 2 * SUB + (TOP_BIT - SUB_BITS) * SUB;
+        static const size_t TOPIC_SLOTS = 1024; // a power of two
+        static const size_t PROBES = 16;
+
+        class Shard {
+        public:
+            void accepted()
+            {
+                add(m_accepts, 1);
+            }
+            void closed(G_CloseReason reason)
+            {
+                add(m_closes[reason], 1);
+            }
+            void ingest(uint32_t topic, size_t bytes)
+            {
+                Slot* slot = find(topic);
+                if (slot == nullptr) {
+                    add(m_untracked, 1);
+                    return;
+                }
+                add(slot->messagesIn, 1);
+                add(slot->bytesIn, bytes);
+            }
+            void sent(uint32_t topic, size_t bytes, uint64_t latency)
+            {
+                Slot* slot = find(topic);
+                if (slot != nullptr) {
+                    add(slot->messagesOut, 1);
+                    add(slot->bytesOut, bytes);
+                }
+                add(m_latency[bucket(latency)], 1);
+                if (latency > m_max.load(std::memory_order_relaxed))
+                    m_max.store(latency, std::memory_order_relaxed);
+            }
+        private:
+            friend class Metrics;
+            typedef std::atomic<uint64_t> Counter;
+            struct Slot {
+                Counter key{ 0 }; // topic + 1, 0 while free
+                Counter messagesIn{ 0 };
+                Counter bytesIn{ 0 };
+                Counter messagesOut{ 0 };
+                Counter bytesOut{ 0 };
+            };
+            // one writer: no read-modify-write needed
+            static void add(Counter& counter, uint64_t n)
+            {
+                counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+            }
+            Slot* find(uint32_t topic)
+            {
+                const uint64_t key = static_cast<uint64_t>(topic) + 1;
+                size_t at = (topic * 2654435761u) & (TOPIC_SLOTS - 1);
+                for (size_t i = 0; i < PROBES; ++i) {
+                    Slot& slot = m_topics[(at + i) & (TOPIC_SLOTS - 1)];
+                    uint64_t held = slot.key.load(std::memory_order_relaxed);
+                    if (held == key)
+                        return &slot;
+                    if (held == 0) {
+                        // published with its counters, still zero
+                        slot.key.store(key, std::memory_order_release);
+                        return &slot;
+                    }
+                }
+                return nullptr;
+            }
+            Counter m_accepts{ 0 };
+            Counter m_closes[CLOSE_REASONS]{};
+            Counter m_untracked{ 0 };
+            Counter m_max{ 0 };
+            Counter m_latency[BUCKETS]{};
+            Slot m_topics[TOPIC_SLOTS]{};
+        };
+
+        Shard* shard(); // a new one, kept as long as the registry
+        BrokerMetrics snapshot();
+        static std::string text(const BrokerMetrics&); // Prometheus text exposition
+        static LatencyMetrics summary(const uint64_t* buckets, uint64_t max); // BUCKETS of counts
+
+        static uint64_t now() // steady ns
+        {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+        static size_t bucket(uint64_t value)
+        {
+            if (value < 2 * SUB)
+                return static_cast<size_t>(value);
+#ifdef __GNUC__
+            unsigned int top = 63 - static_cast<unsigned int>(__builtin_clzll(value));
+#else
+            unsigned int top = 0;
+            while ((value >> top) > 1)
+                top++;
+#endif
+            if (top > TOP_BIT)
+                return BUCKETS - 1;
+            unsigned int shift = top - SUB_BITS;
+            return 2 * SUB + (shift - 1) * SUB + static_cast<size_t>((value >> shift) - SUB);
+        }
+        static uint64_t value(size_t bucket) // middle of the bucket
+        {
+            if (bucket < 2 * SUB)
+                return bucket;
+            uint64_t shift = (bucket - 2 * SUB) / SUB + 1;
+            uint64_t top = (bucket - 2 * SUB) % SUB + SUB;
+            return (top << shift) + ((uint64_t(1) << shift) >> 1);
+        }
+    private:
+        std::mutex m_lock{};
+        std::vector<std::unique_ptr<Shard>> m_shards{};
+    };
+}
+
+#endif // SCADUP_METRICS_H
@@ -1,64 +1,235 @@
 #include "common/Scadup.h"
+#ifndef _WIN32
+#include <netinet/tcp.h>
+#endif
 
 #define LOG_TAG "Publisher"
 #include "../utils/logging.h"
+#include "../utils/ShmRing.h"
+#include "Wire.h"
 
 using namespace Scadup;
 
+// publish() blocks only while this many bytes are still waiting for the socket
+static const size_t MAX_PENDING = 64 * 1024 * 1024;
+// receive timeouts close() waits through for the broker to read what was sent
+static const int MAX_CLOSE_WAITS = 10;
+
+// one frame from the broker, its status and content into body as laid out in v1
+static bool readFrame(SOCKET socket, uint8_t version, Header& head, std::string& body)
+{
+    char status[Wire::STATUS_BYTES];
+    size_t content = 0;
+    if (!Wire::readHead(socket, version, head, status, content))
+        return false;
+    body.resize(head.size - HEAD_SIZE);
+    memcpy(&body[0], status, body.size() - content);
+    return content == 0 || Wire::readFull(socket, &body[body.size() - content], content);
+}
+
+Publisher::~Publisher()
+{
+    close();
+}
+
 int Publisher::setup(const char* ip, unsigned short port)
 {
-    m_socket = socket2Broker(ip, port, m_ssid, 3);
+    close();
+    m_socket = socket2Broker(ip, port, m_ssid, 3, PUBLISHER, &m_version);
     if (m_socket < 0) {
         LOGE("socket set to Broker fail, invalid socket!");
         return -1;
     }
+    int flag = 1;
+    setsockopt(m_socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&flag), sizeof(flag));
+    // the broker only answers ring requests, never wait on it for long
+#ifdef _WIN32
+    DWORD tv = 3 * HEARTBEAT_INTERVAL;
+#else
+    timeval tv{ 3 * HEARTBEAT_INTERVAL / 1000, 0 };
+#endif
+    setsockopt(m_socket, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&tv), sizeof(tv));
+    m_local = localPeer(m_socket);
+    m_running = true;
+    m_sender = std::thread(&Publisher::transmit, this);
     return 0;
 }
 
-ssize_t Publisher::broadcast(const uint8_t* data, size_t len)
+void Publisher::transmit()
 {
-    if (data == nullptr || len == 0) {
-        LOGE("Data is null!");
-        return -1;
+    std::string sending{};
+    std::unique_lock<std::mutex> lock(m_lock);
+    for (;;) {
+        if (!m_cond.wait_for(lock, std::chrono::milliseconds(HEARTBEAT_INTERVAL),
+            [this] { return !m_pending.empty() || !m_running; })) {
+            // silent for a whole interval, otherwise the data is the heartbeat
+            Header head{};
+            head.cmd = 0x10;
+            head.flag = PUBLISHER;
+            head.size = HEAD_SIZE;
+            head.ssid = m_ssid;
+            char beat[Wire::PREFIX];
+            size_t size = Wire::prefix(m_version, head, nullptr, beat);
+            lock.unlock();
+            ssize_t sent = Write(m_socket, beat, size);
+            lock.lock();
+            if (sent != static_cast<ssize_t>(size)) {
+                LOGE("Heartbeat to sock %d failed: %s", m_socket, strerror(errno));
+                m_running = false;
+                m_cond.notify_all();
+                break;
+            }
+            continue;
+        }
+        if (m_pending.empty())
+            break; // closed and drained
+        sending.swap(m_pending);
+        lock.unlock();
+        m_cond.notify_all();
+        const char* data = sending.data();
+        size_t left = sending.size();
+        while (left > 0) {
+            ssize_t sent = Write(m_socket, data, left);
+            if (sent < 0 && errno == EINTR)
+                continue;
+            if (sent <= 0)
+                break;
+            data += sent;
+            left -= static_cast<size_t>(sent);
+        }
+        sending.clear();
+        lock.lock();
+        if (left > 0) {
+            LOGE("Writes %zu bytes left: %s", left, strerror(errno));
+            m_running = false;
+            m_pending.clear();
+            m_cond.notify_all();
+            break;
+        }
     }
-    if (m_socket <= 0) {
-        LOGE("Socket(%d) invalid!", m_socket);
-        return -2;
+}
+
+void Publisher::setChecksum(bool checksum)
+{
+    m_checksum = checksum;
+}
+
+void Publisher::setTrace(bool trace)
+{
+    m_trace = trace;
+}
+
+void Publisher::close()
+{
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_running = false;
+    }
+    m_cond.notify_all();
+    if (m_sender.joinable()) {
+        m_sender.join();
     }
-    ssize_t bytes = writes(m_socket, data, len);
-    if (bytes <= 0) {
-        LOGE("Writes %d: %s", bytes, strerror(errno));
+    if (m_socket > 0) {
+        // closing with a late offer unread would reset the connection and
+        // drop what is still unsent: end the stream, read until the broker closes
+#ifdef _WIN32
+        shutdown(m_socket, SD_SEND);
+#else
+        shutdown(m_socket, SHUT_WR);
+#endif
+        char rest[256];
+        for (int waits = 0; waits < MAX_CLOSE_WAITS;) {
+            ssize_t got = ::recv(m_socket, rest, sizeof(rest), 0);
+            if (got == 0 || (got < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR))
+                break;
+            if (got < 0 && errno != EINTR)
+                waits++; // a receive timeout: the broker is still reading the backlog
+        }
         Close(m_socket);
         m_socket = -1;
-        return -3;
     }
-    wait(Time100ms);
-    Close(m_socket);
-    m_socket = -1;
-    return bytes;
+    std::lock_guard<std::mutex> lock(m_ringLock);
+    m_rings.clear();
+}
+
+// the ring of a topic when the broker is on this host, asked for once
+ShmRing* Publisher::ring(uint32_t topic)
+{
+    std::lock_guard<std::mutex> guard(m_ringLock);
+    if (!m_local)
+        return nullptr;
+    auto it = m_rings.find(topic);
+    if (it != m_rings.end())
+        return it->second.get();
+    // queued behind the publishes before it, so those reach the ring first
+    Header head{};
+    head.cmd = 0x30;
+    head.flag = PUBLISHER;
+    head.size = HEAD_SIZE;
+    head.topic = topic;
+    head.ssid = m_ssid;
+    char ask[Wire::PREFIX];
+    size_t size = Wire::prefix(m_version, head, nullptr, ask);
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (!m_running)
+            return nullptr;
+        m_pending.append(ask, size);
+    }
+    m_cond.notify_all();
+    Header reply{};
+    std::string body{};
+    bool read = false;
+    // an offer for another topic came after its request timed out
+    while ((read = readFrame(m_socket, m_version, reply, body)) && reply.cmd == 0x30 && reply.topic != topic) { }
+    if (!read || reply.cmd != 0x30 || reply.size <= HEAD_SIZE + sizeof(Message::Payload::status)) {
+        LOGW("No shared memory offer from broker, publish over TCP.");
+        m_local = false;
+        return nullptr;
+    }
+    std::shared_ptr<ShmRing> ring{};
+    const char* name = body.c_str() + sizeof(Message::Payload::status);
+    if (*name != '\0') {
+        ring = std::make_shared<ShmRing>();
+        if (ring->open(name) != 0) {
+            LOGW("Open shared memory %s: %s, topic 0x%04x over TCP.", name, strerror(errno), topic);
+            ring.reset();
+        }
+    }
+    m_rings[topic] = ring;
+    return ring.get();
 }
 
 int Publisher::publish(uint32_t topic, const std::string& payload, ...)
 {
+    return post(topic, payload, 0);
+}
+
+int Publisher::retain(uint32_t topic, const std::string& payload)
+{
+    return post(topic, payload, RETAIN);
+}
+
+int Publisher::post(uint32_t topic, const std::string& payload, uint8_t rsvp)
+{
+    // the publish hop, the later ones stamped on the way
+    char trace[Wire::TRACE_BYTES] = {};
+    const size_t traced = m_trace ? Wire::TRACE_BYTES : 0;
+    if (traced != 0)
+        Wire::put(trace, Wire::HOP_PUBLISH, Wire::now());
     LOGI("begin publish to BROKER, ssid=0x%04x, msg=\"%s\"", m_ssid, payload.c_str());
     size_t size = payload.size();
     if (size == 0) {
         LOGW("Payload was empty!");
         return 0;
     }
-    const size_t maxLen = payload.max_size();
-    Message msg = {};
-    memset(static_cast<void*>(&msg), 0, sizeof(Message));
+    const size_t maxLen = UINT32_MAX - HEAD_SIZE - sizeof(Message::Payload::status) - 1 - traced;
     size = (size > maxLen ? maxLen : size);
-    size_t msgLen = sizeof(Message) + size - sizeof(char*) + 1;
-    auto* message = new(std::nothrow) uint8_t[msgLen + 1];
-    if (message == nullptr) {
-        LOGE("Message malloc len %zu failed!", msgLen + 1);
-        Close(m_socket);
-        m_socket = -1;
-        return -1;
-    }
+    size_t msgLen = HEAD_SIZE + sizeof(Message::Payload::status) + size + 1 + traced;
 
+    Message msg = {};
+    memset(static_cast<void*>(&msg), 0, sizeof(Message));
+    msg.head.rsvp = rsvp;
     msg.head.ssid = m_ssid;
     msg.head.size = static_cast<unsigned int>(msgLen);
     msg.head.topic = topic;
@@ -66,12 +237,48 @@ int Publisher::publish(uint32_t topic, const std::string& payload, ...)
     msg.payload.status[0] = 'O';
     msg.payload.status[1] = 'K';
     msg.payload.status[2] = '\0';
-    memcpy(message, &msg, sizeof(Message));
-    memcpy(message + HEAD_SIZE + sizeof(Message::Payload::status), payload.c_str(), size);
+    if (m_checksum) {
+        msg.head.rsvp |= CHECKED;
+        Wire::seal(msg.payload.status, payload.data(), size);
+    }
+    if (traced != 0)
+        msg.head.rsvp |= TRACED;
 
-    ssize_t bytes = broadcast(message, msgLen);
-    LOGI("broadcast message size expect=%d, bytes=%d.", msgLen, bytes);
-    DelArr(message);
+    // same host: straight into the shared ring, no syscall unless a reader sleeps;
+    // retained values go over TCP, a lapped ring bridge would lose them
+    ShmRing* shared = ring(topic);
+    if (shared != nullptr && msgLen <= shared->limit() && (rsvp & RETAIN) == 0) {
+        ShmRing::Part parts[] = {
+            { &msg, HEAD_SIZE + sizeof(Message::Payload::status) },
+            { payload.data(), size },
+            { "", 1 },
+            { trace, traced }
+        };
+        if (shared->write(parts, (traced != 0) ? 4 : 3, ShmRing::CLIENT))
+            return static_cast<int>(msgLen);
+    } else if (shared != nullptr) {
+        // too large for the ring, or retained: its place there is marked, local subscribers
+        // wait for it at the marker and keep the order of this publisher
+        char marker[Wire::PREFIX];
+        Wire::mark(msg.head, marker);
+        ShmRing::Part part{ marker, sizeof(marker) };
+        if (shared->write(&part, 1, ShmRing::CLIENT))
+            msg.head.rsvp |= MARKED;
+    }
 
-    return bytes;
+    char prefix[Wire::PREFIX];
+    size_t length = Wire::prefix(m_version, msg.head, msg.payload.status, prefix);
+    std::unique_lock<std::mutex> lock(m_lock);
+    m_cond.wait(lock, [this] { return m_pending.size() < MAX_PENDING || !m_running; });
+    if (!m_running || m_socket <= 0) {
+        LOGE("Socket(%d) invalid!", m_socket);
+        return -2;
+    }
+    m_pending.append(prefix, length);
+    m_pending.append(payload.data(), size);
+    m_pending.push_back('\0');
+    m_pending.append(trace, traced);
+    lock.unlock();
+    m_cond.notify_all();
+    return static_cast<int>(msgLen);
 }
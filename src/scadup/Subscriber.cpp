@@ -2,154 +2,775 @@
 
 #define LOG_TAG "Subscriber"
 #include "../utils/logging.h"
-#include "../utils/threadpool.hpp"
-#include "../utils/TaskBase.h"
+#include "../utils/Pool.h"
+#include "../utils/ShmRing.h"
+#include "Wire.h"
+#include <new>
+#ifndef _WIN32
+#include <poll.h>
+#endif
 
 using namespace Scadup;
 extern const char* GET_FLAG(G_ScaFlag x);
 
 bool Subscriber::m_exit = false;
-threadpool g_threadpool{};
+
+// frames up to this size are parsed out of the buffer without growing it
+static const size_t RECV_BUFFER = 64 * 1024;
+// heartbeat intervals a publish marked in the ring is waited for on the session
+static const unsigned int MARKER_WAITS = 3;
+
+namespace {
+    // receive buffer, shared by the loop and the views handed out from it
+    struct RecvBuffer {
+        std::atomic<size_t> refs{ 1 };
+        size_t capacity = 0;
+        char* data()
+        {
+            return reinterpret_cast<char*>(this + 1);
+        }
+    };
+
+    RecvBuffer* newBuffer(size_t capacity)
+    {
+        void* mem = Pool::alloc(sizeof(RecvBuffer) + capacity);
+        if (mem == nullptr)
+            return nullptr;
+        auto* buffer = new(mem) RecvBuffer();
+        buffer->capacity = capacity;
+        return buffer;
+    }
+
+    void retain(void* buffer)
+    {
+        static_cast<RecvBuffer*>(buffer)->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void release(void* buffer)
+    {
+        auto* buf = static_cast<RecvBuffer*>(buffer);
+        if (buf->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            buf->~RecvBuffer();
+            Pool::free(buf);
+        }
+    }
+
+    // a frame parsed out of a buffer, in either layout
+    struct Parsed {
+        Header head{};
+        const char* status = nullptr;
+        char* content = nullptr; // ends with the NUL of a publish, then the stamps of a traced one
+        size_t length = 0; // of the content
+        size_t span = 0; // bytes taken in the buffer
+    };
+
+    // a whole frame in the v1 layout
+    Parsed layout(char* frame)
+    {
+        const size_t size = HEAD_SIZE + sizeof(Message::Payload::status);
+        Parsed parsed{};
+        memcpy(static_cast<void*>(&parsed.head), frame, HEAD_SIZE);
+        parsed.status = frame + HEAD_SIZE;
+        parsed.content = frame + size;
+        parsed.length = (parsed.head.size > size) ? parsed.head.size - size : 0;
+        parsed.span = parsed.head.size;
+        return parsed;
+    }
+
+    // a whole compact frame whose header decode() took used bytes of, the
+    // ssid left to the caller
+    Parsed compact(char* frame, const Header& head, size_t used, size_t body, bool status)
+    {
+        const size_t size = HEAD_SIZE + sizeof(Message::Payload::status);
+        Parsed parsed{};
+        parsed.head = head;
+        parsed.status = status ? frame + used : Wire::OK;
+        parsed.content = frame + used + (status ? sizeof(Message::Payload::status) : 0);
+        parsed.length = (head.size > size) ? head.size - size : 0;
+        parsed.span = used + body;
+        return parsed;
+    }
+
+    // a topic received by multicast: datagrams delivered in sequence, the gaps
+    // asked for over the session and filled from its answers
+    struct Group {
+        SOCKET socket = -1;
+        uint64_t expected = 0; // sequence delivered next
+        uint64_t asked = 0; // gaps below were asked for
+        uint64_t stalled = 0; // expected at the last heartbeat
+        uint64_t resent = 0; // sequence of the next frame the session answers with
+        uint64_t resends = 0; // frames of the answer still to come
+        std::map<uint64_t, RecvBuffer*> pending{}; // ahead of expected, one frame each
+        RecvBuffer* buffer = nullptr; // datagrams are received into
+
+        ~Group()
+        {
+            for (auto& it : pending) {
+                release(it.second);
+            }
+            if (buffer != nullptr)
+                release(buffer);
+            if (socket >= 0)
+                Close(socket);
+        }
+        // "group:port interface" offered by the broker, joined on its interface
+        // if it runs on this host, else on the one the session goes out of
+        int join(const char* offer, SOCKET session)
+        {
+#ifdef _WIN32
+            return -1;
+#else
+            char addr[INET_ADDRSTRLEN] = {};
+            char iface[INET_ADDRSTRLEN] = {};
+            unsigned short port = 0;
+            ip_mreq mreq{};
+            if (sscanf(offer, "%15[^:]:%hu %15s", addr, &port, iface) != 3
+                || inet_pton(AF_INET, addr, &mreq.imr_multiaddr) != 1
+                || inet_pton(AF_INET, iface, &mreq.imr_interface) != 1) {
+                errno = EINVAL;
+                return -1;
+            }
+            sockaddr_in self{};
+            auto len = static_cast<socklen_t>(sizeof(self));
+            if (!localPeer(session) && getsockname(session, reinterpret_cast<sockaddr*>(&self), &len) == 0
+                && self.sin_family == AF_INET)
+                mreq.imr_interface = self.sin_addr;
+            buffer = newBuffer(64 * 1024);
+            socket = ::socket(AF_INET, SOCK_DGRAM, 0);
+            if (buffer == nullptr || socket < 0)
+                return -1;
+            // every subscriber of the group on this host binds the port
+            int flag = 1;
+            int bytes = 4 * 1024 * 1024;
+            setsockopt(socket, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+            setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &bytes, sizeof(bytes));
+            sockaddr_in local{};
+            local.sin_family = AF_INET;
+            local.sin_port = htons(port);
+            local.sin_addr.s_addr = htonl(INADDR_ANY);
+            if (::bind(socket, reinterpret_cast<sockaddr*>(&local), sizeof(local)) != 0
+                || setsockopt(socket, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) != 0)
+                return -1;
+            return 0;
+#endif
+        }
+    };
+}
+
+MessageView::MessageView(const MessageView& other)
+    : m_head(other.m_head), m_status(other.m_status), m_data(other.m_data), m_size(other.m_size),
+    m_seq(other.m_seq), m_trace(other.m_trace), m_buffer(other.m_buffer)
+{
+    if (m_buffer != nullptr)
+        retain(m_buffer);
+}
+
+MessageView& MessageView::operator=(const MessageView& other)
+{
+    if (this != &other) {
+        if (other.m_buffer != nullptr)
+            retain(other.m_buffer);
+        release();
+        m_head = other.m_head;
+        m_status = other.m_status;
+        m_data = other.m_data;
+        m_size = other.m_size;
+        m_seq = other.m_seq;
+        m_trace = other.m_trace;
+        m_buffer = other.m_buffer;
+    }
+    return *this;
+}
+
+MessageView::~MessageView()
+{
+    release();
+}
+
+void MessageView::release()
+{
+    if (m_buffer != nullptr)
+        ::release(m_buffer);
+    m_buffer = nullptr;
+    m_status = m_data = nullptr;
+    m_size = 0;
+}
+
+Subscriber::~Subscriber()
+{
+    stopBeat();
+}
 
 int Subscriber::setup(const char* ip, unsigned short port)
 {
-    m_socket = socket2Broker(ip, port, m_ssid, 60);
+    m_exit = false;
+    m_socket = socket2Broker(ip, port, m_ssid, 60, SUBSCRIBER, &m_version);
     if (m_socket < 0) {
         LOGE("socket set to Broker fail, invalid socket!");
         return -1;
     }
-    std::function<void(SOCKET, bool&)> func = [&](SOCKET sock, bool& exit) -> void {
-        try {
-            LOGI("start keep-alive task");
-            keepAlive(sock, exit);
-        } catch (const std::exception& e) {
-            LOGE("Exception in keep-alive task: %s", e.what());
-        } catch (...) {
-            LOGE("Unknown exception in keep-alive task");
-        }
-        };
-    g_threadpool.enqueue(func, m_socket, std::ref(m_exit));
+    // wake up the receive loop in time for quit() and stalled multicast gaps
+#ifdef _WIN32
+    DWORD tv = HEARTBEAT_INTERVAL;
+#else
+    timeval tv{ HEARTBEAT_INTERVAL / 1000, (HEARTBEAT_INTERVAL % 1000) * 1000 };
+#endif
+    setsockopt(m_socket, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&tv), sizeof(tv));
     return 0;
 }
 
 ssize_t Subscriber::subscribe(uint32_t topic, RECV_CALLBACK callback)
+{
+    return receive(topic, callback, nullptr);
+}
+
+ssize_t Subscriber::subscribe(uint32_t topic, const VIEW_CALLBACK& callback)
+{
+    return receive(topic, nullptr, &callback);
+}
+
+ssize_t Subscriber::receive(uint32_t topic, RECV_CALLBACK callback, const VIEW_CALLBACK* viewer)
 {
     LOGI("subscribe topic=0x%04x, ssid=0x%04x", topic, m_ssid);
+    const size_t size = HEAD_SIZE + sizeof(Message::Payload::status);
     Header head{};
     head.flag = SUBSCRIBER;
     head.ssid = m_ssid;
     head.topic = topic;
-    ssize_t len = ::send(m_socket, reinterpret_cast<char*>(&head), HEAD_SIZE, 0);
+    char start[sizeof(Message::Payload::status)] = {};
+    if (m_from != START_LIVE) {
+        // the start position rides in the status slot
+        head.rsvp = static_cast<uint8_t>(m_from);
+        head.size = size;
+        memcpy(start, &m_start, sizeof(m_start));
+    } else {
+#ifndef _WIN32
+        head.cmd = 0x40; // from shared memory on this host, or the multicast group if the topic has one
+#endif
+    }
+    char hello[Wire::PREFIX];
+    ssize_t len = ::send(m_socket, hello, Wire::prefix(m_version, head, start, hello), 0);
     if (len == 0 || (len < 0 && errno == EPIPE)) {
         Close(m_socket);
         LOGE("Write to sock %d, ssid %llu failed!", m_socket, m_ssid);
         return -1;
-    } else {
-        g_threadpool.start(3);
     }
+    // heartbeats from a thread of their own: a slow callback must not let
+    // the broker take the session for idle
+    stopBeat();
+    m_lost = false;
+    m_beating = true;
+    m_beater = std::thread(&Subscriber::beat, this);
+    RecvBuffer* buffer = newBuffer(RECV_BUFFER - sizeof(RecvBuffer));
+    if (buffer == nullptr) {
+        LOGE("Receive buffer(%zu) malloc failed!", RECV_BUFFER);
+        quit();
+        return -4;
+    }
+    char* buff = buffer->data();
+    size_t capacity = buffer->capacity;
+    size_t least = capacity; // the buffer holds at least one ring record
+    size_t have = 0;
+    size_t ringEnd = 0; // buff holds ring records up to here, in the v1 layout
+    uint64_t ringPos = 0;
+    Group group{};
     int32_t state = 0;
-    volatile bool flag = false;
-    do {
-        if (m_exit) {
-            LOGW("Subscribe will exit");
-            break;
+    bool flag = true;
+    uint64_t arrived = 0; // when what was read last came, taken at its first traced frame
+    size_t early = 0; // publishes the session delivered before the ring reached their marker
+
+    // one message to the callbacks, false if it ends the subscription
+    auto emit = [&](RecvBuffer* owner, const Parsed& frame, uint64_t seq) {
+        // the stamps of a traced publish are not part of its content
+        const size_t trace = Wire::trailer(frame.head);
+        const size_t length = frame.length - trace;
+        if (frame.head.flag == PUBLISHER && length > 0 &&
+            !Wire::intact(frame.head, frame.status, frame.content, length - 1)) {
+            LOGW("Checksum of topic 0x%04x mismatched, message %llu skipped.", frame.head.topic, seq);
+            m_position = seq + 1;
+            return true;
         }
-        wait(Time100ms);
         Message msg = {};
-        const size_t size = HEAD_SIZE + sizeof(Message::Payload::status);
-        memset(static_cast<void*>(&msg), 0, size);
-        len = ::recv(m_socket, reinterpret_cast<char*>(&msg), size, MSG_WAITALL);
-        if (len == 0 || (len < 0 && errno != EAGAIN)) {
-            LOGE("Receive msg fail[%ld] sock=%d, %s", len, m_socket, strerror(errno));
-            if (m_socket >= 0)
-                Close(m_socket);
-            state = -2;
-            break;
+        msg.head = frame.head;
+        memcpy(msg.payload.status, frame.status, sizeof(Message::Payload::status));
+        if (length > 0) {
+            msg.payload.content = frame.content;
+            frame.content[length - 1] = '\0';
         }
-        if (memcmp(reinterpret_cast<char*>(&msg), "Scadup", 7) == 0)
-            continue;
-        flag = (msg.head.ssid != 0);
-        if (msg.head.size == 0) {
-            msg.head.size = size;
-            msg.head.flag = SUBSCRIBER;
-            msg.head.ssid = m_ssid;
-            msg.head.topic = topic;
-            len = writes(m_socket, reinterpret_cast<uint8_t*>(&msg), size);
-            if (len < 0) {
-                LOGE("Writes %s", strerror(errno));
-                Close(m_socket);
-                state = -3;
-                break;
+        LOGI("message payload = [%s]-[%s]", msg.payload.status, msg.payload.content);
+        if (callback != nullptr)
+            callback(msg);
+        if (viewer != nullptr && *viewer) {
+            MessageView view;
+            view.m_head = msg.head;
+            view.m_status = frame.status;
+            view.m_data = (msg.payload.content != nullptr) ? msg.payload.content : "";
+            view.m_size = (length > 0) ? length - 1 : 0;
+            view.m_seq = seq;
+            view.m_buffer = owner;
+            retain(owner);
+            if (trace != 0) {
+                const char* hops = frame.content + length;
+                if (arrived == 0)
+                    arrived = Wire::now();
+                view.m_trace.publish = Wire::get(hops, Wire::HOP_PUBLISH);
+                view.m_trace.receive = Wire::get(hops, Wire::HOP_RECEIVE);
+                view.m_trace.enqueue = Wire::get(hops, Wire::HOP_ENQUEUE);
+                view.m_trace.send = Wire::get(hops, Wire::HOP_SEND);
+                view.m_trace.arrive = arrived;
+                view.m_trace.callback = Wire::now();
             }
-            LOGI("MQ writes %ld [%lld] %s.", len, msg.head.ssid, GET_FLAG(msg.head.flag));
-            continue;
+            (*viewer)(view);
         }
-        if (msg.head.size > size) {
-            size_t length = msg.head.size - size;
-            char* body = new(std::nothrow) char[length];
-            if (body == nullptr) {
-                LOGE("Extra body(%u, %lu) malloc failed!", msg.head.size, size);
-                state = -4;
+        m_position = seq + 1;
+        // a frame without ssid ends the subscription
+        return msg.head.ssid != 0;
+    };
+    // asks the session for the holes between the pending frames up to end
+    auto ask = [&](uint64_t end) {
+        Header req{};
+        req.cmd = 0x40;
+        req.flag = SUBSCRIBER;
+        req.size = static_cast<uint32_t>(HEAD_SIZE + 2 * sizeof(uint64_t));
+        req.topic = topic;
+        req.ssid = m_ssid;
+        char frame[Wire::PREFIX + sizeof(uint64_t)];
+        uint64_t from = std::max(group.expected, group.asked);
+        auto next = group.pending.lower_bound(from);
+        while (from < end) {
+            uint64_t range[2]{ from, (next != group.pending.end() && next->first < end) ? next->first : end };
+            if (range[0] < range[1]) {
+                // from in the status slot, to as the content
+                size_t length = Wire::prefix(m_version, req, reinterpret_cast<const char*>(&range[0]), frame);
+                memcpy(frame + length, &range[1], sizeof(range[1]));
+                length += sizeof(range[1]);
+                LOGI("topic 0x%04x asks for %llu..%llu again.", topic, range[0], range[1]);
+                std::lock_guard<std::mutex> lock(m_lock);
+                if (::send(m_socket, frame, length, MSG_NOSIGNAL) != static_cast<ssize_t>(length))
+                    return; // asked again when the gap stalls
+            }
+            from = range[1] + 1;
+            group.asked = std::min(from, end);
+            if (next != group.pending.end())
+                ++next;
+        }
+    };
+    // delivers the pending frames that are next in sequence
+    auto settle = [&]() {
+        bool more = true;
+        while (more && !group.pending.empty() && group.pending.begin()->first <= group.expected) {
+            auto next = group.pending.begin();
+            if (next->first == group.expected)
+                more = emit(next->second, layout(next->second->data()), group.expected++);
+            release(next->second);
+            group.pending.erase(next);
+        }
+        return more;
+    };
+    // a frame of the group in whatever order it came, delivered in sequence
+    auto accept = [&](RecvBuffer* owner, const Parsed& frame, uint64_t seq) {
+        if (seq < group.expected || group.pending.count(seq) > 0)
+            return true;
+        if (seq > group.expected) {
+            // kept in the v1 layout, whichever it came in
+            RecvBuffer* copy = newBuffer(frame.head.size);
+            if (copy == nullptr)
+                return true; // asked again once the gap stalls
+            memcpy(copy->data(), &frame.head, HEAD_SIZE);
+            memcpy(copy->data() + HEAD_SIZE, frame.status, sizeof(Message::Payload::status));
+            if (frame.length > 0)
+                memcpy(copy->data() + size, frame.content, frame.length);
+            group.pending[seq] = copy;
+            ask(seq + 1);
+            return true;
+        }
+        return emit(owner, frame, group.expected++) && settle();
+    };
+    // every datagram waiting on the group socket
+    auto datagrams = [&]() {
+        while (flag) {
+            if (group.buffer->refs.load(std::memory_order_acquire) > 1) {
+                RecvBuffer* next = newBuffer(group.buffer->capacity);
+                if (next == nullptr)
+                    return false;
+                release(group.buffer);
+                group.buffer = next;
+            }
+            char* data = group.buffer->data();
+            ssize_t got = ::recv(group.socket, data, group.buffer->capacity, MSG_DONTWAIT);
+            if (got < 0)
+                return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+            if (static_cast<size_t>(got) < Wire::GROUP_HEAD)
+                continue;
+            GroupHead gh = Wire::decodeGroup(data);
+            if (gh.topic != topic)
+                continue;
+            char* frame = data + Wire::GROUP_HEAD;
+            auto left = static_cast<size_t>(got) - Wire::GROUP_HEAD;
+            Header head{};
+            size_t body = 0;
+            bool status = false;
+            long used = (gh.kind == GROUP_FRAME) ? Wire::decode(frame, left, head, body, status) : 0;
+            if (used > 0 && static_cast<size_t>(used) + body == left) {
+                Parsed parsed = compact(frame, head, static_cast<size_t>(used), body, status);
+                parsed.head.ssid = m_ssid;
+                flag = accept(group.buffer, parsed, gh.seq);
+            } else if (gh.kind == GROUP_FETCH && gh.seq >= group.expected) {
+                ask(gh.seq + 1);
+            } else if (gh.kind == GROUP_BEAT && gh.seq > group.expected) {
+                ask(gh.seq);
+            }
+        }
+        return true;
+    };
+
+    // what the session sends while the topic comes from the ring, one frame at
+    // a time read exactly, so nothing behind it is taken out of turn: until
+    // the publish a ring marker stands for, or what is there already; false
+    // if the session failed
+    auto session = [&](bool marked) {
+        unsigned int waits = 0;
+        while (flag) {
+            char peek = 0;
+            ssize_t got = ::recv(m_socket, &peek, 1, MSG_PEEK | (marked ? 0 : MSG_DONTWAIT));
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                if (!marked)
+                    return true;
+                if (errno != EINTR && ++waits >= MARKER_WAITS) {
+                    LOGW("Message of topic 0x%04x marked in shared memory did not come, lost!", topic);
+                    return true;
+                }
+                continue;
+            }
+            if (got <= 0)
+                return false;
+            Header head{};
+            char status[sizeof(Message::Payload::status)];
+            size_t content = 0;
+            if (!Wire::readHead(m_socket, m_version, head, status, content))
+                return false;
+            RecvBuffer* owner = newBuffer(head.size);
+            if (owner == nullptr)
+                return false;
+            char* data = owner->data();
+            if (m_version >= WIRE_VERSION)
+                head.ssid = m_ssid;
+            memcpy(data, &head, HEAD_SIZE);
+            memcpy(data + HEAD_SIZE, status, head.size - HEAD_SIZE - content);
+            bool read = content == 0 || Wire::readFull(m_socket, data + head.size - content, content);
+            bool publish = read && head.flag == PUBLISHER;
+            if (publish) {
+                if (!marked)
+                    early++; // its marker was lapped, or is yet to be read
+                flag = emit(owner, layout(data), m_position);
+            }
+            release(owner);
+            if (!read)
+                return false;
+            if (publish && marked)
+                return true;
+        }
+        return true;
+    };
+
+    auto beat = std::chrono::steady_clock::now();
+    while (flag && !m_exit) {
+        arrived = 0;
+        if (m_ring && have == 0) {
+            // whole frames from the ring, no syscall while it has some; the
+            // session is read at a marker, or when the ring stays quiet
+            long got = m_ring->read(ringPos, buff, capacity);
+            if (got < 0) {
+                LOGW("Shared memory of topic 0x%04x overrun, messages lost!", topic);
+                got = 0;
+            }
+            have = ringEnd = static_cast<size_t>(got);
+            if (have == 0 && !m_ring->wait(ringPos, HEARTBEAT_INTERVAL) && !session(false)) {
+                LOGE("Receive msg fail sock=%d, %s", m_socket, strerror(errno));
+                state = -2;
                 break;
             }
-            len = ::recv(m_socket, body, length, 0);
-            if (len < 0 || (len == 0 && errno != EINTR)) {
-                LOGE("Receive body fail[%ld], sock=%d, %s", len, m_socket, strerror(errno));
-                if (m_socket >= 0)
-                    Close(m_socket);
-                DelArr(body);
-                state = -5;
+        } else if (group.socket >= 0 && have == 0) {
+#ifndef _WIN32
+            // datagrams first, then the session: retained values and the gaps
+            pollfd fds[2]{ { group.socket, POLLIN, 0 }, { m_socket, POLLIN, 0 } };
+            poll(fds, 2, static_cast<int>(HEARTBEAT_INTERVAL));
+            if (!datagrams()) {
+                LOGE("Receive multicast of topic 0x%04x: %s", topic, strerror(errno));
+                state = -2;
                 break;
-            } else {
-                auto* message = reinterpret_cast<Message*>(new char[size + len]);
-                if (message != nullptr) {
-                    memcpy(message, &msg.head, HEAD_SIZE);
-                    memcpy(reinterpret_cast<char*>(message) + HEAD_SIZE, msg.payload.status, sizeof(Message::Payload::status));
-                    if (len > 0) {
-                        message->payload.content = body;
-                        message->payload.content[len - 1] = '\0';
+            }
+            len = (fds[1].revents != 0) ? ::recv(m_socket, buff, capacity, MSG_DONTWAIT) : 0;
+            if ((fds[1].revents != 0 && len == 0) || (len < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+                LOGE("Receive msg fail[%ld] sock=%d, %s", len, m_socket, strerror(errno));
+                state = -2;
+                break;
+            }
+            have = static_cast<size_t>(std::max<ssize_t>(len, 0));
+#endif
+        } else {
+            // blocks until data or the heartbeat interval (SO_RCVTIMEO) elapses
+            len = ::recv(m_socket, buff + have, capacity - have, 0);
+            if (len < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+                len = 0;
+            } else if (len <= 0) {
+                LOGE("Receive msg fail[%ld] sock=%d, %s", len, m_socket, strerror(errno));
+                state = -2;
+                break;
+            }
+            have += static_cast<size_t>(len);
+        }
+        auto now = std::chrono::steady_clock::now();
+        if (group.socket >= 0 && now - beat >= std::chrono::milliseconds(HEARTBEAT_INTERVAL)) {
+            beat = now;
+            // no progress for a heartbeat on a gap: its answer got lost, ask again
+            if (group.expected < group.asked && group.expected == group.stalled && group.resends == 0) {
+                uint64_t end = group.asked;
+                group.asked = group.expected;
+                ask(end);
+            }
+            group.stalled = group.expected;
+        }
+        // every complete frame in the buffer, content handed out in place
+        size_t off = 0;
+        size_t next = 0; // bytes of the frame at off, when known but incomplete
+        while (flag) {
+            char* at = buff + off;
+            size_t left = have - off;
+            Parsed frame{};
+            if (off < ringEnd || m_version < 2) {
+                if (left < size)
+                    break;
+                Message msg = {};
+                memcpy(static_cast<void*>(&msg.head), at, HEAD_SIZE);
+                if (memcmp(at, "Scadup", 7) == 0) {
+                    off += size;
+                    continue;
+                }
+                if (msg.head.size == 0) {
+                    memcpy(msg.payload.status, at + HEAD_SIZE, sizeof(Message::Payload::status));
+                    msg.head.size = size;
+                    msg.head.flag = SUBSCRIBER;
+                    msg.head.ssid = m_ssid;
+                    msg.head.topic = topic;
+                    {
+                        std::lock_guard<std::mutex> lock(m_lock);
+                        len = writes(m_socket, reinterpret_cast<uint8_t*>(&msg), size);
                     }
-                    if (callback != nullptr) {
-                        // std::function<RECV_CALLBACK> func = callback;
-                        g_threadpool.enqueue(callback, *message);
+                    if (len < 0) {
+                        LOGE("Writes %s", strerror(errno));
+                        state = -3;
+                        flag = false;
+                        break;
                     }
-                    LOGI("message payload = [%s]-[%s]", message->payload.status, message->payload.content);
-                    DelArr(message);
+                    LOGI("MQ writes %ld [%lld] %s.", len, msg.head.ssid, GET_FLAG(msg.head.flag));
+                    off += size;
+                    continue;
+                }
+                if (msg.head.size < size) {
+                    LOGW("Message size(%u) invalid!", msg.head.size);
+                    off += size;
+                    continue;
+                }
+                if (left < msg.head.size) {
+                    next = msg.head.size;
+                    break;
+                }
+                frame = layout(at);
+            } else {
+                size_t length = 0;
+                bool status = false;
+                long used = Wire::decode(at, left, frame.head, length, status);
+                if (used < 0) {
+                    LOGE("Malformed frame from broker, sock=%d!", m_socket);
+                    state = -3;
+                    flag = false;
+                    break;
+                }
+                if (used == 0)
+                    break;
+                if (left - static_cast<size_t>(used) < length) {
+                    next = static_cast<size_t>(used) + length;
+                    break;
+                }
+                frame = compact(at, frame.head, static_cast<size_t>(used), length, status);
+                frame.head.ssid = m_ssid;
+            }
+            const Header& fh = frame.head;
+            if ((fh.cmd == 0x30 || fh.cmd == 0x40) && fh.flag == BROKER) {
+                // the broker offers the topic ring or multicast group, read from the position on
+                uint64_t position = 0;
+                memcpy(&position, frame.status, sizeof(position));
+                const char* name = frame.content;
+                int ret = -1;
+                if (frame.length > 0)
+                    frame.content[frame.length - 1] = '\0';
+                if (frame.length > 0 && fh.cmd == 0x30) {
+                    m_ring = std::make_shared<ShmRing>();
+                    ret = m_ring->open(name);
+                    ringPos = position;
+                    least = std::max(least, m_ring->limit());
+                } else if (frame.length > 0) {
+                    ret = group.join(name, m_socket);
+                    group.expected = group.asked = group.stalled = position;
+                    m_position = position;
+                }
+                if (ret != 0) {
+                    LOGE("Open %s: %s!", frame.length > 0 ? name : "", strerror(errno));
+                    m_ring.reset();
+                    state = -5;
+                    flag = false;
+                    break;
+                }
+                LOGI("topic 0x%04x from %s at %llu.", topic, name, position);
+                off += frame.span;
+                continue;
+            }
+            if (fh.cmd == 0x41 && fh.flag == BROKER && fh.size == size + 3 * sizeof(uint64_t)) {
+                // the gap asked for: the frames from first to end follow, those before first are gone
+                uint64_t first = 0;
+                uint64_t answer[3]{}; // asked from, asked to, end
+                memcpy(&first, frame.status, sizeof(first));
+                memcpy(answer, frame.content, sizeof(answer));
+                if (group.expected >= answer[0] && group.expected < first) {
+                    LOGW("Messages %llu..%llu of topic 0x%04x lost!", group.expected, first, topic);
+                    group.expected = first;
+                }
+                if (answer[2] < answer[1])
+                    group.asked = std::min(group.asked, answer[2]); // cut short, the rest is asked for again
+                group.resent = first;
+                group.resends = answer[2] - first;
+                off += frame.span;
+                flag = settle();
+                continue;
+            }
+            if (fh.cmd == 0x20 && fh.flag == BROKER && fh.size == size) {
+                // replay starts here, every later message is the next sequence
+                memcpy(&m_position, frame.status, sizeof(m_position));
+                LOGI("topic 0x%04x starts at %llu.", topic, m_position);
+                off += frame.span;
+                continue;
+            }
+            if (fh.cmd == Wire::MARKER && off < ringEnd) {
+                // a publish too large for the ring, delivered from the session in its place
+                off += frame.span;
+                if (early > 0) {
+                    early--;
+                } else if (!session(true)) {
+                    LOGE("Receive msg fail sock=%d, %s", m_socket, strerror(errno));
+                    state = -2;
+                    flag = false;
+                    break;
                 }
+                continue;
+            }
+            if (m_ring && off >= ringEnd && fh.flag == PUBLISHER)
+                early++; // came with the offer, ahead of its marker
+            if (group.resends > 0) {
+                group.resends--;
+                flag = accept(buffer, frame, group.resent++);
+            } else {
+                flag = emit(buffer, frame, m_position);
+            }
+            off += frame.span;
+        }
+        size_t need = std::max(std::max(capacity, least), next);
+        if (need > capacity || buffer->refs.load(std::memory_order_acquire) > 1) {
+            // a frame larger than the buffer, or views still reading it:
+            // carry the rest over to a fresh one
+            RecvBuffer* fresh = newBuffer(need);
+            if (fresh == nullptr) {
+                LOGE("Receive buffer(%zu) malloc failed!", need);
+                state = -4;
+                break;
             }
-            DelArr(body);
+            memcpy(fresh->data(), buff + off, have - off);
+            release(buffer);
+            buffer = fresh;
+            buff = buffer->data();
+            capacity = buffer->capacity;
+        } else if (off > 0) {
+            memmove(buff, buff + off, have - off);
         }
-    } while (flag);
+        have -= off;
+        ringEnd = (ringEnd > off) ? ringEnd - off : 0;
+    }
+    release(buffer);
+    m_ring.reset();
+    if (m_lost)
+        state = -1;
     quit();
     return state;
 }
 
-void Subscriber::keepAlive(SOCKET socket, bool& exit)
+void Subscriber::setStart(G_StartFrom from, uint64_t value)
 {
-    while (!exit) {
-        Header head{};
-        head.cmd = 0x10;
-        head.ssid = m_ssid;
-        head.flag = SUBSCRIBER;
-        ssize_t len = ::send(socket, reinterpret_cast<char*>(&head), HEAD_SIZE, 0);
-        if (len == 0 || (len < 0 && errno == EPIPE)) {
-            Close(socket);
-            LOGE("Write to sock[%d], cmd %zu failed!", socket, head.cmd);
+    m_from = from;
+    m_start = value;
+}
+
+uint64_t Subscriber::position() const
+{
+    return m_position;
+}
+
+// the heartbeat thread, until stopBeat()
+void Subscriber::beat()
+{
+    std::unique_lock<std::mutex> lock(m_lock);
+    while (!m_cond.wait_for(lock, std::chrono::milliseconds(HEARTBEAT_INTERVAL), [this] { return !m_beating; })) {
+        if (!keepAlive()) {
+            // the receive loop owns the socket: wake it up, it ends the subscription
+            m_lost = true;
+#ifdef _WIN32
+            shutdown(m_socket, SD_BOTH);
+#else
+            shutdown(m_socket, SHUT_RDWR);
+#endif
             break;
         }
-        wait(Time100ms * 3);
     }
 }
 
+void Subscriber::stopBeat()
+{
+    std::thread beater{};
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        m_beating = false;
+        beater.swap(m_beater);
+    }
+    m_cond.notify_all();
+    if (beater.joinable())
+        beater.join();
+}
+
+// under m_lock
+bool Subscriber::keepAlive()
+{
+    Header head{};
+    head.cmd = 0x10;
+    head.ssid = m_ssid;
+    head.flag = SUBSCRIBER;
+    char beat[Wire::PREFIX];
+    ssize_t len = ::send(m_socket, beat, Wire::prefix(m_version, head, nullptr, beat), MSG_NOSIGNAL);
+    if (len == 0 || (len < 0 && errno == EPIPE)) {
+        LOGE("Write to sock[%d], cmd %zu failed!", m_socket, head.cmd);
+        return false;
+    }
+    return true;
+}
+
 void Subscriber::quit()
 {
     m_exit = true;
-    g_threadpool.stop();
-    Header head{};
-    head.cmd = 0xff;
-    ::send(m_socket, reinterpret_cast<char*>(&head), HEAD_SIZE, 0);
-    wait(Time100ms);
+    stopBeat();
     if (m_socket > 0) {
+        Header head{};
+        head.cmd = 0xff;
+        char bye[Wire::PREFIX];
+        ::send(m_socket, bye, Wire::prefix(m_version, head, nullptr, bye), MSG_NOSIGNAL);
+        wait(Time100ms);
         Close(m_socket);
         m_socket = 0;
     }
@@ -159,5 +780,4 @@ void Subscriber::exit()
 {
     abandon();
     m_exit = true;
-    g_threadpool.stop();
 }
@@ -0,0 +1,64 @@
+#include "Metrics.h"
+#include <algorithm>
+#include <cstdio>
+
+using namespace Scadup;
+
+static const char* const STAGE_NAMES[TraceStats::STAGES] = {
+    "publisher", "broker", "queue", "network", "dispatch", "total"
+};
+
+TraceStats::TraceStats() : m_buckets(STAGES * Metrics::BUCKETS, 0) { }
+
+void TraceStats::add(const Trace& trace)
+{
+    const struct {
+        uint64_t from;
+        uint64_t to;
+    } spans[STAGES] = {
+        { trace.publish, trace.receive },
+        { trace.receive, trace.enqueue },
+        { trace.enqueue, trace.send },
+        { trace.send, trace.arrive },
+        { trace.arrive, trace.callback },
+        { trace.publish, trace.callback },
+    };
+    for (size_t i = 0; i < STAGES; ++i) {
+        if (spans[i].from == 0 || spans[i].to == 0)
+            continue;
+        // steady on one host, a later hop is never stamped earlier
+        uint64_t ns = (spans[i].to > spans[i].from) ? spans[i].to - spans[i].from : 0;
+        m_buckets[i * Metrics::BUCKETS + Metrics::bucket(ns)]++;
+        if (ns > m_max[i])
+            m_max[i] = ns;
+    }
+}
+
+LatencyMetrics TraceStats::stage(Stage stage) const
+{
+    if (stage >= STAGES)
+        return LatencyMetrics{};
+    return Metrics::summary(&m_buckets[stage * Metrics::BUCKETS], m_max[stage]);
+}
+
+std::string TraceStats::report() const
+{
+    std::string out{};
+    char line[160];
+    for (size_t i = 0; i < STAGES; ++i) {
+        LatencyMetrics stats = stage(static_cast<Stage>(i));
+        int len = snprintf(line, sizeof(line),
+            "%-9s count %llu, p50 %.2fus, p90 %.2fus, p99 %.2fus, p999 %.2fus, max %.2fus\n",
+            STAGE_NAMES[i], (unsigned long long)stats.count, stats.p50 / 1e3, stats.p90 / 1e3,
+            stats.p99 / 1e3, stats.p999 / 1e3, stats.max / 1e3);
+        if (len > 0)
+            out.append(line, std::min(static_cast<size_t>(len), sizeof(line) - 1));
+    }
+    return out;
+}
+
+void TraceStats::clear()
+{
+    std::fill(m_buckets.begin(), m_buckets.end(), 0);
+    std::fill(m_max, m_max + STAGES, 0);
+}
@@ -0,0 +1,291 @@
+#ifndef SCADUP_WIRE_H
+#define SCADUP_WIRE_H
+
+#include "common/Scadup.h"
+#include "../utils/Crc32c.h"
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+
+namespace Scadup {
+    /*
+     * Compact frame of protocol version 2, every integer little-endian:
+     *
+     *   cmd u8 | rsvp u8 | bits u8 | topic u32 | length varint | [status 8] content
+     *
+     * bits holds the sender's flag and whether a status is sent, one is only
+     * sent when it is not the "OK" of a publish; length counts the bytes after
+     * it. The ssid is the session's and not repeated. Both ends turn a compact
+     * frame back into the v1 layout (Header, status, content) in memory, so
+     * routing, history, rings and the segment log keep that one: none of them
+     * leaves the host. Multicast datagrams do, they carry a GroupHead in
+     * little-endian then the compact frame, whatever the subscriber speaks.
+     *
+     * The broker's hello offers the highest version it speaks in rsvp. A
+     * client speaking it too answers with a version header in the v1 layout
+     * (cmd 0x02, the version in rsvp), everything after that is compact; one
+     * that does not just goes on with v1.
+     */
+    namespace Wire {
+        const uint8_t VERSION = 0x02; // cmd of the version header
+        const uint8_t FLAG = 0x03; // bits: G_ScaFlag of the sender
+        const uint8_t STATUS = 0x04; // bits: the status is on the wire
+        const size_t HEAD = 7; // before the length
+        const size_t STATUS_BYTES = sizeof(Message::Payload::status);
+        const size_t PREFIX = HEAD_SIZE + STATUS_BYTES; // room for what precedes the content, either version
+        const char OK[STATUS_BYTES] = { 'O', 'K' };
+
+        // compact header and status of a frame (head.size as in v1, status
+        // read when there is a body, nullptr for OK) into out, PREFIX bytes at least
+        inline size_t encode(const Header& head, const char* status, char* out)
+        {
+            if (status == nullptr)
+                status = OK;
+            size_t length = 0;
+            bool send = false;
+            if (head.size >= HEAD_SIZE + STATUS_BYTES) {
+                // a status alone is always sent, an empty length means no body
+                send = head.size == HEAD_SIZE + STATUS_BYTES || memcmp(status, OK, STATUS_BYTES) != 0;
+                length = head.size - HEAD_SIZE - (send ? 0 : STATUS_BYTES);
+            }
+            auto* dst = reinterpret_cast<uint8_t*>(out);
+            dst[0] = head.cmd;
+            dst[1] = head.rsvp;
+            dst[2] = static_cast<uint8_t>((head.flag & FLAG) | (send ? STATUS : 0));
+            for (int i = 0; i < 4; ++i) {
+                dst[3 + i] = static_cast<uint8_t>(head.topic >> (8 * i));
+            }
+            size_t used = HEAD;
+            do {
+                uint8_t byte = length & 0x7f;
+                length >>= 7;
+                dst[used++] = static_cast<uint8_t>(byte | (length != 0 ? 0x80 : 0));
+            } while (length != 0);
+            if (send) {
+                memcpy(out + used, status, STATUS_BYTES);
+                used += STATUS_BYTES;
+            }
+            return used;
+        }
+
+        // what goes before the content in the version: the v1 header and
+        // status as they are, or their compact form
+        inline size_t prefix(uint8_t version, const Header& head, const char* status, char* out)
+        {
+            if (status == nullptr)
+                status = OK;
+            if (version >= WIRE_VERSION)
+                return encode(head, status, out);
+            memcpy(out, &head, HEAD_SIZE);
+            if (head.size < HEAD_SIZE + STATUS_BYTES)
+                return HEAD_SIZE;
+            memcpy(out + HEAD_SIZE, status, STATUS_BYTES);
+            return HEAD_SIZE + STATUS_BYTES;
+        }
+
+        // the compact header at data: cmd, rsvp, flag, topic and the v1 size
+        // into head, body the bytes after it, status whether one is among
+        // them; bytes parsed, 0 if more are needed, -1 if it is malformed
+        inline long decode(const char* data, size_t len, Header& head, size_t& body, bool& status)
+        {
+            if (len < HEAD + 1)
+                return 0;
+            const auto* src = reinterpret_cast<const uint8_t*>(data);
+            if ((src[2] & ~(FLAG | STATUS)) != 0)
+                return -1;
+            uint64_t length = 0;
+            size_t used = HEAD;
+            for (int shift = 0;; shift += 7) {
+                if (shift > 28)
+                    return -1;
+                if (used == len)
+                    return 0;
+                uint8_t byte = src[used++];
+                length |= static_cast<uint64_t>(byte & 0x7f) << shift;
+                if ((byte & 0x80) == 0)
+                    break;
+            }
+            status = (src[2] & STATUS) != 0;
+            uint64_t size = HEAD_SIZE + length + (status || length == 0 ? 0 : STATUS_BYTES);
+            if (size > UINT32_MAX || (status && length < STATUS_BYTES))
+                return -1;
+            head.cmd = src[0];
+            head.rsvp = src[1];
+            head.flag = static_cast<G_ScaFlag>(src[2] & FLAG);
+            head.size = static_cast<uint32_t>(size);
+            head.topic = static_cast<uint32_t>(src[3]) | static_cast<uint32_t>(src[4]) << 8 |
+                static_cast<uint32_t>(src[5]) << 16 | static_cast<uint32_t>(src[6]) << 24;
+            body = static_cast<size_t>(length);
+            return static_cast<long>(used);
+        }
+
+        // cmd of a ring record standing for a publish too large for the ring:
+        // subscribers read that one from the session when they get this far
+        const uint8_t MARKER = 0x31;
+
+        // the marker of a publish into out, PREFIX bytes in the v1 layout
+        inline void mark(const Header& head, char* out)
+        {
+            Header marker = head;
+            marker.cmd = MARKER;
+            marker.size = static_cast<uint32_t>(PREFIX);
+            memcpy(out, &marker, HEAD_SIZE);
+            memcpy(out + HEAD_SIZE, OK, STATUS_BYTES);
+        }
+
+        // GroupHead of a datagram: seq u64 | topic u32 | kind u32
+        const size_t GROUP_HEAD = 16;
+
+        inline void encodeGroup(const GroupHead& head, char* out)
+        {
+            auto* dst = reinterpret_cast<uint8_t*>(out);
+            for (int i = 0; i < 8; ++i) {
+                dst[i] = static_cast<uint8_t>(head.seq >> (8 * i));
+            }
+            for (int i = 0; i < 4; ++i) {
+                dst[8 + i] = static_cast<uint8_t>(head.topic >> (8 * i));
+                dst[12 + i] = static_cast<uint8_t>(head.kind >> (8 * i));
+            }
+        }
+
+        // GROUP_HEAD bytes at data
+        inline GroupHead decodeGroup(const char* data)
+        {
+            const auto* src = reinterpret_cast<const uint8_t*>(data);
+            GroupHead head{};
+            for (int i = 0; i < 8; ++i) {
+                head.seq |= static_cast<uint64_t>(src[i]) << (8 * i);
+            }
+            for (int i = 0; i < 4; ++i) {
+                head.topic |= static_cast<uint32_t>(src[8 + i]) << (8 * i);
+                head.kind |= static_cast<uint32_t>(src[12 + i]) << (8 * i);
+            }
+            return head;
+        }
+
+        inline bool readFull(SOCKET socket, char* data, size_t len)
+        {
+            while (len > 0) {
+                ssize_t got = ::recv(socket, data, len, 0);
+                if (got < 0 && errno == EINTR)
+                    continue;
+                if (got <= 0)
+                    return false;
+                data += got;
+                len -= static_cast<size_t>(got);
+            }
+            return true;
+        }
+
+        // the header and status of the next frame, read exactly and laid out
+        // as in v1 (status the bytes of it there are, OK when v2 left it out);
+        // content the bytes still to read
+        inline bool readHead(SOCKET socket, uint8_t version, Header& head, char* status, size_t& content)
+        {
+            if (version < WIRE_VERSION) {
+                if (!readFull(socket, reinterpret_cast<char*>(&head), HEAD_SIZE) || head.size < HEAD_SIZE)
+                    return false;
+                size_t body = head.size - HEAD_SIZE;
+                size_t took = (body < STATUS_BYTES) ? body : STATUS_BYTES;
+                content = body - took;
+                return took == 0 || readFull(socket, status, took);
+            }
+            char prefix[PREFIX];
+            size_t have = HEAD;
+            size_t length = 0;
+            bool sent = false;
+            long used = 0;
+            if (!readFull(socket, prefix, have))
+                return false;
+            // the varint length a byte at a time
+            while ((used = decode(prefix, have, head, length, sent)) == 0) {
+                if (!readFull(socket, prefix + have, 1))
+                    return false;
+                have++;
+            }
+            if (used < 0)
+                return false;
+            if (length == 0) {
+                content = 0;
+                return true;
+            }
+            if (!sent) {
+                memcpy(status, OK, STATUS_BYTES);
+                content = length;
+                return true;
+            }
+            content = length - STATUS_BYTES;
+            return readFull(socket, status, STATUS_BYTES);
+        }
+
+        // the CRC32C of a publish's content (without its NUL) into status[4..7]
+        inline void seal(char* status, const char* content, size_t len)
+        {
+            uint32_t crc = Crc32c::extend(0, content, len);
+            for (int i = 0; i < 4; ++i) {
+                status[4 + i] = static_cast<char>(crc >> (8 * i));
+            }
+        }
+
+        // a traced publish: [content NUL] then the stamps of the hops below,
+        // u64 each, the subscriber adds its own to MessageView::trace()
+        enum Hop {
+            HOP_PUBLISH = 0,
+            HOP_RECEIVE,
+            HOP_ENQUEUE,
+            HOP_SEND,
+            HOPS
+        };
+        const size_t TRACE_BYTES = HOPS * sizeof(uint64_t);
+
+        inline uint64_t now()
+        {
+            return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count());
+        }
+
+        // bytes of stamps at the end of a frame, 0 if it is not traced
+        inline size_t trailer(const Header& head)
+        {
+            return (head.flag == PUBLISHER && (head.rsvp & TRACED) != 0 &&
+                head.size > HEAD_SIZE + STATUS_BYTES + TRACE_BYTES) ? TRACE_BYTES : 0;
+        }
+
+        inline void put(char* trace, Hop hop, uint64_t ns)
+        {
+            for (int i = 0; i < 8; ++i) {
+                trace[hop * sizeof(uint64_t) + i] = static_cast<char>(ns >> (8 * i));
+            }
+        }
+
+        inline uint64_t get(const char* trace, Hop hop)
+        {
+            const auto* src = reinterpret_cast<const uint8_t*>(trace + hop * sizeof(uint64_t));
+            uint64_t ns = 0;
+            for (int i = 0; i < 8; ++i) {
+                ns |= static_cast<uint64_t>(src[i]) << (8 * i);
+            }
+            return ns;
+        }
+
+        // now as the hop of a traced frame in the v1 layout, size bytes long
+        inline void stamp(char* frame, size_t size, Hop hop)
+        {
+            put(frame + size - TRACE_BYTES, hop, now());
+        }
+
+        // the content is what was sealed, or the frame was not
+        inline bool intact(const Header& head, const char* status, const char* content, size_t len)
+        {
+            if ((head.rsvp & CHECKED) == 0)
+                return true;
+            uint32_t crc = Crc32c::extend(0, content, len);
+            const auto* sum = reinterpret_cast<const uint8_t*>(status + 4);
+            return crc == (static_cast<uint32_t>(sum[0]) | static_cast<uint32_t>(sum[1]) << 8 |
+                static_cast<uint32_t>(sum[2]) << 16 | static_cast<uint32_t>(sum[3]) << 24);
+        }
+    }
+}
+
+#endif // SCADUP_WIRE_H
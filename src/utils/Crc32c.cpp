@@ -0,0 +1,113 @@
+#include "Crc32c.h"
+#include <cstring>
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#include <nmmintrin.h>
+#define CRC32C_SSE42 1
+#endif
+
+namespace {
+    const uint32_t POLY = 0x82f63b78; // 0x1edc6f41 reflected
+
+    struct Tables {
+        uint32_t t[8][256];
+        Tables()
+        {
+            for (uint32_t i = 0; i < 256; ++i) {
+                uint32_t crc = i;
+                for (int k = 0; k < 8; ++k) {
+                    crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+                }
+                t[0][i] = crc;
+            }
+            for (uint32_t i = 0; i < 256; ++i) {
+                for (int k = 1; k < 8; ++k) {
+                    t[k][i] = (t[k - 1][i] >> 8) ^ t[0][t[k - 1][i] & 0xff];
+                }
+            }
+        }
+    };
+    const Tables TABLES;
+
+    inline uint32_t load32(const uint8_t* p)
+    {
+        return static_cast<uint32_t>(p[0]) | static_cast<uint32_t>(p[1]) << 8 |
+            static_cast<uint32_t>(p[2]) << 16 | static_cast<uint32_t>(p[3]) << 24;
+    }
+
+    uint32_t slicing(uint32_t crc, const uint8_t* p, size_t len)
+    {
+        const auto& t = TABLES.t;
+        for (; len >= 8; p += 8, len -= 8) {
+            uint32_t lo = load32(p) ^ crc;
+            uint32_t hi = load32(p + 4);
+            crc = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24] ^
+                t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+        }
+        for (; len > 0; ++p, --len) {
+            crc = (crc >> 8) ^ t[0][(crc ^ *p) & 0xff];
+        }
+        return crc;
+    }
+
+#ifdef CRC32C_SSE42
+    __attribute__((target("sse4.2")))
+    uint32_t instruction(uint32_t crc, const uint8_t* p, size_t len)
+    {
+        for (; len > 0 && (reinterpret_cast<uintptr_t>(p) & 7) != 0; ++p, --len) {
+            crc = _mm_crc32_u8(crc, *p);
+        }
+#ifdef __x86_64__
+        uint64_t wide = crc;
+        for (; len >= 8; p += 8, len -= 8) {
+            uint64_t word;
+            memcpy(&word, p, sizeof(word));
+            wide = _mm_crc32_u64(wide, word);
+        }
+        crc = static_cast<uint32_t>(wide);
+#endif
+        for (; len >= 4; p += 4, len -= 4) {
+            uint32_t word;
+            memcpy(&word, p, sizeof(word));
+            crc = _mm_crc32_u32(crc, word);
+        }
+        for (; len > 0; ++p, --len) {
+            crc = _mm_crc32_u8(crc, *p);
+        }
+        return crc;
+    }
+
+    bool supported()
+    {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.2") != 0;
+    }
+#else
+    uint32_t instruction(uint32_t crc, const uint8_t* p, size_t len)
+    {
+        return slicing(crc, p, len);
+    }
+
+    bool supported()
+    {
+        return false;
+    }
+#endif
+
+    const bool HARDWARE = supported();
+}
+
+uint32_t Crc32c::extend(uint32_t crc, const void* data, size_t len)
+{
+    const auto* p = static_cast<const uint8_t*>(data);
+    return ~(HARDWARE ? instruction(~crc, p, len) : slicing(~crc, p, len));
+}
+
+uint32_t Crc32c::portable(uint32_t crc, const void* data, size_t len)
+{
+    return ~slicing(~crc, static_cast<const uint8_t*>(data), len);
+}
+
+bool Crc32c::hardware()
+{
+    return HARDWARE;
+}
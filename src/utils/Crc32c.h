@@ -0,0 +1,21 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <cstddef>
+#include <cstdint>
+
+/*
+ * CRC-32C (Castagnoli), the checksum of iSCSI and ext4. Taken with the SSE4.2
+ * crc32 instruction when the CPU has it, decided once at load, else with
+ * slicing-by-8 tables, eight bytes per step instead of one. Both give the
+ * same value for the same bytes on any host.
+ */
+class Crc32c {
+public:
+    // crc of the bytes so far (0 to start) extended by data
+    static uint32_t extend(uint32_t, const void*, size_t);
+    static uint32_t portable(uint32_t, const void*, size_t); // the tables, whatever the CPU
+    static bool hardware(); // extend() runs on the instruction
+};
+
+#endif
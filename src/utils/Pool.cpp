@@ -0,0 +1,366 @@
+#include "Pool.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <new>
+#include <vector>
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+namespace {
+    const unsigned CLASSES = 11;          // 64 << 0 .. 64 << 10
+    const size_t MIN_CLASS = 64;
+    const size_t MAX_CLASS = MIN_CLASS << (CLASSES - 1);
+    const size_t SLAB_SIZE = 2 * 1024 * 1024;
+    const size_t CACHE_BYTES = 512 * 1024; // per thread and class
+    const size_t BATCH = 32;
+    const uint32_t OVERSIZE = 0xffffffff;
+
+    // prefixes every block, keeps the payload 16-byte aligned
+    struct Tag {
+        uint64_t size;
+        uint32_t cls;
+        uint32_t reserved;
+    };
+    const size_t TAG_SIZE = sizeof(Tag);
+
+    struct Block {
+        Block* next;
+    };
+
+    struct Counters {
+        std::atomic<size_t> hits{ 0 };
+        std::atomic<size_t> refills{ 0 };
+        std::atomic<size_t> misses{ 0 };
+        std::atomic<size_t> oversize{ 0 };
+    };
+
+    // only the owner thread writes its counters, no read-modify-write needed
+    inline void bump(std::atomic<size_t>& counter, size_t n = 1)
+    {
+        counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    inline size_t classSize(unsigned cls)
+    {
+        return MIN_CLASS << cls;
+    }
+
+    inline unsigned classOf(size_t size)
+    {
+        if (size <= MIN_CLASS)
+            return 0;
+#ifdef __GNUC__
+        return static_cast<unsigned>(64 - __builtin_clzll(static_cast<unsigned long long>(size - 1))) - 6;
+#else
+        unsigned cls = 0;
+        while (classSize(cls) < size)
+            cls++;
+        return cls;
+#endif
+    }
+
+    inline size_t cacheLimit(unsigned cls)
+    {
+        return std::min<size_t>(256, std::max<size_t>(8, CACHE_BYTES / classSize(cls)));
+    }
+
+    struct Cache;
+
+    struct Shared {
+        struct Depot {
+            std::mutex lock{};
+            Block* head = nullptr;
+        } depots[CLASSES];
+        std::mutex slabLock{};
+        char* cursor = nullptr;
+        char* end = nullptr;
+        std::atomic<size_t> slabBytes{ 0 };
+        std::atomic<size_t> hugeBytes{ 0 };
+        std::atomic<bool> huge{ false };
+        std::mutex registry{};
+        std::vector<Cache*> caches{};
+        Counters retired{};
+    };
+
+    // never destroyed: blocks may still be freed from static destructors
+    Shared& shared()
+    {
+        static auto* instance = new Shared();
+        return *instance;
+    }
+
+    char* newSlab(Shared& sh)
+    {
+        char* slab = nullptr;
+#ifdef __linux__
+        if (sh.huge.load(std::memory_order_relaxed)) {
+            void* mem = mmap(nullptr, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (mem != MAP_FAILED) {
+                sh.hugeBytes += SLAB_SIZE;
+                slab = static_cast<char*>(mem);
+            } else {
+                // no reserved huge pages, ask for transparent ones instead
+                mem = mmap(nullptr, SLAB_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                if (mem != MAP_FAILED) {
+#ifdef MADV_HUGEPAGE
+                    if (madvise(mem, SLAB_SIZE, MADV_HUGEPAGE) == 0)
+                        sh.hugeBytes += SLAB_SIZE;
+#endif
+                    slab = static_cast<char*>(mem);
+                }
+            }
+        }
+#endif
+        if (slab == nullptr)
+            slab = static_cast<char*>(std::malloc(SLAB_SIZE));
+        if (slab != nullptr)
+            sh.slabBytes += SLAB_SIZE;
+        return slab;
+    }
+
+    // chains up to `count` fresh blocks of one class, returns how many
+    size_t carve(Shared& sh, unsigned cls, size_t count, Block*& head)
+    {
+        const size_t stride = TAG_SIZE + classSize(cls);
+        std::lock_guard<std::mutex> lock(sh.slabLock);
+        if (sh.cursor == nullptr || static_cast<size_t>(sh.end - sh.cursor) < stride) {
+            // the tail of the old slab is given up
+            char* slab = newSlab(sh);
+            if (slab == nullptr)
+                return 0;
+            sh.cursor = slab;
+            sh.end = slab + SLAB_SIZE;
+        }
+        size_t n = std::min(count, static_cast<size_t>(sh.end - sh.cursor) / stride);
+        for (size_t i = 0; i < n; ++i) {
+            auto* block = reinterpret_cast<Block*>(sh.cursor);
+            block->next = head;
+            head = block;
+            sh.cursor += stride;
+        }
+        return n;
+    }
+
+    struct Cache {
+        Block* heads[CLASSES] = {};
+        size_t counts[CLASSES] = {};
+        Counters counters{};
+
+        Cache()
+        {
+            Shared& sh = shared();
+            std::lock_guard<std::mutex> lock(sh.registry);
+            sh.caches.emplace_back(this);
+        }
+        ~Cache();
+
+        void spill(unsigned cls, size_t keep)
+        {
+            Block* first = heads[cls];
+            Block* last = nullptr;
+            Block* it = first;
+            size_t n = counts[cls];
+            for (; n > keep; --n) {
+                last = it;
+                it = it->next;
+            }
+            if (last == nullptr)
+                return;
+            heads[cls] = it;
+            counts[cls] = keep;
+            Shared::Depot& depot = shared().depots[cls];
+            std::lock_guard<std::mutex> lock(depot.lock);
+            last->next = depot.head;
+            depot.head = first;
+        }
+    };
+
+#if defined(__GNUC__) && !defined(_WIN32)
+#define FAST_TLS __attribute__((tls_model("initial-exec")))
+#else
+#define FAST_TLS
+#endif
+    // a trivial thread_local is a plain TLS load on the hot path; the value
+    // RETIRED marks a thread whose cache is gone, its frees go to the depot
+    const uintptr_t RETIRED = 1;
+    thread_local uintptr_t t_cache FAST_TLS = 0;
+
+    Cache::~Cache()
+    {
+        for (unsigned cls = 0; cls < CLASSES; ++cls) {
+            spill(cls, 0);
+        }
+        Shared& sh = shared();
+        std::lock_guard<std::mutex> lock(sh.registry);
+        sh.caches.erase(std::remove(sh.caches.begin(), sh.caches.end(), this), sh.caches.end());
+        sh.retired.hits += counters.hits.load();
+        sh.retired.refills += counters.refills.load();
+        sh.retired.misses += counters.misses.load();
+        sh.retired.oversize += counters.oversize.load();
+    }
+
+    struct Reaper {
+        ~Reaper()
+        {
+            if (t_cache > RETIRED)
+                delete reinterpret_cast<Cache*>(t_cache);
+            t_cache = RETIRED;
+        }
+    };
+
+    Cache* create()
+    {
+        if (t_cache == RETIRED)
+            return nullptr;
+        thread_local Reaper reaper; // flushes the cache at thread exit
+        (void)reaper;
+        auto* cache = new(std::nothrow) Cache();
+        t_cache = reinterpret_cast<uintptr_t>(cache);
+        return cache;
+    }
+
+    inline Cache* local()
+    {
+        uintptr_t cache = t_cache;
+        if (cache > RETIRED)
+            return reinterpret_cast<Cache*>(cache);
+        return (cache == 0) ? create() : nullptr;
+    }
+
+    // one block from the depot or a slab, a thread cache gets a batch along
+    Block* fetch(unsigned cls, Cache* cache)
+    {
+        Shared& sh = shared();
+        Shared::Depot& depot = sh.depots[cls];
+        Block* block = nullptr;
+        {
+            std::lock_guard<std::mutex> lock(depot.lock);
+            block = depot.head;
+            if (block != nullptr) {
+                depot.head = block->next;
+                if (cache != nullptr) {
+                    // take a batch along while holding the lock
+                    for (size_t i = 1; i < BATCH && depot.head != nullptr; ++i) {
+                        Block* next = depot.head->next;
+                        depot.head->next = cache->heads[cls];
+                        cache->heads[cls] = depot.head;
+                        cache->counts[cls]++;
+                        depot.head = next;
+                    }
+                }
+            }
+        }
+        if (block != nullptr) {
+            if (cache != nullptr)
+                bump(cache->counters.refills);
+            else
+                sh.retired.refills++;
+            return block;
+        }
+        Block* chain = nullptr;
+        size_t n = carve(sh, cls, cache != nullptr ? BATCH : 1, chain);
+        if (n == 0)
+            return nullptr;
+        block = chain;
+        if (cache != nullptr) {
+            cache->heads[cls] = chain->next;
+            cache->counts[cls] = n - 1;
+            bump(cache->counters.misses);
+        } else {
+            sh.retired.misses++;
+        }
+        return block;
+    }
+}
+
+void* Pool::alloc(size_t size)
+{
+    Cache* cache = local();
+    if (size > MAX_CLASS) {
+        auto* tag = static_cast<Tag*>(std::malloc(TAG_SIZE + size));
+        if (tag == nullptr)
+            return nullptr;
+        tag->size = size;
+        tag->cls = OVERSIZE;
+        if (cache != nullptr)
+            bump(cache->counters.oversize);
+        else
+            shared().retired.oversize++;
+        return tag + 1;
+    }
+    unsigned cls = classOf(size);
+    Block* block = nullptr;
+    if (cache != nullptr && cache->heads[cls] != nullptr) {
+        block = cache->heads[cls];
+        cache->heads[cls] = block->next;
+        cache->counts[cls]--;
+        bump(cache->counters.hits);
+    } else {
+        block = fetch(cls, cache);
+        if (block == nullptr)
+            return nullptr;
+    }
+    auto* tag = reinterpret_cast<Tag*>(block);
+    tag->size = classSize(cls);
+    tag->cls = cls;
+    return tag + 1;
+}
+
+void Pool::free(void* ptr)
+{
+    if (ptr == nullptr)
+        return;
+    Tag* tag = static_cast<Tag*>(ptr) - 1;
+    if (tag->cls == OVERSIZE) {
+        std::free(tag);
+        return;
+    }
+    unsigned cls = tag->cls;
+    auto* block = reinterpret_cast<Block*>(tag);
+    Cache* cache = local();
+    if (cache == nullptr) {
+        Shared::Depot& depot = shared().depots[cls];
+        std::lock_guard<std::mutex> lock(depot.lock);
+        block->next = depot.head;
+        depot.head = block;
+        return;
+    }
+    block->next = cache->heads[cls];
+    cache->heads[cls] = block;
+    if (++cache->counts[cls] > cacheLimit(cls))
+        cache->spill(cls, cacheLimit(cls) / 2);
+}
+
+size_t Pool::usable(const void* ptr)
+{
+    return (ptr == nullptr) ? 0 : static_cast<size_t>((static_cast<const Tag*>(ptr) - 1)->size);
+}
+
+void Pool::setHugePages(bool enable)
+{
+    shared().huge = enable;
+}
+
+Pool::Stats Pool::stats()
+{
+    Shared& sh = shared();
+    Stats stats{};
+    std::lock_guard<std::mutex> lock(sh.registry);
+    stats.hits = sh.retired.hits;
+    stats.refills = sh.retired.refills;
+    stats.misses = sh.retired.misses;
+    stats.oversize = sh.retired.oversize;
+    for (const auto* cache : sh.caches) {
+        stats.hits += cache->counters.hits.load(std::memory_order_relaxed);
+        stats.refills += cache->counters.refills.load(std::memory_order_relaxed);
+        stats.misses += cache->counters.misses.load(std::memory_order_relaxed);
+        stats.oversize += cache->counters.oversize.load(std::memory_order_relaxed);
+    }
+    stats.slabBytes = sh.slabBytes;
+    stats.hugeBytes = sh.hugeBytes;
+    return stats;
+}
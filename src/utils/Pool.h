@@ -0,0 +1,30 @@
+#ifndef POOL_H
+#define POOL_H
+
+#include <cstddef>
+
+/*
+ * Size-class buffer pool. Blocks of 64 B .. 64 KiB are carved from 2 MiB slabs
+ * (optionally huge-page backed), cached per thread and spilled to a shared
+ * depot; larger requests go straight to malloc. A block may be freed by any
+ * thread, slabs are kept for the life of the process.
+ */
+class Pool {
+public:
+    struct Stats {
+        size_t hits;      // served by the calling thread's cache
+        size_t refills;   // served by the shared depot
+        size_t misses;    // carved from a slab
+        size_t oversize;  // above the largest class, malloc'ed
+        size_t slabBytes;
+        size_t hugeBytes; // part of slabBytes backed by huge pages
+    };
+
+    static void* alloc(size_t);
+    static void free(void*);
+    static size_t usable(const void*);
+    static void setHugePages(bool);
+    static Stats stats();
+};
+
+#endif
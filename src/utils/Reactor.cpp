@@ -0,0 +1,212 @@
+#include "Reactor.h"
+#include <cerrno>
+#include <fcntl.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <unistd.h>
+#elif defined(_WIN32)
+#define poll WSAPoll
+#else
+#include <poll.h>
+#include <unistd.h>
+#endif
+
+Reactor::~Reactor()
+{
+    close();
+}
+
+int Reactor::setNonBlock(SOCKET sock)
+{
+#ifdef _WIN32
+    u_long mode = 1;
+    return ioctlsocket(sock, FIONBIO, &mode);
+#else
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0)
+        return -1;
+    return fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+#endif
+}
+
+#ifdef __linux__
+
+int Reactor::open(size_t events)
+{
+    m_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (m_epoll < 0)
+        return -1;
+    m_wakeup = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_wakeup < 0) {
+        close();
+        return -2;
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.ptr = &m_wakeup;
+    if (epoll_ctl(m_epoll, EPOLL_CTL_ADD, m_wakeup, &ev) < 0) {
+        close();
+        return -3;
+    }
+    m_events.resize(events == 0 ? 1 : events);
+    m_ready.resize(m_events.size());
+    return 0;
+}
+
+void Reactor::close()
+{
+    if (m_wakeup >= 0) {
+        ::close(m_wakeup);
+        m_wakeup = -1;
+    }
+    if (m_epoll >= 0) {
+        ::close(m_epoll);
+        m_epoll = -1;
+    }
+}
+
+static uint32_t toEpoll(uint32_t events)
+{
+    uint32_t ev = EPOLLET | EPOLLRDHUP;
+    if (events & Reactor::READ)
+        ev |= EPOLLIN;
+    if (events & Reactor::WRITE)
+        ev |= EPOLLOUT;
+    return ev;
+}
+
+int Reactor::add(SOCKET sock, uint32_t events, void* data)
+{
+    epoll_event ev{};
+    ev.events = toEpoll(events);
+    ev.data.ptr = data;
+    return epoll_ctl(m_epoll, EPOLL_CTL_ADD, sock, &ev);
+}
+
+int Reactor::modify(SOCKET sock, uint32_t events, void* data)
+{
+    epoll_event ev{};
+    ev.events = toEpoll(events);
+    ev.data.ptr = data;
+    return epoll_ctl(m_epoll, EPOLL_CTL_MOD, sock, &ev);
+}
+
+int Reactor::remove(SOCKET sock)
+{
+    return epoll_ctl(m_epoll, EPOLL_CTL_DEL, sock, nullptr);
+}
+
+int Reactor::wait(int timeout)
+{
+    int n = epoll_wait(m_epoll, m_events.data(), static_cast<int>(m_events.size()), timeout);
+    if (n < 0)
+        return (errno == EINTR) ? 0 : -1;
+    int count = 0;
+    for (int i = 0; i < n; ++i) {
+        const epoll_event& ev = m_events[i];
+        if (ev.data.ptr == &m_wakeup) {
+            uint64_t val = 0;
+            while (::read(m_wakeup, &val, sizeof(val)) > 0) { }
+            continue;
+        }
+        uint32_t events = 0;
+        if (ev.events & EPOLLIN)
+            events |= READ;
+        if (ev.events & EPOLLOUT)
+            events |= WRITE;
+        if (ev.events & EPOLLERR)
+            events |= FAULT;
+        if (ev.events & (EPOLLHUP | EPOLLRDHUP))
+            events |= CLOSE | READ;
+        m_ready[count].events = events;
+        m_ready[count].data = ev.data.ptr;
+        count++;
+    }
+    return count;
+}
+
+void Reactor::notify()
+{
+    uint64_t one = 1;
+    ssize_t len = ::write(m_wakeup, &one, sizeof(one));
+    static_cast<void>(len);
+}
+
+#else
+
+int Reactor::open(size_t)
+{
+    return 0;
+}
+
+void Reactor::close()
+{
+    m_watch.clear();
+}
+
+int Reactor::add(SOCKET sock, uint32_t events, void* data)
+{
+    m_watch[sock] = Event{ events, data };
+    return 0;
+}
+
+int Reactor::modify(SOCKET sock, uint32_t events, void* data)
+{
+    return add(sock, events, data);
+}
+
+int Reactor::remove(SOCKET sock)
+{
+    m_watch.erase(sock);
+    return 0;
+}
+
+int Reactor::wait(int timeout)
+{
+    // without a wakeup descriptor, bound the sleep so notify() is seen promptly
+    const int slice = 10;
+    if (timeout < 0 || timeout > slice)
+        timeout = slice;
+    std::vector<pollfd> fds;
+    fds.reserve(m_watch.size());
+    for (auto& watch : m_watch) {
+        pollfd pfd{};
+        pfd.fd = watch.first;
+        pfd.events = static_cast<short>(((watch.second.events & READ) ? POLLIN : 0) |
+            ((watch.second.events & WRITE) ? POLLOUT : 0));
+        fds.emplace_back(pfd);
+    }
+    int n = fds.empty() ? 0 : poll(fds.data(), static_cast<unsigned long>(fds.size()), timeout);
+    if (m_notified.exchange(false) && n <= 0)
+        return 0;
+    if (n < 0)
+        return (errno == EINTR) ? 0 : -1;
+    m_ready.clear();
+    for (auto& pfd : fds) {
+        if (pfd.revents == 0)
+            continue;
+        uint32_t events = 0;
+        if (pfd.revents & POLLIN)
+            events |= READ;
+        if (pfd.revents & POLLOUT)
+            events |= WRITE;
+        if (pfd.revents & POLLERR)
+            events |= FAULT;
+        if (pfd.revents & POLLHUP)
+            events |= CLOSE | READ;
+        m_ready.push_back(Event{ events, m_watch[pfd.fd].data });
+    }
+    return static_cast<int>(m_ready.size());
+}
+
+void Reactor::notify()
+{
+    m_notified = true;
+}
+
+#endif
+
+const Reactor::Event& Reactor::event(int index) const
+{
+    return m_ready[index];
+}
@@ -0,0 +1,64 @@
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <cstdint>
+#include <vector>
+#ifdef _WIN32
+#include <Winsock2.h>
+#else
+typedef int SOCKET;
+#endif
+#ifdef __linux__
+#include <sys/epoll.h>
+#else
+#include <atomic>
+#include <map>
+#endif
+
+/*
+ * Readiness notifier owning a set of non-blocking sockets.
+ * Linux uses edge-triggered epoll, other platforms fall back to level-triggered poll();
+ * handlers must drain a socket until EAGAIN either way.
+ */
+class Reactor {
+public:
+    enum : uint32_t {
+        READ = 0x1,
+        WRITE = 0x4,
+        FAULT = 0x8,
+        CLOSE = 0x10,
+    };
+    struct Event {
+        uint32_t events;
+        void* data;
+    };
+
+    Reactor() = default;
+    ~Reactor();
+    Reactor(const Reactor&) = delete;
+    Reactor& operator=(const Reactor&) = delete;
+
+    int open(size_t = 1024);
+    void close();
+    int add(SOCKET, uint32_t, void*);
+    int modify(SOCKET, uint32_t, void*);
+    int remove(SOCKET);
+    int wait(int); // milliseconds, returns number of ready events
+    const Event& event(int) const;
+    void notify(); // wake up wait() from another thread
+
+    static int setNonBlock(SOCKET);
+
+private:
+    std::vector<Event> m_ready{};
+#ifdef __linux__
+    std::vector<epoll_event> m_events{};
+    int m_epoll = -1;
+    int m_wakeup = -1;
+#else
+    std::map<SOCKET, Event> m_watch{};
+    std::atomic<bool> m_notified{ false };
+#endif
+};
+
+#endif // REACTOR_H
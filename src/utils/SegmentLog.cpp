@@ -0,0 +1,415 @@
+#include "SegmentLog.h"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#ifndef _WIN32
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    const uint32_t MAGIC = 0x474f4c53; // "SLOG"
+
+    // precedes every record, records are 8-byte aligned in the segment
+    struct RecordHead {
+        uint32_t magic;
+        uint32_t size;
+        uint64_t seq;
+        uint64_t time;
+    };
+    const size_t RECORD_HEAD = sizeof(RecordHead);
+
+    inline size_t span(uint32_t size)
+    {
+        return (RECORD_HEAD + size + 7) & ~static_cast<size_t>(7);
+    }
+}
+
+#ifdef _WIN32
+
+struct SegmentLog::Segment {
+};
+
+SegmentLog::~SegmentLog() = default;
+int SegmentLog::open(const std::string&, size_t, size_t) { return -1; }
+void SegmentLog::close() { }
+int64_t SegmentLog::append(const void*, uint32_t, uint64_t) { return -1; }
+int SegmentLog::sync() { return -1; }
+size_t SegmentLog::read(uint64_t, size_t, const Reader&) { return 0; }
+uint64_t SegmentLog::seek(uint64_t) { return 0; }
+uint64_t SegmentLog::first() const { return 0; }
+uint64_t SegmentLog::next() const { return 0; }
+size_t SegmentLog::unsynced() const { return 0; }
+
+#else
+
+struct SegmentLog::Segment {
+    uint64_t base = 0; // sequence of the first record
+    uint64_t last = 0; // sequence after the last record
+    int fd = -1;
+    int idx = -1;
+    size_t capacity = 0; // file length
+    size_t end = 0; // bytes of complete records
+    std::vector<Entry> index{};
+    std::mutex mapLock{};
+    std::atomic<char*> map{ nullptr };
+    size_t mapSize = 0;
+
+    ~Segment()
+    {
+        char* mem = map.load();
+        if (mem != nullptr)
+            munmap(mem, mapSize);
+        if (fd >= 0)
+            ::close(fd);
+        if (idx >= 0)
+            ::close(idx);
+    }
+
+    // maps the file as long as it is now, later appends stay below that
+    const char* mapped(size_t length)
+    {
+        char* mem = map.load(std::memory_order_acquire);
+        if (mem != nullptr)
+            return mem;
+        std::lock_guard<std::mutex> lock(mapLock);
+        mem = map.load(std::memory_order_relaxed);
+        if (mem == nullptr && length > 0) {
+            void* addr = mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0);
+            if (addr == MAP_FAILED)
+                return nullptr;
+            mem = static_cast<char*>(addr);
+            mapSize = length;
+            map.store(mem, std::memory_order_release);
+        }
+        return mem;
+    }
+};
+
+static std::string segmentPath(const std::string& dir, uint64_t base, const char* ext)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%020llu.%s", static_cast<unsigned long long>(base), ext);
+    return dir + "/" + name;
+}
+
+static int makeDirs(const std::string& dir)
+{
+    for (size_t pos = 1; pos <= dir.size(); ++pos) {
+        if (pos != dir.size() && dir[pos] != '/')
+            continue;
+        std::string part = dir.substr(0, pos);
+        if (::mkdir(part.c_str(), 0755) != 0 && errno != EEXIST)
+            return -1;
+    }
+    return 0;
+}
+
+static void syncDir(const std::string& dir)
+{
+    int fd = ::open(dir.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd >= 0) {
+        fsync(fd);
+        ::close(fd);
+    }
+}
+
+SegmentLog::~SegmentLog()
+{
+    close();
+}
+
+int SegmentLog::open(const std::string& dir, size_t segment, size_t index)
+{
+    close();
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_dir = dir;
+    m_segmentBytes = std::max<size_t>(segment, 4096);
+    m_indexBytes = std::max<size_t>(index, 1);
+    if (makeDirs(dir) != 0)
+        return -1;
+    DIR* handle = opendir(dir.c_str());
+    if (handle == nullptr)
+        return -1;
+    std::vector<uint64_t> bases;
+    while (dirent* ent = readdir(handle)) {
+        unsigned long long base = 0;
+        char ext[8] = {};
+        if (strlen(ent->d_name) == 24 && sscanf(ent->d_name, "%20llu.%3s", &base, ext) == 2 && strcmp(ext, "log") == 0)
+            bases.emplace_back(base);
+    }
+    closedir(handle);
+    std::sort(bases.begin(), bases.end());
+    for (uint64_t base : bases) {
+        auto seg = std::make_shared<Segment>();
+        seg->base = base;
+        seg->fd = ::open(segmentPath(dir, base, "log").c_str(), O_RDWR | O_CLOEXEC);
+        seg->idx = ::open(segmentPath(dir, base, "idx").c_str(), O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+        struct stat st { };
+        if (seg->fd < 0 || seg->idx < 0 || fstat(seg->fd, &st) != 0) {
+            m_segments.clear();
+            return -1;
+        }
+        seg->capacity = static_cast<size_t>(st.st_size);
+        if (recover(seg, base) != 0) {
+            m_segments.clear();
+            return -1;
+        }
+        m_segments.emplace_back(seg);
+    }
+    if (m_segments.empty()) {
+        auto seg = create(0, m_segmentBytes);
+        if (!seg)
+            return -1;
+        m_segments.emplace_back(seg);
+    }
+    m_next = m_segments.back()->last;
+    return 0;
+}
+
+int SegmentLog::recover(const std::shared_ptr<Segment>& seg, uint64_t base)
+{
+    struct stat st { };
+    if (fstat(seg->idx, &st) != 0)
+        return -1;
+    size_t count = static_cast<size_t>(st.st_size) / sizeof(Entry);
+    seg->index.resize(count);
+    if (count > 0 && pread(seg->idx, seg->index.data(), count * sizeof(Entry), 0) !=
+        static_cast<ssize_t>(count * sizeof(Entry)))
+        return -1;
+    // resume from the last index entry that still points at its record
+    size_t pos = 0;
+    uint64_t seq = base;
+    RecordHead head{};
+    while (!seg->index.empty()) {
+        const Entry& entry = seg->index.back();
+        if (entry.pos + RECORD_HEAD <= seg->capacity &&
+            pread(seg->fd, &head, RECORD_HEAD, static_cast<off_t>(entry.pos)) == static_cast<ssize_t>(RECORD_HEAD) &&
+            head.magic == MAGIC && head.seq == entry.seq) {
+            pos = entry.pos;
+            seq = entry.seq;
+            break;
+        }
+        seg->index.pop_back();
+    }
+    while (pos + RECORD_HEAD <= seg->capacity) {
+        if (pread(seg->fd, &head, RECORD_HEAD, static_cast<off_t>(pos)) != static_cast<ssize_t>(RECORD_HEAD))
+            break;
+        if (head.magic != MAGIC || head.seq != seq || pos + span(head.size) > seg->capacity)
+            break;
+        pos += span(head.size);
+        seq++;
+    }
+    seg->end = pos;
+    seg->last = seq;
+    if (ftruncate(seg->idx, static_cast<off_t>(seg->index.size() * sizeof(Entry))) != 0)
+        return -1;
+    return 0;
+}
+
+std::shared_ptr<SegmentLog::Segment> SegmentLog::create(uint64_t base, size_t capacity)
+{
+    auto seg = std::make_shared<Segment>();
+    seg->base = seg->last = base;
+    seg->capacity = capacity;
+    seg->fd = ::open(segmentPath(m_dir, base, "log").c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    seg->idx = ::open(segmentPath(m_dir, base, "idx").c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (seg->fd < 0 || seg->idx < 0)
+        return nullptr;
+    // blocks allocated up front: appends never change the file size, so
+    // fdatasync() has no metadata to write
+#ifdef __linux__
+    if (posix_fallocate(seg->fd, 0, static_cast<off_t>(capacity)) != 0 &&
+        ftruncate(seg->fd, static_cast<off_t>(capacity)) != 0)
+        return nullptr;
+#else
+    if (ftruncate(seg->fd, static_cast<off_t>(capacity)) != 0)
+        return nullptr;
+#endif
+    syncDir(m_dir);
+    return seg;
+}
+
+int SegmentLog::roll(size_t need)
+{
+    std::shared_ptr<Segment> active = m_segments.back();
+    if (active->end == 0) {
+        // nothing in it, replaced by a large enough one of the same name
+        m_segments.pop_back();
+    } else {
+        // sealed segments shrink to their data, readers never map beyond it
+        if (ftruncate(active->fd, static_cast<off_t>(active->end)) == 0)
+            active->capacity = active->end;
+        m_dirty.emplace_back(active);
+    }
+    auto seg = create(m_next, std::max(m_segmentBytes, need));
+    if (!seg)
+        return -1;
+    m_segments.emplace_back(seg);
+    return 0;
+}
+
+void SegmentLog::close()
+{
+    sync();
+    std::lock_guard<std::mutex> lock(m_lock);
+    m_segments.clear();
+    m_dirty.clear();
+    m_unsynced = 0;
+    m_next = 0;
+}
+
+int64_t SegmentLog::append(const void* data, uint32_t size, uint64_t time)
+{
+    static const char padding[8] = {};
+    const size_t total = span(size);
+    std::lock_guard<std::mutex> lock(m_lock);
+    if (m_segments.empty())
+        return -1;
+    if (m_segments.back()->end + total > m_segments.back()->capacity && roll(total) != 0)
+        return -1;
+    Segment* seg = m_segments.back().get();
+    RecordHead head{ MAGIC, size, m_next, time };
+    iovec iov[3] = {
+        { &head, RECORD_HEAD },
+        { const_cast<void*>(data), size },
+        { const_cast<char*>(padding), total - RECORD_HEAD - size },
+    };
+    size_t pos = seg->end;
+    ssize_t sz = pwritev(seg->fd, iov, iov[2].iov_len > 0 ? 3 : 2, static_cast<off_t>(pos));
+    if (sz != static_cast<ssize_t>(total))
+        return -1; // a torn record is overwritten by the next append
+    if (seg->index.empty() || pos - seg->index.back().pos >= m_indexBytes) {
+        Entry entry{ m_next, pos, time };
+        if (::write(seg->idx, &entry, sizeof(entry)) == static_cast<ssize_t>(sizeof(entry)))
+            seg->index.emplace_back(entry);
+    }
+    seg->end = pos + total;
+    seg->last = ++m_next;
+    m_unsynced++;
+    return static_cast<int64_t>(head.seq);
+}
+
+int SegmentLog::sync()
+{
+    std::vector<std::shared_ptr<Segment>> segments;
+    {
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (m_segments.empty())
+            return 0;
+        segments.swap(m_dirty);
+        segments.emplace_back(m_segments.back());
+        m_unsynced = 0;
+    }
+    int rc = 0;
+    for (const auto& seg : segments) {
+        if (fdatasync(seg->fd) != 0 || fdatasync(seg->idx) != 0)
+            rc = -1;
+    }
+    return rc;
+}
+
+size_t SegmentLog::read(uint64_t from, size_t bytes, const Reader& reader)
+{
+    size_t count = 0;
+    size_t total = 0;
+    uint64_t seq = from;
+    for (;;) {
+        std::shared_ptr<Segment> seg;
+        size_t pos = 0;
+        size_t end = 0;
+        size_t length = 0;
+        uint64_t last = 0;
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            if (m_segments.empty() || seq >= m_next)
+                break;
+            seq = std::max(seq, m_segments.front()->base);
+            auto it = std::upper_bound(m_segments.begin(), m_segments.end(), seq,
+                [](uint64_t s, const std::shared_ptr<Segment>& sg) { return s < sg->base; });
+            seg = *(it - 1);
+            auto entry = std::upper_bound(seg->index.begin(), seg->index.end(), seq,
+                [](uint64_t s, const Entry& e) { return s < e.seq; });
+            if (entry != seg->index.begin())
+                pos = (entry - 1)->pos;
+            end = seg->end;
+            length = seg->capacity;
+            last = seg->last;
+        }
+        const char* map = (end > pos) ? seg->mapped(length) : nullptr;
+        if (map == nullptr) {
+            if (end > pos)
+                break;
+            seq = std::max(seq, last);
+            continue;
+        }
+        while (pos < end) {
+            const auto* head = reinterpret_cast<const RecordHead*>(map + pos);
+            pos += span(head->size);
+            if (head->seq < seq)
+                continue;
+            Record record{ head->seq, head->time, map + (pos - span(head->size)) + RECORD_HEAD, head->size };
+            seq = head->seq + 1;
+            count++;
+            total += head->size;
+            if (!reader(record) || (bytes > 0 && total >= bytes))
+                return count;
+        }
+        // this segment is done, go on with the next one
+        seq = std::max(seq, last);
+    }
+    return count;
+}
+
+uint64_t SegmentLog::seek(uint64_t time)
+{
+    uint64_t from = 0;
+    {
+        // the index entry before the time narrows the scan to one interval
+        std::lock_guard<std::mutex> lock(m_lock);
+        if (m_segments.empty())
+            return m_next;
+        from = m_segments.front()->base;
+        for (const auto& seg : m_segments) {
+            if (seg->index.empty() || seg->index.front().time >= time)
+                break;
+            auto entry = std::lower_bound(seg->index.begin(), seg->index.end(), time,
+                [](const Entry& e, uint64_t t) { return e.time < t; });
+            from = (entry - 1)->seq;
+        }
+    }
+    uint64_t found = next();
+    read(from, 0, [&found, time](const Record& record) {
+        if (record.time < time)
+            return true;
+        found = record.seq;
+        return false;
+    });
+    return found;
+}
+
+uint64_t SegmentLog::first() const
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_segments.empty() ? m_next : m_segments.front()->base;
+}
+
+uint64_t SegmentLog::next() const
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_next;
+}
+
+size_t SegmentLog::unsynced() const
+{
+    std::lock_guard<std::mutex> lock(m_lock);
+    return m_unsynced;
+}
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef SEGMENT_LOG_H
+#define SEGMENT_LOG_H
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/*
+ * Append-only record log in one directory, split into preallocated segment
+ * files named by their first sequence number, each with a sparse index of
+ * (sequence, position, time) every `index` bytes. Appends are pwrite()s into
+ * the page cache, sync() makes them durable with fdatasync(); reads go through
+ * a read-only mmap of the segment, so a reader never copies nor blocks
+ * appends. Sealed segments are truncated to their data, the active one is
+ * recovered on open() by scanning from its last index entry.
+ */
+class SegmentLog {
+public:
+    struct Record {
+        uint64_t seq;
+        uint64_t time; // caller defined, ns since epoch in the broker
+        const char* data; // into the mapping, valid during the callback
+        uint32_t size;
+    };
+    typedef std::function<bool(const Record&)> Reader; // false stops the read
+
+    SegmentLog() = default;
+    ~SegmentLog();
+    SegmentLog(const SegmentLog&) = delete;
+    SegmentLog& operator=(const SegmentLog&) = delete;
+
+    int open(const std::string&, size_t segment = 64 * 1024 * 1024, size_t index = 4096);
+    void close();
+    int64_t append(const void*, uint32_t, uint64_t); // sequence number, -1 on failure
+    int sync(); // fdatasync what was appended since the last sync
+    size_t read(uint64_t, size_t, const Reader&); // from sequence, up to bytes; records read
+    uint64_t seek(uint64_t); // first sequence stamped at or after the time, next() if none
+    uint64_t first() const; // oldest sequence kept
+    uint64_t next() const; // sequence of the next append
+    size_t unsynced() const; // appends not yet synced
+
+private:
+    struct Segment;
+    struct Entry {
+        uint64_t seq;
+        uint64_t pos;
+        uint64_t time;
+    };
+
+    std::shared_ptr<Segment> create(uint64_t, size_t);
+    int recover(const std::shared_ptr<Segment>&, uint64_t);
+    int roll(size_t);
+
+    mutable std::mutex m_lock{};
+    std::string m_dir{};
+    std::vector<std::shared_ptr<Segment>> m_segments{}; // oldest first, last one active
+    size_t m_segmentBytes = 0;
+    size_t m_indexBytes = 0;
+    uint64_t m_next = 0;
+    size_t m_unsynced = 0;
+    std::vector<std::shared_ptr<Segment>> m_dirty{}; // sealed since the last sync
+};
+
+#endif
@@ -0,0 +1,268 @@
+#include "ShmRing.h"
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <new>
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+namespace {
+    const uint32_t MAGIC = 0x474e5253; // "SRNG"
+    const size_t CONTROL_SIZE = 4096;
+
+    // precedes every record, records are 8-byte aligned in the ring
+    struct RecordHead {
+        uint64_t tag; // claimed position + 1 once committed
+        uint32_t size;
+        uint32_t origin;
+    };
+    const size_t RECORD_HEAD = sizeof(RecordHead);
+
+    inline size_t span(size_t size)
+    {
+        return (RECORD_HEAD + size + 7) & ~static_cast<size_t>(7);
+    }
+}
+
+struct ShmRing::Control {
+    uint32_t magic;
+    uint32_t pageSize;
+    uint64_t capacity;
+    alignas(64) std::atomic<uint64_t> head; // bytes claimed
+    alignas(64) std::atomic<uint32_t> signal; // futex word
+    std::atomic<uint32_t> sleepers;
+};
+
+ShmRing::~ShmRing()
+{
+    close();
+}
+
+#ifndef __linux__
+
+int ShmRing::create(const std::string&, size_t) { return -1; }
+int ShmRing::open(const std::string&) { return -1; }
+int ShmRing::map(int, size_t) { return -1; }
+void ShmRing::close() { }
+bool ShmRing::write(const Part*, int, Origin) { return false; }
+long ShmRing::read(uint64_t&, char*, size_t, unsigned int) { return 0; }
+bool ShmRing::wait(uint64_t, unsigned int) { return false; }
+void ShmRing::wake() { }
+uint64_t ShmRing::position() const { return 0; }
+size_t ShmRing::limit() const { return 0; }
+
+#else
+
+namespace {
+    inline std::atomic<uint64_t>* tagAt(char* record)
+    {
+        return reinterpret_cast<std::atomic<uint64_t>*>(record);
+    }
+
+    long futex(std::atomic<uint32_t>* word, int op, uint32_t value, const timespec* timeout)
+    {
+        return syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), op, value, timeout, nullptr, 0);
+    }
+}
+
+int ShmRing::create(const std::string& name, size_t bytes)
+{
+    close();
+    size_t capacity = CONTROL_SIZE;
+    while (capacity < bytes) {
+        capacity <<= 1;
+    }
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return -1;
+    // reserved up front: a full /dev/shm fails here instead of SIGBUS on a write
+    int err = posix_fallocate(fd, 0, static_cast<off_t>(CONTROL_SIZE + capacity));
+    if (err == 0 && map(fd, capacity) != 0)
+        err = errno;
+    if (err != 0) {
+        ::close(fd);
+        shm_unlink(name.c_str());
+        errno = err;
+        return -1;
+    }
+    ::close(fd);
+    new(m_control) Control();
+    m_control->pageSize = static_cast<uint32_t>(CONTROL_SIZE);
+    m_control->capacity = capacity;
+    m_control->head.store(0, std::memory_order_relaxed);
+    m_control->signal.store(0, std::memory_order_relaxed);
+    m_control->sleepers.store(0, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    m_control->magic = MAGIC;
+    m_name = name;
+    m_owner = true;
+    return 0;
+}
+
+int ShmRing::open(const std::string& name)
+{
+    close();
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd < 0)
+        return -1;
+    struct stat st { };
+    if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) <= CONTROL_SIZE) {
+        ::close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    int ret = map(fd, static_cast<size_t>(st.st_size) - CONTROL_SIZE);
+    ::close(fd);
+    if (ret != 0)
+        return -1;
+    if (m_control->magic != MAGIC || m_control->capacity != m_capacity) {
+        close();
+        errno = EINVAL;
+        return -1;
+    }
+    std::atomic_thread_fence(std::memory_order_acquire);
+    m_name = name;
+    return 0;
+}
+
+// control page, the data, then the data again right behind it
+int ShmRing::map(int fd, size_t capacity)
+{
+    void* base = mmap(nullptr, CONTROL_SIZE + 2 * capacity, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED)
+        return -1;
+    char* mem = static_cast<char*>(base);
+    if (mmap(mem, CONTROL_SIZE + capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED
+        || mmap(mem + CONTROL_SIZE + capacity, capacity, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+            fd, CONTROL_SIZE) == MAP_FAILED) {
+        int err = errno;
+        munmap(base, CONTROL_SIZE + 2 * capacity);
+        errno = err;
+        return -1;
+    }
+    m_control = reinterpret_cast<Control*>(mem);
+    m_data = mem + CONTROL_SIZE;
+    m_capacity = capacity;
+    return 0;
+}
+
+void ShmRing::close()
+{
+    if (m_control != nullptr)
+        munmap(m_control, CONTROL_SIZE + 2 * m_capacity);
+    if (m_owner)
+        shm_unlink(m_name.c_str());
+    m_control = nullptr;
+    m_data = nullptr;
+    m_capacity = 0;
+    m_owner = false;
+    m_name.clear();
+}
+
+bool ShmRing::write(const Part* parts, int count, Origin origin)
+{
+    if (m_control == nullptr)
+        return false;
+    size_t size = 0;
+    for (int i = 0; i < count; ++i) {
+        size += parts[i].size;
+    }
+    if (size > limit())
+        return false;
+    uint64_t pos = m_control->head.fetch_add(span(size), std::memory_order_acq_rel);
+    char* record = m_data + (pos & (m_capacity - 1));
+    auto* head = reinterpret_cast<RecordHead*>(record);
+    head->size = static_cast<uint32_t>(size);
+    head->origin = origin;
+    char* dst = record + RECORD_HEAD;
+    for (int i = 0; i < count; ++i) {
+        memcpy(dst, parts[i].data, parts[i].size);
+        dst += parts[i].size;
+    }
+    tagAt(record)->store(pos + 1, std::memory_order_release);
+    // pairs with the fence in wait(): either the reader sees the tag or we see it asleep
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_control->sleepers.load(std::memory_order_relaxed) > 0)
+        wake();
+    return true;
+}
+
+long ShmRing::read(uint64_t& pos, char* buffer, size_t room, unsigned int origins)
+{
+    if (m_control == nullptr)
+        return 0;
+    const uint64_t start = pos;
+    uint64_t at = pos;
+    size_t used = 0;
+    for (;;) {
+        char* record = m_data + (at & (m_capacity - 1));
+        uint64_t tag = tagAt(record)->load(std::memory_order_acquire);
+        if (tag != at + 1)
+            break; // not committed yet, or overwritten by a later lap (caught below)
+        auto* head = reinterpret_cast<RecordHead*>(record);
+        uint32_t size = head->size;
+        if (size > limit())
+            break; // torn, caught below
+        if ((head->origin & origins) != 0) {
+            if (used + size > room)
+                break;
+            memcpy(buffer + used, record + RECORD_HEAD, size);
+            used += size;
+        }
+        at += span(size);
+    }
+    // nothing copied may have been claimed by a writer of the next lap meanwhile
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint64_t head = m_control->head.load(std::memory_order_acquire);
+    if (head - start > m_capacity) {
+        pos = head;
+        return -1;
+    }
+    pos = at;
+    return static_cast<long>(used);
+}
+
+bool ShmRing::wait(uint64_t pos, unsigned int ms)
+{
+    if (m_control == nullptr)
+        return false;
+    uint32_t signal = m_control->signal.load(std::memory_order_acquire);
+    m_control->sleepers.fetch_add(1, std::memory_order_seq_cst);
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    char* record = m_data + (pos & (m_capacity - 1));
+    bool ready = tagAt(record)->load(std::memory_order_acquire) >= pos + 1;
+    if (!ready) {
+        timespec timeout{ static_cast<time_t>(ms / 1000), static_cast<long>(ms % 1000) * 1000000 };
+        futex(&m_control->signal, FUTEX_WAIT, signal, &timeout);
+    }
+    m_control->sleepers.fetch_sub(1, std::memory_order_relaxed);
+    return ready || m_control->signal.load(std::memory_order_acquire) != signal;
+}
+
+void ShmRing::wake()
+{
+    if (m_control == nullptr)
+        return;
+    m_control->signal.fetch_add(1, std::memory_order_release);
+    futex(&m_control->signal, FUTEX_WAKE, INT_MAX, nullptr);
+}
+
+uint64_t ShmRing::position() const
+{
+    return (m_control != nullptr) ? m_control->head.load(std::memory_order_acquire) : 0;
+}
+
+size_t ShmRing::limit() const
+{
+    return m_capacity / 4 - RECORD_HEAD;
+}
+
+#endif
@@ -0,0 +1,63 @@
+#ifndef SHM_RING_H
+#define SHM_RING_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+/*
+ * Broadcast ring of variable sized records in a POSIX shared memory object,
+ * written by any number of processes and read by any number, each reader
+ * with its own position. Writers claim space with one atomic add and commit
+ * by stamping the record, the data area is mapped twice back to back so a
+ * record never wraps. There is no back pressure: a reader that falls a lap
+ * behind is told so and skips ahead. Sleeping readers are woken with a futex,
+ * writers only make that syscall while somebody sleeps. A writer dying
+ * between claim and commit stalls the readers at its record.
+ */
+class ShmRing {
+public:
+    struct Part {
+        const void* data;
+        size_t size;
+    };
+    enum Origin {
+        BROKER = 1,
+        CLIENT = 2
+    };
+
+    ShmRing() = default;
+    ~ShmRing();
+    ShmRing(const ShmRing&) = delete;
+    ShmRing& operator=(const ShmRing&) = delete;
+
+    int create(const std::string&, size_t); // name, data bytes rounded up to a power of two
+    int open(const std::string&);
+    void close(); // unmaps, the creator also unlinks the name
+    bool write(const Part*, int, Origin); // false if larger than limit()
+    // copies records committed from pos on, back to back into the buffer
+    // (at least limit() bytes) and only those of the origins masked; -1 when
+    // the reader was lapped, pos then skips to the newest record
+    long read(uint64_t&, char*, size_t, unsigned int = BROKER | CLIENT);
+    bool wait(uint64_t, unsigned int); // until pos may be readable or ms passed
+    void wake(); // every sleeping reader
+    uint64_t position() const; // where a new reader starts
+    size_t limit() const; // largest record
+    const std::string& name() const
+    {
+        return m_name;
+    }
+
+private:
+    struct Control;
+
+    int map(int, size_t);
+
+    std::string m_name{};
+    Control* m_control = nullptr;
+    char* m_data = nullptr;
+    size_t m_capacity = 0;
+    bool m_owner = false;
+};
+
+#endif
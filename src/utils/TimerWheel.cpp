@@ -0,0 +1,175 @@
+#include "TimerWheel.h"
+#include <algorithm>
+#include <chrono>
+
+namespace {
+    const size_t ROOT_SIZE = 1u << 8;
+    const size_t LEVEL_SIZE = 1u << 6;
+
+    void unlink(TimerWheel::Timer* timer)
+    {
+        timer->prev->next = timer->next;
+        timer->next->prev = timer->prev;
+        timer->prev = timer->next = nullptr;
+    }
+
+    void append(TimerWheel::Timer* head, TimerWheel::Timer* timer)
+    {
+        timer->prev = head->prev;
+        timer->next = head;
+        head->prev->next = timer;
+        head->prev = timer;
+    }
+}
+
+TimerWheel::TimerWheel(unsigned int tick) : m_ms(tick > 0 ? tick : 1)
+{
+    m_slots.resize(ROOT_SIZE + (LEVELS - 1) * LEVEL_SIZE);
+    for (auto& head : m_slots) {
+        head.prev = head.next = &head;
+    }
+    m_base = now();
+}
+
+TimerWheel::~TimerWheel()
+{
+    for (auto& head : m_slots) {
+        while (head.next != &head) {
+            unlink(head.next);
+        }
+    }
+}
+
+uint64_t TimerWheel::now()
+{
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+TimerWheel::Timer* TimerWheel::slot(unsigned int level, size_t index) const
+{
+    size_t offset = (level == 0) ? index : ROOT_SIZE + (level - 1) * LEVEL_SIZE + index;
+    return const_cast<Timer*>(&m_slots[offset]);
+}
+
+void TimerWheel::insert(Timer* timer)
+{
+    uint64_t expire = timer->expire;
+    uint64_t delta = expire - m_tick;
+    Timer* head = nullptr;
+    if (delta < ROOT_SIZE) {
+        head = slot(0, expire & (ROOT_SIZE - 1));
+    } else {
+        unsigned int level = 1;
+        for (; level < LEVELS; ++level) {
+            if (delta < (uint64_t(1) << (ROOT_BITS + level * LEVEL_BITS)))
+                break;
+        }
+        if (level == LEVELS) {
+            // beyond the horizon (~7.7 days of 10 ms ticks) it fires at the horizon
+            level = LEVELS - 1;
+            expire = m_tick + (uint64_t(1) << (ROOT_BITS + level * LEVEL_BITS)) - 1;
+        }
+        head = slot(level, (expire >> (ROOT_BITS + (level - 1) * LEVEL_BITS)) & (LEVEL_SIZE - 1));
+    }
+    append(head, timer);
+}
+
+void TimerWheel::schedule(Timer* timer, uint64_t ms)
+{
+    if (timer->pending())
+        unlink(timer);
+    else
+        m_count++;
+    uint64_t ticks = (ms + m_ms - 1) / m_ms;
+    timer->expire = m_tick + (ticks > 0 ? ticks : 1);
+    insert(timer);
+}
+
+void TimerWheel::cancel(Timer* timer)
+{
+    if (!timer->pending())
+        return;
+    unlink(timer);
+    m_count--;
+}
+
+void TimerWheel::cascade(unsigned int level, uint64_t tick)
+{
+    size_t index = (tick >> (ROOT_BITS + (level - 1) * LEVEL_BITS)) & (LEVEL_SIZE - 1);
+    if (index == 0 && level + 1 < LEVELS)
+        cascade(level + 1, tick);
+    Timer* head = slot(level, index);
+    Timer list;
+    list.prev = list.next = &list;
+    if (head->next != head) {
+        // move the whole slot out, then spread it over the lower levels
+        list.next = head->next;
+        list.prev = head->prev;
+        list.next->prev = &list;
+        list.prev->next = &list;
+        head->prev = head->next = head;
+    }
+    while (list.next != &list) {
+        Timer* timer = list.next;
+        unlink(timer);
+        insert(timer);
+    }
+}
+
+size_t TimerWheel::advance(uint64_t ms, std::vector<Timer*>& due)
+{
+    uint64_t target = (ms > m_base) ? (ms - m_base) / m_ms : 0;
+    size_t fired = 0;
+    if (m_count == 0) {
+        m_tick = std::max(m_tick, target);
+        return 0;
+    }
+    while (m_tick < target) {
+        m_tick++;
+        size_t index = m_tick & (ROOT_SIZE - 1);
+        if (index == 0)
+            cascade(1, m_tick);
+        Timer* head = slot(0, index);
+        while (head->next != head) {
+            Timer* timer = head->next;
+            unlink(timer);
+            m_count--;
+            due.emplace_back(timer);
+            fired++;
+        }
+        if (m_count == 0) {
+            m_tick = target;
+            break;
+        }
+    }
+    return fired;
+}
+
+int TimerWheel::timeout(uint64_t ms) const
+{
+    if (m_count == 0)
+        return -1;
+    uint64_t current = (ms > m_base) ? (ms - m_base) / m_ms : 0;
+    if (current > m_tick)
+        return 0;
+    // first non-empty root slot, or the next cascade when the root is empty
+    size_t ticks = ROOT_SIZE - (m_tick & (ROOT_SIZE - 1));
+    for (size_t i = 1; i < ROOT_SIZE; ++i) {
+        size_t index = (m_tick + i) & (ROOT_SIZE - 1);
+        Timer* head = slot(0, index);
+        if (head->next != head) {
+            ticks = i;
+            break;
+        }
+        if (index == 0)
+            break;
+    }
+    uint64_t wake = m_base + (m_tick + ticks) * m_ms;
+    return (wake > ms) ? static_cast<int>(wake - ms) : 0;
+}
+
+size_t TimerWheel::size() const
+{
+    return m_count;
+}
@@ -0,0 +1,58 @@
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/*
+ * Hierarchical timing wheel (256 + 3 x 64 slots, 10 ms ticks by default).
+ * Timers are intrusive and doubly linked, so schedule() and cancel() are O(1);
+ * owned by one thread, like the Reactor it is driven from: advance() hands
+ * back the timers that are due instead of calling out. Owners re-check their
+ * deadline when a timer fires, the wheel only guarantees it is not early
+ * (except beyond its horizon).
+ */
+class TimerWheel {
+public:
+    struct Timer {
+        Timer* prev = nullptr;
+        Timer* next = nullptr;
+        uint64_t expire = 0; // tick
+        void* data = nullptr;
+        bool pending() const
+        {
+            return prev != nullptr;
+        }
+    };
+
+    explicit TimerWheel(unsigned int tick = 10); // milliseconds
+    ~TimerWheel();
+    TimerWheel(const TimerWheel&) = delete;
+    TimerWheel& operator=(const TimerWheel&) = delete;
+
+    void schedule(Timer*, uint64_t); // (re)arm to fire in given milliseconds
+    void cancel(Timer*);
+    size_t advance(uint64_t, std::vector<Timer*>&); // now in ms, appends due timers
+    int timeout(uint64_t) const; // ms until the next due slot, -1 when idle
+    size_t size() const;
+
+    static uint64_t now(); // steady clock milliseconds
+
+private:
+    static const unsigned int LEVELS = 4;
+    static const unsigned int ROOT_BITS = 8;
+    static const unsigned int LEVEL_BITS = 6;
+
+    void insert(Timer*);
+    void cascade(unsigned int, uint64_t);
+    Timer* slot(unsigned int, size_t) const;
+
+    std::vector<Timer> m_slots{}; // sentinels, root level first
+    uint64_t m_tick = 0;
+    uint64_t m_base = 0; // ms of tick 0
+    unsigned int m_ms = 10;
+    size_t m_count = 0;
+};
+
+#endif
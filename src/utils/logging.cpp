@@ -0,0 +1,570 @@
+#include "logging.h"
+#ifndef __ANDROID__
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+std::atomic<int> Logging::g_level{ LOGGING_MIN };
+
+namespace {
+    using namespace Logging;
+
+    const size_t CAPACITY = 256 * 1024; // staged bytes per thread, a power of two
+    const size_t RECORD_MAX = CAPACITY / 4;
+    const uint32_t WRAP = 0xffffffff; // size of a record: the rest up to the end is skipped
+    const unsigned int IDLE_WAIT = 10; // ms the writer sleeps when nothing is staged
+
+    // precedes the arguments of every record, records are 8-byte aligned
+    struct RecordHead {
+        uint32_t size; // with this head and the padding
+        uint32_t args; // bytes of the arguments
+        const Site* site;
+        int64_t stamp; // steady clock ns
+    };
+    const size_t RECORD_HEAD = sizeof(RecordHead);
+
+    inline size_t align8(size_t size)
+    {
+        return (size + 7) & ~static_cast<size_t>(7);
+    }
+
+    inline int64_t steadyNanos()
+    {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    // single producer (its thread), single consumer (the writer)
+    struct Buffer {
+        std::unique_ptr<char[]> data{ new char[CAPACITY] };
+        std::atomic<size_t> head{ 0 }; // bytes taken by the writer
+        std::atomic<size_t> tail{ 0 }; // bytes staged
+        std::atomic<size_t> dropped{ 0 };
+        std::atomic<bool> closed{ false }; // its thread has ended
+    };
+
+    std::atomic<bool> g_closed{ false }; // the writer is gone, log synchronously
+    std::mutex g_syncLock;
+
+    // arguments as staged: a kind byte, then 8 bytes, or a length and the NUL terminated string
+    size_t argsSize(const Arg* args, size_t count, size_t* lengths)
+    {
+        size_t size = 0;
+        for (size_t i = 0; i < count; ++i) {
+            if (args[i].kind == Arg::STRING && args[i].s != nullptr) {
+                lengths[i] = strnlen(args[i].s, STRING_MAX);
+                size += 1 + sizeof(uint32_t) + lengths[i] + 1;
+            } else {
+                size += 1 + sizeof(uint64_t);
+            }
+        }
+        return size;
+    }
+
+    void putArgs(char* dst, const Arg* args, size_t count, const size_t* lengths)
+    {
+        for (size_t i = 0; i < count; ++i) {
+            const Arg& arg = args[i];
+            if (arg.kind == Arg::STRING && arg.s != nullptr) {
+                *dst++ = static_cast<char>(Arg::STRING);
+                auto length = static_cast<uint32_t>(lengths[i]);
+                memcpy(dst, &length, sizeof(length));
+                dst += sizeof(length);
+                memcpy(dst, arg.s, length);
+                dst[length] = '\0';
+                dst += length + 1;
+            } else {
+                // a null string is staged as a null pointer
+                *dst++ = static_cast<char>(arg.kind == Arg::STRING ? Arg::POINTER : arg.kind);
+                memcpy(dst, &arg.u, sizeof(uint64_t));
+                dst += sizeof(uint64_t);
+            }
+        }
+    }
+
+    // staged arguments read back, in order
+    class Reader {
+    public:
+        Reader(const char* data, const char* end) : m_data(data), m_end(end) { }
+        bool next(Arg& arg)
+        {
+            if (m_data >= m_end)
+                return false;
+            arg.kind = static_cast<Arg::Kind>(*m_data++);
+            if (arg.kind == Arg::STRING) {
+                uint32_t length;
+                memcpy(&length, m_data, sizeof(length));
+                arg.s = m_data + sizeof(length);
+                m_data += sizeof(length) + length + 1;
+            } else {
+                memcpy(&arg.u, m_data, sizeof(uint64_t));
+                m_data += sizeof(uint64_t);
+            }
+            return true;
+        }
+    private:
+        const char* m_data;
+        const char* m_end;
+    };
+
+    long long asSigned(const Arg& arg)
+    {
+        switch (arg.kind) {
+        case Arg::SIGNED: return arg.i;
+        case Arg::UNSIGNED: return static_cast<long long>(arg.u);
+        case Arg::REAL: return static_cast<long long>(arg.d);
+        case Arg::POINTER: return static_cast<long long>(reinterpret_cast<intptr_t>(arg.p));
+        default: return 0;
+        }
+    }
+
+    double asReal(const Arg& arg)
+    {
+        switch (arg.kind) {
+        case Arg::SIGNED: return static_cast<double>(arg.i);
+        case Arg::UNSIGNED: return static_cast<double>(arg.u);
+        case Arg::REAL: return arg.d;
+        default: return 0;
+        }
+    }
+
+    template<typename T>
+    void append(std::string& out, const std::string& spec, T value)
+    {
+        char text[256];
+        int n = snprintf(text, sizeof(text), spec.c_str(), value);
+        if (n < 0)
+            return;
+        if (static_cast<size_t>(n) < sizeof(text)) {
+            out.append(text, static_cast<size_t>(n));
+            return;
+        }
+        size_t at = out.size();
+        out.resize(at + static_cast<size_t>(n) + 1);
+        snprintf(&out[at], static_cast<size_t>(n) + 1, spec.c_str(), value);
+        out.resize(at + static_cast<size_t>(n));
+    }
+
+    // what printf would make of format and the staged arguments; every
+    // integer is cast to what its conversion and length modifier read
+    void render(std::string& out, const char* format, Reader& args)
+    {
+        const char* p = format;
+        Arg arg;
+        while (*p != '\0') {
+            if (*p != '%') {
+                const char* next = strchr(p, '%');
+                size_t run = (next != nullptr) ? static_cast<size_t>(next - p) : strlen(p);
+                out.append(p, run);
+                p += run;
+                continue;
+            }
+            const char* start = p++;
+            if (*p == '%') {
+                out.push_back('%');
+                ++p;
+                continue;
+            }
+            std::string spec = "%";
+            bool missing = false;
+            while (*p != '\0' && strchr("-+ #0'", *p) != nullptr) {
+                spec.push_back(*p++);
+            }
+            if (*p == '*') {
+                ++p;
+                missing |= !args.next(arg);
+                spec += std::to_string(static_cast<int>(asSigned(arg)));
+            }
+            while (isdigit(static_cast<unsigned char>(*p))) {
+                spec.push_back(*p++);
+            }
+            if (*p == '.') {
+                ++p;
+                if (*p == '*') {
+                    ++p;
+                    missing |= !args.next(arg);
+                    int precision = static_cast<int>(asSigned(arg));
+                    if (precision >= 0)
+                        spec += "." + std::to_string(precision);
+                } else {
+                    spec.push_back('.');
+                    while (isdigit(static_cast<unsigned char>(*p))) {
+                        spec.push_back(*p++);
+                    }
+                }
+            }
+            char length[3] = {};
+            for (int i = 0; i < 2 && *p != '\0' && strchr("hlLqjzt", *p) != nullptr; ++i) {
+                length[i] = *p++;
+            }
+            char conv = *p;
+            if (conv == '\0') {
+                out.append(start);
+                break;
+            }
+            ++p;
+            // %n writes nothing here, a conversion without its argument is kept as is
+            if (missing || !args.next(arg) || conv == 'n') {
+                if (conv != 'n')
+                    out.append(start, static_cast<size_t>(p - start));
+                continue;
+            }
+            bool wide = spec.size() > 1;
+            switch (conv) {
+            case 'd':
+            case 'i': {
+                long long v = asSigned(arg);
+                if (strcmp(length, "hh") == 0) v = static_cast<signed char>(v);
+                else if (strcmp(length, "h") == 0) v = static_cast<short>(v);
+                else if (strcmp(length, "l") == 0) v = static_cast<long>(v);
+                else if (strcmp(length, "z") == 0 || strcmp(length, "t") == 0) v = static_cast<ptrdiff_t>(v);
+                else if (length[0] == '\0') v = static_cast<int>(v);
+                append(out, spec + "lld", v);
+                break;
+            }
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X': {
+                auto v = static_cast<unsigned long long>(asSigned(arg));
+                if (strcmp(length, "hh") == 0) v = static_cast<unsigned char>(v);
+                else if (strcmp(length, "h") == 0) v = static_cast<unsigned short>(v);
+                else if (strcmp(length, "l") == 0) v = static_cast<unsigned long>(v);
+                else if (strcmp(length, "z") == 0 || strcmp(length, "t") == 0) v = static_cast<size_t>(v);
+                else if (length[0] == '\0') v = static_cast<unsigned int>(v);
+                append(out, spec + "ll" + conv, v);
+                break;
+            }
+            case 'c':
+                append(out, spec + "c", static_cast<int>(asSigned(arg)));
+                break;
+            case 's': {
+                const char* s = (arg.kind == Arg::STRING) ? arg.s : "(null)";
+                if (wide)
+                    append(out, spec + "s", s);
+                else
+                    out.append(s);
+                break;
+            }
+            case 'p':
+                append(out, spec + "p", arg.kind == Arg::POINTER ? arg.p : nullptr);
+                break;
+            case 'f':
+            case 'F':
+            case 'e':
+            case 'E':
+            case 'g':
+            case 'G':
+            case 'a':
+            case 'A':
+                append(out, spec + conv, asReal(arg));
+                break;
+            default:
+                out.append(start, static_cast<size_t>(p - start));
+                break;
+            }
+        }
+    }
+
+    // "[2026-1-2/03:04:05]" of the wall clock second, redone when it changes
+    class Clock {
+    public:
+        const std::string& stamp(time_t second)
+        {
+            if (second != m_second || m_text.empty()) {
+                struct tm local {};
+#ifdef _WIN32
+                localtime_s(&local, &second);
+#else
+                localtime_r(&second, &local);
+#endif
+                char text[64];
+                snprintf(text, sizeof(text), "[%d-%d-%d/%02d:%02d:%02d]", local.tm_year + 1900, local.tm_mon + 1,
+                    local.tm_mday, local.tm_hour, local.tm_min, local.tm_sec);
+                m_text = text;
+                m_second = second;
+            }
+            return m_text;
+        }
+    private:
+        time_t m_second = 0;
+        std::string m_text{};
+    };
+
+    // one line as the former printf macros wrote it
+    void format(std::string& out, Clock& clock, time_t second, const RecordHead& head, Reader& args)
+    {
+        const Site& site = *head.site;
+        if (site.time)
+            out += clock.stamp(second);
+        out.push_back('[');
+        out += site.level;
+        out.push_back(']');
+        if (site.module != nullptr) {
+            const char* file = site.file;
+            for (const char* ptr = site.file; *ptr != '\0'; ++ptr) {
+                if (*ptr == '/' || *ptr == '\\')
+                    file = ptr + 1;
+            }
+            out.push_back('[');
+            out += site.module;
+            out += "](";
+            out += file;
+            out.push_back(':');
+            out += std::to_string(site.line);
+            out += ")[";
+            out += site.function;
+            out += "]: ";
+        }
+        render(out, site.format, args);
+        out.push_back('\n');
+    }
+
+    void output(const std::string& text)
+    {
+        if (text.empty())
+            return;
+        static_cast<void>(fwrite(text.data(), 1, text.size(), stdout));
+        static_cast<void>(fflush(stdout));
+    }
+
+    class Writer {
+    public:
+        static Writer& instance()
+        {
+            static Writer writer;
+            return writer;
+        }
+        ~Writer()
+        {
+            {
+                std::lock_guard<std::mutex> guard(m_wait);
+                m_running = false;
+            }
+            m_cond.notify_one();
+            if (m_thread.joinable())
+                m_thread.join();
+            g_closed = true;
+        }
+        std::shared_ptr<Buffer> add()
+        {
+            auto buffer = std::make_shared<Buffer>();
+            std::lock_guard<std::mutex> guard(m_lock);
+            m_buffers.emplace_back(buffer);
+            return buffer;
+        }
+        void wake()
+        {
+            if (!m_sleeping.load(std::memory_order_acquire))
+                return;
+            {
+                std::lock_guard<std::mutex> guard(m_wait);
+                m_woken = true;
+            }
+            m_cond.notify_one();
+        }
+        void flush()
+        {
+            std::vector<std::pair<std::shared_ptr<Buffer>, size_t>> marks;
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                for (auto& buffer : m_buffers) {
+                    marks.emplace_back(buffer, buffer->tail.load(std::memory_order_acquire));
+                }
+            }
+            for (auto& mark : marks) {
+                while (mark.first->head.load(std::memory_order_acquire) < mark.second && !g_closed) {
+                    wake();
+                    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+                }
+            }
+        }
+    private:
+        struct Entry {
+            int64_t stamp;
+            const RecordHead* head;
+        };
+
+        Writer() : m_thread(&Writer::run, this) { }
+
+        void run()
+        {
+            for (;;) {
+                bool running;
+                {
+                    std::lock_guard<std::mutex> guard(m_wait);
+                    running = m_running;
+                }
+                if (drain() > 0)
+                    continue;
+                if (!running)
+                    break;
+                std::unique_lock<std::mutex> lock(m_wait);
+                m_sleeping.store(true, std::memory_order_release);
+                m_cond.wait_for(lock, std::chrono::milliseconds(IDLE_WAIT), [this] { return m_woken || !m_running; });
+                m_sleeping.store(false, std::memory_order_relaxed);
+                m_woken = false;
+            }
+        }
+
+        // writes what every buffer holds, in stamp order; records written
+        size_t drain()
+        {
+            std::vector<std::shared_ptr<Buffer>> buffers;
+            {
+                std::lock_guard<std::mutex> guard(m_lock);
+                // a buffer of an ended thread goes once it is empty
+                m_buffers.erase(std::remove_if(m_buffers.begin(), m_buffers.end(), [](const std::shared_ptr<Buffer>& b) {
+                    return b->closed.load(std::memory_order_acquire) &&
+                        b->head.load(std::memory_order_relaxed) == b->tail.load(std::memory_order_acquire);
+                    }), m_buffers.end());
+                buffers = m_buffers;
+            }
+            std::vector<size_t> ends(buffers.size());
+            m_entries.clear();
+            for (size_t i = 0; i < buffers.size(); ++i) {
+                Buffer& buffer = *buffers[i];
+                size_t at = buffer.head.load(std::memory_order_relaxed);
+                size_t tail = buffer.tail.load(std::memory_order_acquire);
+                while (at < tail) {
+                    size_t offset = at & (CAPACITY - 1);
+                    const auto* head = reinterpret_cast<const RecordHead*>(buffer.data.get() + offset);
+                    if (head->size == WRAP) {
+                        at += CAPACITY - offset;
+                        continue;
+                    }
+                    m_entries.push_back(Entry{ head->stamp, head });
+                    at += head->size;
+                }
+                ends[i] = at;
+            }
+            // each thread's records are in stamp order already, the sort keeps it
+            std::stable_sort(m_entries.begin(), m_entries.end(), [](const Entry& a, const Entry& b) {
+                return a.stamp < b.stamp;
+                });
+            auto wall = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::system_clock::now().time_since_epoch()).count() - steadyNanos();
+            m_text.clear();
+            for (const Entry& entry : m_entries) {
+                const char* args = reinterpret_cast<const char*>(entry.head) + RECORD_HEAD;
+                Reader reader(args, args + entry.head->args);
+                format(m_text, m_clock, static_cast<time_t>((entry.stamp + wall) / 1000000000), *entry.head, reader);
+            }
+            for (size_t i = 0; i < buffers.size(); ++i) {
+                size_t dropped = buffers[i]->dropped.exchange(0, std::memory_order_relaxed);
+                if (dropped > 0) {
+                    m_text += m_clock.stamp(static_cast<time_t>((steadyNanos() + wall) / 1000000000));
+                    m_text += "[WARN] " + std::to_string(dropped) + " log records dropped, staged faster than written\n";
+                }
+            }
+            output(m_text);
+            for (size_t i = 0; i < buffers.size(); ++i) {
+                buffers[i]->head.store(ends[i], std::memory_order_release);
+            }
+            return m_entries.size();
+        }
+
+        std::mutex m_lock{}; // the buffers
+        std::vector<std::shared_ptr<Buffer>> m_buffers{};
+        std::mutex m_wait{};
+        std::condition_variable m_cond{};
+        bool m_running = true;
+        bool m_woken = false;
+        std::atomic<bool> m_sleeping{ false };
+        std::vector<Entry> m_entries{};
+        std::string m_text{};
+        Clock m_clock{};
+        std::thread m_thread;
+    };
+
+    // the calling thread's buffer, registered at its first record
+    struct Local {
+        std::shared_ptr<Buffer> buffer{};
+        ~Local()
+        {
+            if (buffer)
+                buffer->closed.store(true, std::memory_order_release);
+        }
+    };
+    thread_local Local t_local;
+
+    // formats and writes on the calling thread, once the writer is gone
+    void direct(const Site& site, const char* args, size_t size)
+    {
+        std::vector<char> record(RECORD_HEAD + size);
+        RecordHead head{ static_cast<uint32_t>(record.size()), static_cast<uint32_t>(size), &site, steadyNanos() };
+        memcpy(record.data() + RECORD_HEAD, args, size);
+        Reader reader(record.data() + RECORD_HEAD, record.data() + record.size());
+        std::lock_guard<std::mutex> guard(g_syncLock);
+        static Clock clock;
+        std::string text;
+        format(text, clock, time(nullptr), head, reader);
+        output(text);
+    }
+}
+
+void Logging::setLevel(Level level)
+{
+    g_level.store(level, std::memory_order_relaxed);
+}
+
+Logging::Level Logging::level()
+{
+    return static_cast<Level>(g_level.load(std::memory_order_relaxed));
+}
+
+void Logging::flush()
+{
+    if (!g_closed)
+        Writer::instance().flush();
+}
+
+void Logging::stage(Level level, const Site& site, const Arg* args, size_t count)
+{
+    size_t lengths[64];
+    count = std::min<size_t>(count, 64);
+    size_t size = argsSize(args, count, lengths);
+    size_t need = align8(RECORD_HEAD + size);
+    if (g_closed || need > RECORD_MAX) {
+        if (g_closed) {
+            std::vector<char> staged(size);
+            putArgs(staged.data(), args, count, lengths);
+            direct(site, staged.data(), size);
+        }
+        return;
+    }
+    Writer& writer = Writer::instance();
+    if (!t_local.buffer)
+        t_local.buffer = writer.add();
+    Buffer& buffer = *t_local.buffer;
+    size_t tail = buffer.tail.load(std::memory_order_relaxed);
+    size_t offset = tail & (CAPACITY - 1);
+    size_t pad = (CAPACITY - offset < need) ? CAPACITY - offset : 0;
+    if (tail + pad + need - buffer.head.load(std::memory_order_acquire) > CAPACITY) {
+        // never waits for room, at any level: counted, reported by the writer
+        buffer.dropped.fetch_add(1, std::memory_order_relaxed);
+        writer.wake();
+        return;
+    }
+    char* data = buffer.data.get();
+    if (pad > 0) {
+        reinterpret_cast<RecordHead*>(data + offset)->size = WRAP;
+        offset = 0;
+    }
+    auto* head = reinterpret_cast<RecordHead*>(data + offset);
+    head->size = static_cast<uint32_t>(need);
+    head->args = static_cast<uint32_t>(size);
+    head->site = &site;
+    head->stamp = steadyNanos();
+    putArgs(data + offset + RECORD_HEAD, args, count, lengths);
+    buffer.tail.store(tail + pad + need, std::memory_order_release);
+    if (level >= LEVEL_WARN || tail + pad + need - buffer.head.load(std::memory_order_relaxed) > CAPACITY / 2)
+        writer.wake();
+}
+#endif
@@ -19,6 +19,17 @@ inline const char* basename(const char* name)
 //#pragma GCC diagnostic ignored "-Wwritable-strings"
 #pragma GCC diagnostic ignored "-Wformat"
 #endif
+
+// levels, the ones below LOGGING_MIN are compiled out (-DLOGGING_MIN=LOGGING_WARN)
+#define LOGGING_INFO 1
+#define LOGGING_WARN 2
+#define LOGGING_ERROR 3
+#define LOGGING_NONE 4
+#ifndef LOGGING_MIN
+#define LOGGING_MIN LOGGING_INFO
+#endif
+#define _LOG_NONE_(fmt, ...) do { } while (0)
+
 #ifdef __ANDROID__
 #include <android/log.h>
 #ifdef __cplusplus
@@ -27,28 +38,146 @@ inline const char* basename(const char* name)
 #define _LOG_(level, fmt, ...) __android_log_print(level, LOG_TAG,"(%s:%d)[%s]: " fmt, basename(__FILE__), __LINE__, __FUNCTION__, ##__VA_ARGS__)
 #endif
 #define LOGD(fmt, ...) _LOG_(ANDROID_LOG_DEBUG, fmt, ##__VA_ARGS__)
+#if LOGGING_MIN <= LOGGING_INFO
 #define LOGI(fmt, ...) _LOG_(ANDROID_LOG_INFO, fmt, ##__VA_ARGS__)
+#else
+#define LOGI _LOG_NONE_
+#endif
+#if LOGGING_MIN <= LOGGING_WARN
 #define LOGW(fmt, ...) _LOG_(ANDROID_LOG_WARN, fmt, ##__VA_ARGS__)
+#else
+#define LOGW _LOG_NONE_
+#endif
+#if LOGGING_MIN <= LOGGING_ERROR
 #define LOGE(fmt, ...) _LOG_(ANDROID_LOG_ERROR, fmt, ##__VA_ARGS__)
 #else
+#define LOGE _LOG_NONE_
+#endif
+#else
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+
+/*
+ * Asynchronous logging: a LOG* call only copies its arguments (strings
+ * included, at most STRING_MAX bytes each) and a steady clock stamp into a
+ * lock-free buffer of the calling thread. A background thread formats the
+ * records of all threads in stamp order, printf-compatible, with the date
+ * redone once a second, and writes them to stdout in one go. A full buffer
+ * drops the record at any level, never waits: the writer reports the count
+ * with its next batch. WARN and ERROR wake the writer at once. What is
+ * staged is written at exit, or on flush().
+ */
+namespace Logging {
+    enum Level {
+        LEVEL_INFO = LOGGING_INFO,
+        LEVEL_WARN = LOGGING_WARN,
+        LEVEL_ERROR = LOGGING_ERROR,
+        LEVEL_NONE = LOGGING_NONE
+    };
+    const size_t STRING_MAX = 4096;
+    // where a LOG* call is, one per call in static storage
+    struct Site {
+        bool time; // false with NOTIME
+        const char* level;
+        const char* module; // nullptr with NOLOCATE
+        const char* file;
+        int line;
+        const char* function;
+        const char* format;
+    };
+    // one argument as staged, its type widened
+    struct Arg {
+        enum Kind : uint8_t {
+            SIGNED,
+            UNSIGNED,
+            REAL,
+            STRING,
+            POINTER
+        };
+        Kind kind;
+        union {
+            long long i;
+            unsigned long long u;
+            double d;
+            const void* p;
+            const char* s;
+        };
+        Arg() : kind(POINTER), p(nullptr) { }
+        Arg(bool v) : kind(UNSIGNED), u(v) { }
+        Arg(char v) : kind(SIGNED), i(v) { }
+        Arg(signed char v) : kind(SIGNED), i(v) { }
+        Arg(unsigned char v) : kind(UNSIGNED), u(v) { }
+        Arg(short v) : kind(SIGNED), i(v) { }
+        Arg(unsigned short v) : kind(UNSIGNED), u(v) { }
+        Arg(int v) : kind(SIGNED), i(v) { }
+        Arg(unsigned int v) : kind(UNSIGNED), u(v) { }
+        Arg(long v) : kind(SIGNED), i(v) { }
+        Arg(unsigned long v) : kind(UNSIGNED), u(v) { }
+        Arg(long long v) : kind(SIGNED), i(v) { }
+        Arg(unsigned long long v) : kind(UNSIGNED), u(v) { }
+        Arg(float v) : kind(REAL), d(v) { }
+        Arg(double v) : kind(REAL), d(v) { }
+        Arg(long double v) : kind(REAL), d(static_cast<double>(v)) { }
+        Arg(const char* v) : kind(STRING), s(v) { }
+        Arg(char* v) : kind(STRING), s(v) { }
+        Arg(const std::string& v) : kind(STRING), s(v.c_str()) { }
+        Arg(std::nullptr_t) : kind(POINTER), p(nullptr) { }
+        template<typename T>
+        Arg(T* v) : kind(POINTER), p(v) { }
+        template<typename T, typename std::enable_if<std::is_enum<T>::value, int>::type = 0>
+        Arg(T v) : kind(SIGNED), i(static_cast<long long>(v)) { }
+    };
+
+    extern std::atomic<int> g_level;
+    inline bool enabled(Level level)
+    {
+        return level >= g_level.load(std::memory_order_relaxed);
+    }
+    void setLevel(Level); // records below it are skipped at run time
+    Level level();
+    void flush(); // until everything staged so far is written
+    void stage(Level, const Site&, const Arg*, size_t);
+
+    template<typename... Args>
+    inline void log(Level level, const Site& site, Args... args)
+    {
+        const Arg list[sizeof...(Args) + 1] = { Arg(args)... };
+        stage(level, site, list, sizeof...(Args));
+    }
+}
+
 #ifdef NOTIME
-#define TIME_ARGS(_ptm)
-#define TIME_FORMAT
+#define TIME_SITE false
 #else
-#define TIME_ARGS(_ptm) ((_ptm)->tm_year + 1900), ((_ptm)->tm_mon + 1), (_ptm)->tm_mday, (_ptm)->tm_hour, (_ptm)->tm_min, (_ptm)->tm_sec
-#define TIME_FORMAT "[%d-%d-%d/%02d:%02d:%02d]"
+#define TIME_SITE true
 #endif //NOTIME
 #ifdef NOLOCATE
-#define LOCATE_ARGS
-#define LOCATE_FORMAT
+#define LOCATE_SITE(_module) nullptr, nullptr, 0, nullptr
 #else
-#define LOCATE_ARGS(_module) _module,basename(const_cast<char*>(__FILE__)),__LINE__,__FUNCTION__
-#define LOCATE_FORMAT "[%s](%s:%d)[%s]: "
+#define LOCATE_SITE(_module) _module, __FILE__, __LINE__, __FUNCTION__
 #endif //NOLOCATE
-inline struct tm* times() { time_t now = time(NULL); static struct tm* local = NULL; local = localtime(&now); return local; }
-inline void logger(const char* fm, ...) { va_list args; va_start(args, fm); static_cast<void>(vprintf(fm, args)); va_end(args); static_cast<void>(printf("\n")); }
-#define LOGI(fmt, ...) logger(TIME_FORMAT "[INFO]" LOCATE_FORMAT fmt, TIME_ARGS(times()), LOCATE_ARGS(LOG_TAG),##__VA_ARGS__)
-#define LOGW(fmt, ...) logger(TIME_FORMAT "[WARN]" LOCATE_FORMAT fmt, TIME_ARGS(times()), LOCATE_ARGS(LOG_TAG),##__VA_ARGS__)
-#define LOGE(fmt, ...) logger(TIME_FORMAT "[ERROR]" LOCATE_FORMAT fmt, TIME_ARGS(times()), LOCATE_ARGS(LOG_TAG),##__VA_ARGS__)
+#define _LOG_(lvl, name, fmt, ...) do { \
+        if (Logging::enabled(Logging::lvl)) { \
+            static const Logging::Site _site_ = { TIME_SITE, name, LOCATE_SITE(LOG_TAG), fmt }; \
+            Logging::log(Logging::lvl, _site_, ##__VA_ARGS__); \
+        } \
+    } while (0)
+#if LOGGING_MIN <= LOGGING_INFO
+#define LOGI(fmt, ...) _LOG_(LEVEL_INFO, "INFO", fmt, ##__VA_ARGS__)
+#else
+#define LOGI _LOG_NONE_
+#endif
+#if LOGGING_MIN <= LOGGING_WARN
+#define LOGW(fmt, ...) _LOG_(LEVEL_WARN, "WARN", fmt, ##__VA_ARGS__)
+#else
+#define LOGW _LOG_NONE_
+#endif
+#if LOGGING_MIN <= LOGGING_ERROR
+#define LOGE(fmt, ...) _LOG_(LEVEL_ERROR, "ERROR", fmt, ##__VA_ARGS__)
+#else
+#define LOGE _LOG_NONE_
+#endif
 #endif //ANDROID
 #endif //SCADUP_LOGGING_H
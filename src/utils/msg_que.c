@@ -1,104 +1,252 @@
 #include "msg_que.h"
 #include <stdlib.h>
+#include <string.h>
+#ifndef _WIN32
+#include <errno.h>
+#include <time.h>
+#endif
 
 #ifdef _WIN32
 #define MUTEX_INIT(m)    InitializeCriticalSection(m)
 #define MUTEX_LOCK(m)    EnterCriticalSection(m)
 #define MUTEX_UNLOCK(m)  LeaveCriticalSection(m)
 #define MUTEX_DESTROY(m) DeleteCriticalSection(m)
+#define COND_INIT(c)     InitializeConditionVariable(c)
+#define COND_SIGNAL(c)   WakeAllConditionVariable(c)
+#define COND_DESTROY(c)
 #else
 #define MUTEX_INIT(m)    pthread_mutex_init(m, NULL)
 #define MUTEX_LOCK(m)    pthread_mutex_lock(m)
 #define MUTEX_UNLOCK(m)  pthread_mutex_unlock(m)
 #define MUTEX_DESTROY(m) pthread_mutex_destroy(m)
+#define COND_INIT(c)     pthread_cond_init(c, NULL)
+#define COND_SIGNAL(c)   pthread_cond_broadcast(c)
+#define COND_DESTROY(c)  pthread_cond_destroy(c)
+#endif
+
+#ifdef _MSC_VER
+#define LOAD(p)        ((size_t)InterlockedOr64((volatile LONG64*)(p), 0))
+#define STORE(p, v)    InterlockedExchange64((volatile LONG64*)(p), (LONG64)(v))
+#define LOAD_INT(p)    InterlockedOr((volatile LONG*)(p), 0)
+#define ADD_INT(p, v)  InterlockedExchangeAdd((volatile LONG*)(p), (LONG)(v))
+#define FENCE()        MemoryBarrier()
+static int cas(size_t* p, size_t* expect, size_t desired)
+{
+    size_t prev = (size_t)InterlockedCompareExchange64((volatile LONG64*)p, (LONG64)desired, (LONG64)*expect);
+    if (prev == *expect)
+        return 1;
+    *expect = prev;
+    return 0;
+}
+#else
+#define LOAD(p)        __atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define STORE(p, v)    __atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define LOAD_INT(p)    __atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define ADD_INT(p, v)  __atomic_fetch_add(p, v, __ATOMIC_SEQ_CST)
+#define FENCE()        __atomic_thread_fence(__ATOMIC_SEQ_CST)
+static int cas(size_t* p, size_t* expect, size_t desired)
+{
+    return __atomic_compare_exchange_n(p, expect, desired, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
 #endif
 
-void mq_init(struct MsgQue* q)
+int mq_init(struct MsgQue* q)
 {
+    return mq_init_size(q, MQ_DEFAULT_CAPACITY);
+}
+
+int mq_init_size(struct MsgQue* q, size_t capacity)
+{
+    size_t size = 2;
+    size_t i;
+    if (q == NULL)
+        return -1;
+    while (size < capacity)
+        size <<= 1;
+    memset(q, 0, sizeof(*q));
+    q->cells = (MqCell*)malloc(size * sizeof(MqCell));
+    if (q->cells == NULL)
+        return -2;
+    for (i = 0; i < size; ++i) {
+        q->cells[i].seq = i;
+        q->cells[i].data = NULL;
+    }
+    q->mask = size - 1;
     MUTEX_INIT(&q->mutex);
-    q->head = q->tail = NULL;
+    COND_INIT(&q->cond);
+    return 0;
 }
 
 void mq_deinit(struct MsgQue* q)
 {
-    if (q == NULL)
+    if (q == NULL || q->cells == NULL)
         return;
-    INode* n = q->head;
-    while (n) {
-        INode* i = n->next;
-        free(n);
-        n = i;
-    }
-    q->tail = q->head = NULL;
+    free(q->cells);
+    q->cells = NULL;
+    q->enqueue = q->dequeue = 0;
     MUTEX_DESTROY(&q->mutex);
+    COND_DESTROY(&q->cond);
 }
 
-int mq_push(struct MsgQue* q, void* x)
+static void wakeup(struct MsgQue* q)
 {
-    MUTEX_LOCK(&q->mutex);
-    if (q == NULL) {
+    // pairs with the fence in mq_wait(): either we see the sleeper or it sees the data
+    FENCE();
+    if (LOAD_INT(&q->waiters) > 0) {
+        MUTEX_LOCK(&q->mutex);
+        COND_SIGNAL(&q->cond);
         MUTEX_UNLOCK(&q->mutex);
-        return -1;
-    }
-    INode* i = (INode*)malloc(sizeof(INode));
-    if (NULL == i) {
-        MUTEX_UNLOCK(&q->mutex);
-        return -2;
     }
-    i->data = x;
-    i->next = NULL;
+}
 
-    if (q->tail == NULL) {
-        q->head = q->tail = i;
-    } else {
-        q->tail->next = i;
-        q->tail = i;
+int mq_push_batch(struct MsgQue* q, void** x, int n)
+{
+    size_t pos;
+    int count = 0;
+    int i;
+    if (q == NULL || q->cells == NULL || n <= 0)
+        return 0;
+    pos = LOAD(&q->enqueue);
+    for (;;) {
+        size_t seq = pos;
+        count = 0;
+        while (count < n) {
+            seq = LOAD(&q->cells[(pos + count) & q->mask].seq);
+            if (seq != pos + count)
+                break;
+            count++;
+        }
+        if (count == 0) {
+            if ((ptrdiff_t)(seq - pos) < 0)
+                return 0; /* full */
+            pos = LOAD(&q->enqueue);
+            continue;
+        }
+        if (cas(&q->enqueue, &pos, pos + count))
+            break;
     }
-    MUTEX_UNLOCK(&q->mutex);
-    return 0;
+    for (i = 0; i < count; ++i) {
+        MqCell* cell = &q->cells[(pos + i) & q->mask];
+        cell->data = x[i];
+        STORE(&cell->seq, pos + i + 1);
+    }
+    wakeup(q);
+    return count;
 }
 
-void mq_pop(struct MsgQue* q)
+int mq_push(struct MsgQue* q, void* x)
 {
-    MUTEX_LOCK(&q->mutex);
-    if (q != NULL && q->head != NULL) {
-        if (q->head->next == NULL) {
-            free(q->head);
-            q->head = q->tail = NULL;
-        } else {
-            INode* n = q->head->next;
-            free(q->head);
-            q->head = n;
+    if (q == NULL || q->cells == NULL)
+        return -1;
+    return (mq_push_batch(q, &x, 1) == 1) ? 0 : -2;
+}
+
+int mq_pop_batch(struct MsgQue* q, void** x, int n)
+{
+    size_t pos;
+    int count = 0;
+    int i;
+    if (q == NULL || q->cells == NULL || n <= 0)
+        return 0;
+    pos = LOAD(&q->dequeue);
+    for (;;) {
+        size_t seq = pos + 1;
+        count = 0;
+        while (count < n) {
+            seq = LOAD(&q->cells[(pos + count) & q->mask].seq);
+            if (seq != pos + count + 1)
+                break;
+            count++;
+        }
+        if (count == 0) {
+            if ((ptrdiff_t)(seq - (pos + 1)) < 0)
+                return 0; /* empty */
+            pos = LOAD(&q->dequeue);
+            continue;
         }
+        if (cas(&q->dequeue, &pos, pos + count))
+            break;
     }
-    MUTEX_UNLOCK(&q->mutex);
+    for (i = 0; i < count; ++i) {
+        MqCell* cell = &q->cells[(pos + i) & q->mask];
+        if (x != NULL)
+            x[i] = cell->data;
+        STORE(&cell->seq, pos + i + q->mask + 1);
+    }
+    return count;
 }
 
+void* mq_take(struct MsgQue* q)
+{
+    void* x = NULL;
+    mq_pop_batch(q, &x, 1);
+    return x;
+}
+
+/* single consumer only, see msg_que.h */
 void* mq_front(struct MsgQue* q)
 {
-    MUTEX_LOCK(&q->mutex);
-    if (q == NULL || q->head == NULL) {
-        MUTEX_UNLOCK(&q->mutex);
+    size_t pos;
+    MqCell* cell;
+    if (q == NULL || q->cells == NULL)
         return NULL;
-    }
-    void* p = q->head->data;
-    MUTEX_UNLOCK(&q->mutex);
-    return p;
+    pos = LOAD(&q->dequeue);
+    cell = &q->cells[pos & q->mask];
+    if (LOAD(&cell->seq) != pos + 1)
+        return NULL;
+    return cell->data;
+}
+
+void mq_pop(struct MsgQue* q)
+{
+    mq_pop_batch(q, NULL, 1);
 }
 
 int mq_size(struct MsgQue* q)
 {
-    MUTEX_LOCK(&q->mutex);
-    if (q != NULL) {
-        INode* i = q->head;
-        int s = 0;
-        while (i != NULL) {
-            i = i->next;
-            s++;
+    size_t tail;
+    size_t head;
+    if (q == NULL || q->cells == NULL)
+        return 0;
+    head = LOAD(&q->dequeue);
+    tail = LOAD(&q->enqueue);
+    return ((ptrdiff_t)(tail - head) > 0) ? (int)(tail - head) : 0;
+}
+
+int mq_wait(struct MsgQue* q, int timeout)
+{
+    int ready;
+#ifndef _WIN32
+    struct timespec ts;
+    if (timeout >= 0) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_sec += timeout / 1000;
+        ts.tv_nsec += (long)(timeout % 1000) * 1000000L;
+        if (ts.tv_nsec >= 1000000000L) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000L;
         }
-        MUTEX_UNLOCK(&q->mutex);
-        return s;
     }
+#endif
+    if (q == NULL || q->cells == NULL)
+        return 0;
+    if (mq_size(q) > 0)
+        return 1;
+    MUTEX_LOCK(&q->mutex);
+    ADD_INT(&q->waiters, 1);
+    FENCE();
+    while (!(ready = (mq_size(q) > 0))) {
+#ifdef _WIN32
+        if (!SleepConditionVariableCS(&q->cond, &q->mutex, timeout < 0 ? INFINITE : (DWORD)timeout))
+            break;
+#else
+        int rc = (timeout < 0) ? pthread_cond_wait(&q->cond, &q->mutex) :
+            pthread_cond_timedwait(&q->cond, &q->mutex, &ts);
+        if (rc == ETIMEDOUT)
+            break;
+#endif
+    }
+    ADD_INT(&q->waiters, -1);
     MUTEX_UNLOCK(&q->mutex);
-    return 0;
+    return ready ? 1 : mq_size(q) > 0;
 }
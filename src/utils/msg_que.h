@@ -1,31 +1,63 @@
 #ifndef MSG_QUE_H
 #define MSG_QUE_H
 
+#include <stddef.h>
 #ifdef _WIN32
 #include <Windows.h>
 #else
 #include <pthread.h>
 #endif
 
-typedef struct iNode {
+#define MQ_CACHE_LINE 64
+#define MQ_DEFAULT_CAPACITY 4096
+
+/*
+ * Bounded lock-free multi-producer/multi-consumer ring (Vyukov): every cell
+ * carries a sequence number telling producers and consumers whose turn it is.
+ * The mutex and condition are only used by mq_wait() sleepers.
+ *
+ * Unlike the linked list it replaced the queue has a fixed capacity, chosen
+ * at init: mq_init() takes MQ_DEFAULT_CAPACITY, mq_init_size() any other.
+ * A push into a full queue fails with -2 and leaves the item to the caller,
+ * which must retry, drop or otherwise account for it.
+ */
+typedef struct MqCell {
+    size_t seq;
     void* data;
-    struct iNode* next;
-} INode;
+} MqCell;
 
 typedef struct MsgQue {
-    INode* head;
-    INode* tail;
+    char pad0[MQ_CACHE_LINE];
+    size_t enqueue;
+    char pad1[MQ_CACHE_LINE - sizeof(size_t)];
+    size_t dequeue;
+    char pad2[MQ_CACHE_LINE - sizeof(size_t)];
+    MqCell* cells;
+    size_t mask;
+    int waiters;
 #ifdef _WIN32
     CRITICAL_SECTION mutex;
+    CONDITION_VARIABLE cond;
 #else
     pthread_mutex_t mutex;
+    pthread_cond_t cond;
 #endif
 } MsgQue;
 
-void mq_init(struct MsgQue* q);
-int mq_push(struct MsgQue* q, void* x);
+int mq_init(struct MsgQue* q);                        /* MQ_DEFAULT_CAPACITY cells, 0 or -2 */
+int mq_init_size(struct MsgQue* q, size_t capacity); /* capacity rounds up to a power of 2 */
+int mq_push(struct MsgQue* q, void* x);              /* 0, or -2 when full: check it */
+/*
+ * Deprecated, single consumer only: with two consumers the item mq_front()
+ * returned may be taken by the other before mq_pop(), which then drops the
+ * next one unseen. Use mq_take() or mq_pop_batch() instead.
+ */
 void* mq_front(struct MsgQue* q);
 void mq_pop(struct MsgQue* q);
+void* mq_take(struct MsgQue* q);                     /* front + pop in one step, NULL if empty */
+int mq_push_batch(struct MsgQue* q, void** x, int n); /* number pushed */
+int mq_pop_batch(struct MsgQue* q, void** x, int n);  /* number popped */
+int mq_wait(struct MsgQue* q, int timeout);           /* ms (<0 forever), 1 when not empty */
 int mq_size(struct MsgQue* q);
 void mq_deinit(struct MsgQue* q);
 
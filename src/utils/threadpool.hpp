@@ -2,18 +2,129 @@
 #ifndef THREADPOOL_HPP
 #define THREADPOOL_HPP
 
+#include <cstddef>
 #include <vector>
-#include <queue>
+#include <deque>
 #include <thread>
 #include <functional>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
 #include <future>
+#include <memory>
+#include <new>
 #include <stdexcept>
+#include <type_traits>
 
+/*
+ * Work-stealing pool: every worker owns a deque, takes its own tasks from the
+ * front and steals from the back of the others when idle. Tasks from outside
+ * the pool are spread round-robin; tasks from a worker stay on its deque.
+ * Closures up to task::INLINE_SIZE bytes are stored without heap allocation.
+ * The broker and clients do not run on it: subscriber callbacks stay on the
+ * subscribing thread to keep their order. It is a utility for applications,
+ * measured by utils_bench.
+ */
 class threadpool {
 public:
+    class task {
+    public:
+        static const size_t INLINE_SIZE = 64;
+
+        task() = default;
+        template<class F, class = typename std::enable_if<!std::is_same<typename std::decay<F>::type, task>::value>::type>
+        task(F&& f)
+        {
+            using T = typename std::decay<F>::type;
+            emplace<T>(std::forward<F>(f), std::integral_constant<bool, fits<T>()>());
+        }
+        task(task&& other) noexcept
+        {
+            take(other);
+        }
+        task& operator=(task&& other) noexcept
+        {
+            if (this != &other) {
+                reset();
+                take(other);
+            }
+            return *this;
+        }
+        task(const task&) = delete;
+        task& operator=(const task&) = delete;
+        ~task()
+        {
+            reset();
+        }
+
+        explicit operator bool() const
+        {
+            return m_ops != nullptr;
+        }
+        void operator()()
+        {
+            m_ops->call(&m_buf);
+        }
+
+    private:
+        struct Ops {
+            void (*call)(void*);
+            void (*move)(void*, void*); // move-construct into dst, destroy src
+            void (*destroy)(void*);
+        };
+        typedef typename std::aligned_storage<INLINE_SIZE, alignof(std::max_align_t)>::type Storage;
+
+        template<class T>
+        static constexpr bool fits()
+        {
+            return sizeof(T) <= sizeof(Storage) && alignof(T) <= alignof(Storage)
+                && std::is_nothrow_move_constructible<T>::value;
+        }
+
+        template<class T, class F>
+        void emplace(F&& f, std::true_type)
+        {
+            static const Ops ops = {
+                [](void* p) { (*static_cast<T*>(p))(); },
+                [](void* dst, void* src) {
+                    new(dst) T(std::move(*static_cast<T*>(src)));
+                    static_cast<T*>(src)->~T();
+                },
+                [](void* p) { static_cast<T*>(p)->~T(); },
+            };
+            new(&m_buf) T(std::forward<F>(f));
+            m_ops = &ops;
+        }
+        template<class T, class F>
+        void emplace(F&& f, std::false_type)
+        {
+            static const Ops ops = {
+                [](void* p) { (**static_cast<T**>(p))(); },
+                [](void* dst, void* src) { *static_cast<T**>(dst) = *static_cast<T**>(src); },
+                [](void* p) { delete *static_cast<T**>(p); },
+            };
+            *reinterpret_cast<T**>(&m_buf) = new T(std::forward<F>(f));
+            m_ops = &ops;
+        }
+
+        void take(task& other)
+        {
+            m_ops = other.m_ops;
+            if (m_ops != nullptr)
+                m_ops->move(&m_buf, &other.m_buf);
+            other.m_ops = nullptr;
+        }
+        void reset()
+        {
+            if (m_ops != nullptr)
+                m_ops->destroy(&m_buf);
+            m_ops = nullptr;
+        }
+
+        Storage m_buf;
+        const Ops* m_ops = nullptr;
+    };
+
     threadpool();
     ~threadpool();
 
@@ -23,50 +134,151 @@ public:
     template<class F, class... Args>
     std::future<typename std::result_of<F(Args...)>::type> enqueue(F&& f, Args&&... args);
 
+    // fire and forget, no future and no shared state
+    template<class F, class... Args>
+    void post(F&& f, Args&&... args);
+
     void start(size_t threads);
     void stop();
 
 private:
+    struct Queue {
+        std::mutex lock{};
+        std::deque<task> tasks{};
+    };
+    struct Local {
+        const threadpool* pool = nullptr;
+        size_t index = 0;
+    };
+    static Local& local()
+    {
+        static thread_local Local self;
+        return self;
+    }
+
+    void submit(task&& t);
+    bool pop(size_t index, task& t);
+    bool steal(size_t index, task& t);
+    void run(size_t index);
+
     std::vector<std::thread> m_workers = {};
-    std::queue<std::function<void()>> m_tasks = {};
+    std::unique_ptr<Queue[]> m_queues{};
+    size_t m_queueCount = 1;
+    std::atomic<size_t> m_active{ 0 };
+    std::atomic<size_t> m_next{ 0 };
+    std::atomic<size_t> m_pending{ 0 };
+    std::atomic<size_t> m_sleeping{ 0 };
     std::mutex m_queueMutex{};
     std::condition_variable m_condition{};
     std::atomic<bool> m_stopPool;
 };
 
-threadpool::threadpool() : m_stopPool(false) { }
+inline threadpool::threadpool() : m_stopPool(false)
+{
+    m_queueCount = std::max<size_t>(1, std::min<size_t>(64, std::thread::hardware_concurrency()));
+    m_queues.reset(new Queue[m_queueCount]);
+}
 
-threadpool::~threadpool() { }
+inline threadpool::~threadpool() { }
 
-void threadpool::start(size_t threads)
+inline void threadpool::start(size_t threads)
 {
+    std::unique_lock<std::mutex> lock(m_queueMutex);
+    if (!m_workers.empty())
+        return;
+    m_stopPool = false;
     for (size_t i = 0; i < threads; ++i) {
-        m_workers.emplace_back([this] {
-            for (;;) {
-                std::function<void()> task;
-                {
-                    std::unique_lock<std::mutex> lock(this->m_queueMutex);
-                    this->m_condition.wait(lock, [this] { return this->m_stopPool || !this->m_tasks.empty(); });
-                    if (this->m_stopPool && this->m_tasks.empty()) {
-                        return;
-                    }
-                    task = std::move(this->m_tasks.front());
-                    this->m_tasks.pop();
-                }
-                task();
-            }
-            });
+        m_workers.emplace_back(&threadpool::run, this, i);
     }
+    m_active = threads;
 }
 
-template<class F>
-void threadpool::enqueue(F&& f)
+inline void threadpool::run(size_t index)
 {
-    {
+    Local& self = local();
+    self.pool = this;
+    self.index = index % m_queueCount;
+    for (;;) {
+        task t;
+        if (pop(self.index, t) || steal(self.index, t)) {
+            m_pending--;
+            t();
+            continue;
+        }
         std::unique_lock<std::mutex> lock(m_queueMutex);
-        m_tasks.emplace(std::forward<F>(f));
+        m_sleeping++;
+        m_condition.wait(lock, [this] { return m_pending.load() > 0 || m_stopPool; });
+        m_sleeping--;
+        if (m_stopPool && m_pending.load() == 0) {
+            return;
+        }
+    }
+}
+
+inline bool threadpool::pop(size_t index, task& t)
+{
+    Queue& queue = m_queues[index];
+    std::lock_guard<std::mutex> lock(queue.lock);
+    if (queue.tasks.empty())
+        return false;
+    t = std::move(queue.tasks.front());
+    queue.tasks.pop_front();
+    return true;
+}
+
+inline bool threadpool::steal(size_t index, task& t)
+{
+    for (size_t i = 1; i < m_queueCount; ++i) {
+        Queue& queue = m_queues[(index + i) % m_queueCount];
+        std::unique_lock<std::mutex> lock(queue.lock, std::try_to_lock);
+        if (!lock.owns_lock() || queue.tasks.empty())
+            continue;
+        t = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+    // a busy victim was skipped above, take the slow path once before sleeping
+    for (size_t i = 1; i < m_queueCount; ++i) {
+        Queue& queue = m_queues[(index + i) % m_queueCount];
+        std::lock_guard<std::mutex> lock(queue.lock);
+        if (queue.tasks.empty())
+            continue;
+        t = std::move(queue.tasks.back());
+        queue.tasks.pop_back();
+        return true;
+    }
+    return false;
+}
+
+inline void threadpool::submit(task&& t)
+{
+    Local& self = local();
+    size_t index;
+    if (self.pool == this) {
+        index = self.index;
+    } else {
+        size_t active = std::min(m_queueCount, std::max<size_t>(1, m_active.load(std::memory_order_relaxed)));
+        index = m_next.fetch_add(1, std::memory_order_relaxed) % active;
+    }
+    // counted before it is visible so that a worker never takes it uncounted
+    m_pending++;
+    {
+        Queue& queue = m_queues[index];
+        std::lock_guard<std::mutex> lock(queue.lock);
+        queue.tasks.emplace_back(std::move(t));
+    }
+    // pairs with m_sleeping++ under m_queueMutex: a sleeper either sees the
+    // task or is seen here
+    if (m_sleeping.load() > 0) {
+        std::lock_guard<std::mutex> lock(m_queueMutex);
+        m_condition.notify_one();
     }
-    m_condition.notify_one();
+}
+
+template<class F>
+void threadpool::enqueue(F&& f)
+{
+    submit(task(std::forward<F>(f)));
 }
 
 template<class F, class... Args>
@@ -74,33 +286,39 @@ auto threadpool::enqueue(F&& f, Args&&... args)
 -> std::future<typename std::result_of<F(Args...)>::type>
 {
     using return_type = typename std::result_of<F(Args...)>::type;
-    auto task = std::make_shared< std::packaged_task<return_type()> >(
-        std::bind(std::forward<F>(f), std::forward<Args>(args)...)
-    );
-    std::future<return_type> fres = task->get_future();
-    {
-        std::unique_lock<std::mutex> lock(m_queueMutex);
+    std::packaged_task<return_type()> job(std::bind(std::forward<F>(f), std::forward<Args>(args)...));
+    std::future<return_type> fres = job.get_future();
 
-        // don't allow enqueueing after stopping the pool
-        if (m_stopPool)
-            throw std::runtime_error("enqueue on stopped ThreadPool");
+    // don't allow enqueueing after stopping the pool
+    if (m_stopPool)
+        throw std::runtime_error("enqueue on stopped ThreadPool");
 
-        m_tasks.emplace([task]() { (*task)(); });
-    }
-    m_condition.notify_one();
+    submit(task(std::move(job)));
     return fres;
 }
 
-void threadpool::stop()
+template<class F, class... Args>
+void threadpool::post(F&& f, Args&&... args)
+{
+    if (m_stopPool)
+        throw std::runtime_error("post on stopped ThreadPool");
+    submit(task(std::bind(std::forward<F>(f), std::forward<Args>(args)...)));
+}
+
+inline void threadpool::stop()
 {
+    std::vector<std::thread> workers;
     {
         std::unique_lock<std::mutex> lock(m_queueMutex);
         m_stopPool = true;
+        workers.swap(m_workers);
     }
     m_condition.notify_all();
-    for (std::thread& worker : m_workers) {
-        worker.join();
+    for (std::thread& worker : workers) {
+        if (worker.joinable())
+            worker.join();
     }
+    m_active = 0;
 }
 
 #endif // THREADPOOL_HPP
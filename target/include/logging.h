@@ -0,0 +1,183 @@
+#ifndef SCADUP_LOGGING_H
+#define SCADUP_LOGGING_H
+
+#include <stdio.h>
+#include <time.h>
+#include <stdarg.h>
+#include <string.h>
+#ifdef _WIN32
+inline const char* basename(const char* name)
+{
+    const char* base = name;
+    for (const char* ptr = name; *ptr; ++ptr) {
+        if (*ptr == '/' || *ptr == '\\') base = ptr + 1;
+    }
+    return base;
+}
+#else
+#include <libgen.h>
+//#pragma GCC diagnostic ignored "-Wwritable-strings"
+#pragma GCC diagnostic ignored "-Wformat"
+#endif
+
+// levels, the ones below LOGGING_MIN are compiled out (-DLOGGING_MIN=LOGGING_WARN)
+#define LOGGING_INFO 1
+#define LOGGING_WARN 2
+#define LOGGING_ERROR 3
+#define LOGGING_NONE 4
+#ifndef LOGGING_MIN
+#define LOGGING_MIN LOGGING_INFO
+#endif
+#define _LOG_NONE_(fmt, ...) do { } while (0)
+
+#ifdef __ANDROID__
+#include <android/log.h>
+#ifdef __cplusplus
+#define _LOG_(level, fmt, ...) __android_log_print(level, LOG_TAG,"(%s:%d)[%s]: " fmt, basename(const_cast<char*>(__FILE__)), __LINE__, __FUNCTION__, ##__VA_ARGS__)
+#else
+#define _LOG_(level, fmt, ...) __android_log_print(level, LOG_TAG,"(%s:%d)[%s]: " fmt, basename(__FILE__), __LINE__, __FUNCTION__, ##__VA_ARGS__)
+#endif
+#define LOGD(fmt, ...) _LOG_(ANDROID_LOG_DEBUG, fmt, ##__VA_ARGS__)
+#if LOGGING_MIN <= LOGGING_INFO
+#define LOGI(fmt, ...) _LOG_(ANDROID_LOG_INFO, fmt, ##__VA_ARGS__)
+#else
+#define LOGI _LOG_NONE_
+#endif
+#if LOGGING_MIN <= LOGGING_WARN
+#define LOGW(fmt, ...) _LOG_(ANDROID_LOG_WARN, fmt, ##__VA_ARGS__)
+#else
+#define LOGW _LOG_NONE_
+#endif
+#if LOGGING_MIN <= LOGGING_ERROR
+#define LOGE(fmt, ...) _LOG_(ANDROID_LOG_ERROR, fmt, ##__VA_ARGS__)
+#else
+#define LOGE _LOG_NONE_
+#endif
+#else
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <type_traits>
+
+/*
+ * Asynchronous logging: a LOG* call only copies its arguments (strings
+ * included, at most STRING_MAX bytes each) and a steady clock stamp into a
+ * lock-free buffer of the calling thread. A background thread formats the
+ * records of all threads in stamp order, printf-compatible, with the date
+ * redone once a second, and writes them to stdout in one go. A full buffer
+ * drops the record at any level, never waits: the writer reports the count
+ * with its next batch. WARN and ERROR wake the writer at once. What is
+ * staged is written at exit, or on flush().
+ */
+namespace Logging {
+    enum Level {
+        LEVEL_INFO = LOGGING_INFO,
+        LEVEL_WARN = LOGGING_WARN,
+        LEVEL_ERROR = LOGGING_ERROR,
+        LEVEL_NONE = LOGGING_NONE
+    };
+    const size_t STRING_MAX = 4096;
+    // where a LOG* call is, one per call in static storage
+    struct Site {
+        bool time; // false with NOTIME
+        const char* level;
+        const char* module; // nullptr with NOLOCATE
+        const char* file;
+        int line;
+        const char* function;
+        const char* format;
+    };
+    // one argument as staged, its type widened
+    struct Arg {
+        enum Kind : uint8_t {
+            SIGNED,
+            UNSIGNED,
+            REAL,
+            STRING,
+            POINTER
+        };
+        Kind kind;
+        union {
+            long long i;
+            unsigned long long u;
+            double d;
+            const void* p;
+            const char* s;
+        };
+        Arg() : kind(POINTER), p(nullptr) { }
+        Arg(bool v) : kind(UNSIGNED), u(v) { }
+        Arg(char v) : kind(SIGNED), i(v) { }
+        Arg(signed char v) : kind(SIGNED), i(v) { }
+        Arg(unsigned char v) : kind(UNSIGNED), u(v) { }
+        Arg(short v) : kind(SIGNED), i(v) { }
+        Arg(unsigned short v) : kind(UNSIGNED), u(v) { }
+        Arg(int v) : kind(SIGNED), i(v) { }
+        Arg(unsigned int v) : kind(UNSIGNED), u(v) { }
+        Arg(long v) : kind(SIGNED), i(v) { }
+        Arg(unsigned long v) : kind(UNSIGNED), u(v) { }
+        Arg(long long v) : kind(SIGNED), i(v) { }
+        Arg(unsigned long long v) : kind(UNSIGNED), u(v) { }
+        Arg(float v) : kind(REAL), d(v) { }
+        Arg(double v) : kind(REAL), d(v) { }
+        Arg(long double v) : kind(REAL), d(static_cast<double>(v)) { }
+        Arg(const char* v) : kind(STRING), s(v) { }
+        Arg(char* v) : kind(STRING), s(v) { }
+        Arg(const std::string& v) : kind(STRING), s(v.c_str()) { }
+        Arg(std::nullptr_t) : kind(POINTER), p(nullptr) { }
+        template<typename T>
+        Arg(T* v) : kind(POINTER), p(v) { }
+        template<typename T, typename std::enable_if<std::is_enum<T>::value, int>::type = 0>
+        Arg(T v) : kind(SIGNED), i(static_cast<long long>(v)) { }
+    };
+
+    extern std::atomic<int> g_level;
+    inline bool enabled(Level level)
+    {
+        return level >= g_level.load(std::memory_order_relaxed);
+    }
+    void setLevel(Level); // records below it are skipped at run time
+    Level level();
+    void flush(); // until everything staged so far is written
+    void stage(Level, const Site&, const Arg*, size_t);
+
+    template<typename... Args>
+    inline void log(Level level, const Site& site, Args... args)
+    {
+        const Arg list[sizeof...(Args) + 1] = { Arg(args)... };
+        stage(level, site, list, sizeof...(Args));
+    }
+}
+
+#ifdef NOTIME
+#define TIME_SITE false
+#else
+#define TIME_SITE true
+#endif //NOTIME
+#ifdef NOLOCATE
+#define LOCATE_SITE(_module) nullptr, nullptr, 0, nullptr
+#else
+#define LOCATE_SITE(_module) _module, __FILE__, __LINE__, __FUNCTION__
+#endif //NOLOCATE
+#define _LOG_(lvl, name, fmt, ...) do { \
+        if (Logging::enabled(Logging::lvl)) { \
+            static const Logging::Site _site_ = { TIME_SITE, name, LOCATE_SITE(LOG_TAG), fmt }; \
+            Logging::log(Logging::lvl, _site_, ##__VA_ARGS__); \
+        } \
+    } while (0)
+#if LOGGING_MIN <= LOGGING_INFO
+#define LOGI(fmt, ...) _LOG_(LEVEL_INFO, "INFO", fmt, ##__VA_ARGS__)
+#else
+#define LOGI _LOG_NONE_
+#endif
+#if LOGGING_MIN <= LOGGING_WARN
+#define LOGW(fmt, ...) _LOG_(LEVEL_WARN, "WARN", fmt, ##__VA_ARGS__)
+#else
+#define LOGW _LOG_NONE_
+#endif
+#if LOGGING_MIN <= LOGGING_ERROR
+#define LOGE(fmt, ...) _LOG_(LEVEL_ERROR, "ERROR", fmt, ##__VA_ARGS__)
+#else
+#define LOGE _LOG_NONE_
+#endif
+#endif //ANDROID
+#endif //SCADUP_LOGGING_H
@@ -0,0 +1,475 @@
+#pragma once
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#ifdef _WIN32
+#define _WIN32_WINNT 0x0600
+#include <Ws2tcpip.h>
+#include <Windows.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#endif
+#ifdef _WIN32
+#define  __attribute__(x)
+#define MSG_NOSIGNAL 0
+inline void Close(SOCKET x)
+{
+#ifdef _MSC_VER
+    ::closesocket(x);
+#else
+    ::close(x);
+#endif
+    WSACleanup();
+}
+#ifdef _MSC_VER
+typedef int ssize_t;
+#endif
+#else
+using SOCKET = int;
+#define Close ::close
+#endif
+const unsigned int Time100ms = 100;
+inline ssize_t Write(SOCKET sock, const void* data, size_t len)
+{
+    return ::send(sock, static_cast<const char*>(data), len, MSG_NOSIGNAL);
+}
+template<typename T>
+inline void DelArr(T*& arr)
+{
+    if (arr) {
+        delete[] arr;
+        arr = nullptr;
+    }
+}
+
+template<typename T>
+inline void DelPtr(T*& p)
+{
+    if (p) {
+        delete p;
+        p = nullptr;
+    }
+}
+
+inline void wait(unsigned int tms)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(tms));
+}
+
+class ShmRing;
+
+namespace Scadup {
+    enum G_ScaFlag {
+        NONE = 0,
+        BROKER,
+        PUBLISHER,
+        SUBSCRIBER,
+        MAX_VAL
+    };
+    struct Header {
+        uint8_t rsvp;
+        uint8_t cmd;
+        G_ScaFlag flag;
+        uint32_t size;
+        uint32_t topic;
+        volatile uint64_t ssid; // ssid = (port | key | ip)
+    } __attribute__((aligned(4)));
+    struct Message {
+        Header head{};
+        struct Payload {
+            char status[8];
+            char* content = nullptr;
+        } __attribute__((aligned(4))) payload {};
+    } __attribute__((aligned(4)));
+    enum G_StartFrom {
+        START_LIVE = 0, // legacy, no position announced
+        START_EARLIEST,
+        START_LATEST,
+        START_SEQUENCE,
+        START_TIME // ns since epoch
+    };
+    const uint8_t RETAIN = 0x01; // Header::rsvp of a publish, kept as the topic's last value
+    const uint8_t CHECKED = 0x02; // Header::rsvp of a publish, status[4..7] holds the CRC32C of the content
+    const uint8_t TRACED = 0x04; // Header::rsvp of a publish, the stamps of its hops follow the content's NUL
+    const uint8_t MARKED = 0x08; // Header::rsvp of a publish too large for the ring, its publisher marked it there
+    enum G_GroupKind {
+        GROUP_FRAME = 0,
+        GROUP_FETCH, // too large for a datagram, fetch it over TCP
+        GROUP_BEAT // nothing published since, seq is the next one
+    };
+    // precedes the frame in every datagram of a multicast topic, see Wire::encodeGroup
+    struct GroupHead {
+        uint64_t seq;
+        uint32_t topic;
+        uint32_t kind;
+    };
+    enum G_QuePolicy {
+        DROP_OLDEST = 0,
+        DROP_NEWEST,
+        DISCONNECT
+    };
+    struct Network {
+        SOCKET socket = 0;
+        Header head;
+        char IP[INET_ADDRSTRLEN];
+        unsigned short PORT = 0;
+        unsigned int worker = 0;
+        volatile bool active = false;
+    };
+    struct QueueDepth {
+        char IP[INET_ADDRSTRLEN];
+        unsigned short PORT;
+        uint32_t topic;
+        size_t messages;
+        size_t bytes;
+        size_t dropped;
+    };
+    enum G_CloseReason {
+        CLOSE_QUIT = 0, // the client said so
+        CLOSE_PEER, // closed by the peer
+        CLOSE_RECV, // recv or the socket failed
+        CLOSE_SEND,
+        CLOSE_PROTOCOL, // malformed or invalid frame
+        CLOSE_HANDSHAKE, // refused or not in time
+        CLOSE_IDLE,
+        CLOSE_QUEUE, // queue limit with DISCONNECT
+        CLOSE_RESOURCE, // allocation failed
+        CLOSE_SHUTDOWN,
+        CLOSE_REASONS
+    };
+    struct TopicMetrics {
+        uint32_t topic;
+        uint64_t messagesIn; // published
+        uint64_t bytesIn;
+        uint64_t messagesOut; // queued to TCP subscribers
+        uint64_t bytesOut;
+    };
+    struct LatencyMetrics { // ns
+        uint64_t count;
+        uint64_t p50;
+        uint64_t p90;
+        uint64_t p99;
+        uint64_t p999;
+        uint64_t max;
+    };
+    struct BrokerMetrics {
+        uint64_t accepts = 0;
+        uint64_t closes[CLOSE_REASONS] = {}; // by G_CloseReason, handshake failures included
+        uint64_t untracked = 0; // publishes of topics beyond the per thread table
+        std::vector<TopicMetrics> topics{};
+        std::vector<QueueDepth> queues{};
+        LatencyMetrics latency{}; // publish read to handed to a subscriber's socket
+    };
+    struct PoolStats {
+        size_t hits;
+        size_t refills;
+        size_t misses;
+        size_t oversize;
+        size_t slabBytes;
+        size_t hugeBytes;
+    };
+    struct LogPolicy {
+        size_t segmentBytes = 64 * 1024 * 1024; // preallocated size of a segment file
+        size_t indexInterval = 4096; // bytes between sparse index entries
+        size_t flushMessages = 1024; // fdatasync once this many are unsynced, 0 off
+        unsigned int flushInterval = 100; // ms between fdatasync of dirty topics, 0 off
+    };
+    const size_t HEAD_SIZE = sizeof(Header);
+    const uint8_t WIRE_VERSION = 2; // highest protocol version spoken, 1 is the Header layout above
+    const unsigned int HEARTBEAT_INTERVAL = 1000; // ms a client may stay silent
+    // steady clock ns (CLOCK_MONOTONIC, one clock for the processes of a host)
+    // a traced publish passed each hop at, 0 for a hop it did not take
+    struct Trace {
+        uint64_t publish; // Publisher::publish called
+        uint64_t receive; // read whole by the broker
+        uint64_t enqueue; // queued for this subscriber
+        uint64_t send; // handed to the subscriber's socket
+        uint64_t arrive; // read by the subscriber
+        uint64_t callback; // its callback started
+    };
+    // a received message without copies: status and content point into the
+    // refcounted receive buffer, valid until the callback returns, or while
+    // a copy of the view is kept and not yet released
+    class MessageView {
+    public:
+        MessageView() = default;
+        MessageView(const MessageView&);
+        MessageView& operator=(const MessageView&);
+        ~MessageView();
+        const Header& head() const
+        {
+            return m_head;
+        }
+        const char* status() const
+        {
+            return m_status;
+        }
+        const char* data() const // NUL terminated
+        {
+            return m_data;
+        }
+        size_t size() const
+        {
+            return m_size;
+        }
+        uint64_t seq() const // topic sequence, when subscribed with setStart()
+        {
+            return m_seq;
+        }
+        const Trace* trace() const // nullptr unless published with setTrace()
+        {
+            return (m_trace.publish != 0) ? &m_trace : nullptr;
+        }
+        explicit operator bool() const
+        {
+            return m_buffer != nullptr;
+        }
+        void release();
+    private:
+        friend class Subscriber;
+        Header m_head{};
+        const char* m_status = nullptr;
+        const char* m_data = nullptr;
+        size_t m_size = 0;
+        uint64_t m_seq = 0;
+        Trace m_trace{};
+        void* m_buffer = nullptr;
+    };
+    // per stage latencies of traced messages, added by one thread (the
+    // subscriber's callback) and read by it; a stage is counted when both
+    // of its hops were stamped
+    class TraceStats {
+    public:
+        enum Stage {
+            STAGE_PUBLISHER = 0, // publish to broker read: the publisher's queue, the network
+            STAGE_BROKER, // read to queued: routing, the hand over between workers
+            STAGE_QUEUE, // queued to sent: the subscriber's backlog
+            STAGE_NETWORK, // sent to read by the subscriber
+            STAGE_DISPATCH, // read to the callback
+            STAGE_TOTAL, // publish to the callback
+            STAGES
+        };
+        TraceStats();
+        void add(const Trace&);
+        LatencyMetrics stage(Stage) const; // ns
+        std::string report() const; // a line per stage, us
+        void clear();
+    private:
+        std::vector<uint64_t> m_buckets{};
+        uint64_t m_max[STAGES]{};
+    };
+    typedef void(*RECV_CALLBACK)(const Message&);
+    typedef std::function<void(const MessageView&)> VIEW_CALLBACK;
+    typedef std::map<G_ScaFlag, std::vector<Network>> Networks;
+    extern bool makeSocket(SOCKET& socket, int family = AF_INET);
+    // ip is an IPv4 address, or the path of the broker's unix socket if it contains a '/';
+    // with version given, the highest one both ends speak is agreed on for a client of flag
+    extern SOCKET socket2Broker(const char* ip, unsigned short port, uint64_t& ssid, uint32_t timeout,
+        G_ScaFlag flag = NONE, uint8_t* version = nullptr);
+    extern int connect(const char* ip, unsigned short port, unsigned int total);
+    extern ssize_t writes(SOCKET socket, const uint8_t* data, size_t len);
+    extern bool localPeer(SOCKET socket); // the other end runs on this host
+    extern void abandon(void);
+    extern PoolStats poolStats();
+    extern void setPoolHugePages(bool enable);
+}
+
+namespace Scadup {
+    class Frame;
+    class Metrics;
+    class Broker {
+    public:
+        static Broker& instance();
+        int setup(unsigned short = 9999, unsigned int = 1);
+        int broker();
+        void setZeroCopy(size_t);
+        void setUnixSocket(const char*); // path of a unix socket listened besides TCP, before setup
+        void setQueueLimit(size_t, size_t, G_QuePolicy = DISCONNECT);
+        void setIdleTimeout(unsigned int); // ms without any frame, 0 never
+        int setDurable(const char*, const LogPolicy& = LogPolicy()); // per topic log under dir
+        void setHistory(size_t); // messages per topic kept in memory for replay when not durable
+        void setRetainLimit(size_t); // bytes of retained last values, least recently used evicted
+        void setSharedMemory(size_t); // ring bytes per topic for clients on this host, 0 TCP only
+        // sends the topic once to group:port out of the interface (address), before setup
+        int setMulticast(uint32_t, const char*, unsigned short, const char* = nullptr);
+        void setWireVersion(uint8_t); // highest protocol version offered to clients, 1 keeps all on v1
+        void setVerify(bool); // check the CRC32C of publishes carrying one and drop the corrupt
+        void setMetrics(unsigned short); // serves metrics() as text on 127.0.0.1:port, before setup
+        std::vector<QueueDepth> queueDepth();
+        BrokerMetrics metrics(); // counted since setup, read without stalling the workers
+        void exit(); // stops broker(), or releases what setup() made if it never ran
+    private:
+        struct Session;
+        struct Worker;
+        struct Route;
+        struct RouteTable;
+        struct Backlog;
+        struct Journal;
+        struct History;
+        struct Retained;
+        struct Shared;
+        struct Multicast;
+        int ProxyTask(Networks&, Worker&, Frame*);
+        void route(Worker*, Frame*);
+        void deliver(Worker&, Frame*);
+        uint64_t addRoute(uint32_t, Session*);
+        void removeRoute(uint32_t, Session*);
+        const std::vector<Route>* lookup(Worker&, uint32_t);
+        void onTimer(Session*);
+        History* history(Worker*, uint32_t);
+        int64_t record(History&, Frame*);
+        void subscribeFrom(Session*, Frame*);
+        bool subscribeLive(Session*);
+        void offerRing(Session*);
+        Shared* shared(Worker*, uint32_t, bool);
+        void bridge(Shared*);
+        Multicast* group(uint32_t);
+        void resend(Session*, Frame*);
+        void beat(Worker&);
+        bool pump(Session*);
+        void drain(Worker&);
+        void flusher();
+        void setOffline(Networks&, SOCKET);
+        uint64_t setSession(const std::string&, unsigned short, SOCKET = 0);
+        bool checkSsid(SOCKET, uint64_t);
+        void taskAllot(Networks&, Session*);
+        void loop(Worker&);
+        void onAccept(Worker&, SOCKET);
+        void onReadable(Session*);
+        bool readCompact(Session*);
+        void onHeader(Session*);
+        void onMessage(Session*);
+        void startBody(Session*, bool);
+        bool enqueue(Session*, Frame*);
+        bool flush(Session*);
+        void advance(Session*, size_t);
+        bool reap(Session*);
+        void closeSession(Session*, G_CloseReason);
+        void serveMetrics();
+        void release();
+    private:
+        std::mutex m_lock = {};
+        Networks m_networks{};
+        std::shared_ptr<Metrics> m_metrics{};
+        std::thread m_metricsThread{};
+        SOCKET m_metricsSocket = -1;
+        unsigned short m_metricsPort = 0;
+        std::vector<Worker*> m_workers{};
+        std::mutex m_routeLock = {};
+        std::shared_ptr<const RouteTable> m_routes{};
+        std::atomic<uint64_t> m_version{ 0 };
+        std::mutex m_backlogLock = {};
+        std::vector<std::shared_ptr<Backlog>> m_backlogs{};
+        std::shared_ptr<Journal> m_journal{};
+        std::mutex m_historyLock = {};
+        std::map<uint32_t, std::shared_ptr<History>> m_histories{};
+        size_t m_historySize = 0;
+        std::shared_ptr<Retained> m_retained{};
+        size_t m_retainLimit = 16 * 1024 * 1024;
+        std::mutex m_sharedLock = {};
+        std::map<uint32_t, std::shared_ptr<Shared>> m_shared{};
+        std::atomic<uint64_t> m_sharedVersion{ 0 };
+#ifdef __linux__
+        size_t m_sharedBytes = 4 * 1024 * 1024;
+#else
+        size_t m_sharedBytes = 0;
+#endif
+        struct {
+            size_t messages = 0;
+            size_t bytes = 64 * 1024 * 1024;
+            G_QuePolicy policy = DISCONNECT;
+        } m_queue;
+        std::map<uint32_t, std::shared_ptr<Multicast>> m_multicast{};
+        size_t m_zeroCopy = 0;
+        std::string m_unixPath{};
+        SOCKET m_unixSocket = -1;
+        unsigned int m_idleTimeout = 30000;
+        uint8_t m_wireVersion = WIRE_VERSION;
+        bool m_verify = false;
+        bool m_active = false;
+        bool m_looping = false; // broker() runs, under m_lock
+    };
+}
+
+namespace Scadup {
+    class Publisher {
+    public:
+        Publisher() = default;
+        ~Publisher();
+        int setup(const char*, unsigned short = 9999); // ip and port, or a unix socket path
+        int publish(uint32_t, const std::string&, ...);
+        int retain(uint32_t, const std::string&); // publish, delivered to later subscribers too
+        void setChecksum(bool); // a CRC32C with every later publish, checked by subscribers
+        void setTrace(bool); // stamps every later publish at each hop, see MessageView::trace()
+        void close();
+    private:
+        int post(uint32_t, const std::string&, uint8_t);
+        ShmRing* ring(uint32_t);
+        void transmit();
+    private:
+        std::mutex m_lock{};
+        std::condition_variable m_cond{};
+        std::string m_pending{};
+        std::thread m_sender{};
+        bool m_running = false;
+        SOCKET m_socket = -1;
+        uint64_t m_ssid = 0;
+        std::mutex m_ringLock{};
+        std::map<uint32_t, std::shared_ptr<ShmRing>> m_rings{}; // nullptr: the topic goes over TCP
+        bool m_local = false;
+        bool m_checksum = false;
+        bool m_trace = false;
+        uint8_t m_version = 1;
+    };
+}
+
+namespace Scadup {
+    class Subscriber {
+    public:
+        Subscriber() = default;
+        ~Subscriber();
+        int setup(const char*, unsigned short = 9999); // ip and port, or a unix socket path
+        // blocks until quit(); callbacks run on this thread, in order, while
+        // a thread of its own sends the heartbeats
+        ssize_t subscribe(uint32_t, RECV_CALLBACK = nullptr);
+        ssize_t subscribe(uint32_t, const VIEW_CALLBACK&);
+        void setStart(G_StartFrom, uint64_t = 0); // replay before live, needs broker history
+        uint64_t position() const; // sequence of the next message, to resume from
+        void quit();
+        static void exit();
+    private:
+        ssize_t receive(uint32_t, RECV_CALLBACK, const VIEW_CALLBACK*);
+        void beat();
+        void stopBeat();
+        bool keepAlive();
+    private:
+        static bool m_exit;
+        std::mutex m_lock{}; // sends on the session, m_beating
+        std::condition_variable m_cond{};
+        std::thread m_beater{};
+        bool m_beating = false;
+        std::atomic<bool> m_lost{ false }; // a heartbeat failed, the session is shut down
+        uint64_t m_ssid = 0;
+        SOCKET m_socket = -1;
+        uint8_t m_version = 1;
+        std::shared_ptr<ShmRing> m_ring{};
+        G_StartFrom m_from = START_LIVE;
+        uint64_t m_start = 0;
+        uint64_t m_position = 0;
+    };
+}
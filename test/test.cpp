@@ -32,10 +32,32 @@ int main(int argc, char* argv[])
     }
     string IP = "";
     unsigned short PORT = 0;
+    unsigned int WORKERS = 1;
+    string DURABLE = "";
+    string UNIX = "";
+    string MULTICAST = "";
+    string LOGLEVEL = "";
+    unsigned short METRICS = 0;
     string content = FileUtils::instance()->getStrFile2string("scadup.cfg");
     if (!content.empty()) {
         IP = FileUtils::instance()->getVariable(content, "IP");
         PORT = atoi(FileUtils::instance()->getVariable(content, "PORT").c_str());
+        string workers = FileUtils::instance()->getVariable(content, "WORKERS");
+        if (!workers.empty()) {
+            WORKERS = atoi(workers.c_str());
+        }
+        DURABLE = FileUtils::instance()->getVariable(content, "DURABLE");
+        UNIX = FileUtils::instance()->getVariable(content, "UNIX");
+        MULTICAST = FileUtils::instance()->getVariable(content, "MULTICAST");
+        LOGLEVEL = FileUtils::instance()->getVariable(content, "LOGLEVEL");
+        METRICS = atoi(FileUtils::instance()->getVariable(content, "METRICS").c_str());
+    }
+    if (LOGLEVEL == "WARN") {
+        Logging::setLevel(Logging::LEVEL_WARN);
+    } else if (LOGLEVEL == "ERROR") {
+        Logging::setLevel(Logging::LEVEL_ERROR);
+    } else if (LOGLEVEL == "NONE") {
+        Logging::setLevel(Logging::LEVEL_NONE);
     }
     if (IP.empty()) {
         IP = "127.0.0.1";
@@ -57,17 +79,31 @@ int main(int argc, char* argv[])
     int state = 0;
     switch (flag) {
     case BROKER:
-        state = broker.setup(PORT);
+        if (!DURABLE.empty() && broker.setDurable(DURABLE.c_str()) != 0)
+            cout << "DURABLE directory '" << DURABLE << "' unusable, messages are not kept." << endl;
+        if (!UNIX.empty())
+            broker.setUnixSocket(UNIX.c_str());
+        if (!MULTICAST.empty()) {
+            // group:port of the topic, sent out of the interface of IP
+            size_t colon = MULTICAST.find(':');
+            string group = MULTICAST.substr(0, colon);
+            unsigned short port = (colon != string::npos) ? atoi(MULTICAST.substr(colon + 1).c_str()) : 30001;
+            if (broker.setMulticast(topic, group.c_str(), port, IP.c_str()) != 0)
+                cout << "MULTICAST '" << MULTICAST << "' invalid, topic sent over TCP." << endl;
+            broker.setSharedMemory(0); // clients on this host would read shared memory instead
+        }
+        broker.setMetrics(METRICS);
+        state = broker.setup(PORT, WORKERS);
         if (state == 0)
             state = broker.broker();
         break;
     case SUBSCRIBER:
-        state = subscriber.setup(IP.c_str(), PORT);
+        state = subscriber.setup(UNIX.empty() ? IP.c_str() : UNIX.c_str(), PORT);
         if (state == 0)
             state = subscriber.subscribe(topic);
         break;
     case PUBLISHER:
-        state = publisher.setup(IP.c_str(), PORT);
+        state = publisher.setup(UNIX.empty() ? IP.c_str() : UNIX.c_str(), PORT);
         if (state < 0) break;
         if (argc > 4 && string(argv[3]) == "-f") {
             message = argv[4];